@@ -0,0 +1,903 @@
+/*
+ * Write-back buffer cache for file system blocks.
+ *
+ * Sits between fs.c and the device code in block.c (USB) or
+ * block_sim.c (image_sim file). Buffers are found through a small
+ * hash table on the block number and replaced in LRU order. Writes
+ * only mark a buffer dirty; it reaches the device when it is evicted
+ * or when block_flush() is called.
+ *
+ * Once a journal is opened, blocks changed through block_write() and
+ * block_modify() are metadata: before they are written in place they
+ * are logged to the journal and a commit record is written, so a crash
+ * leaves either all or none of a transaction's blocks. The *_data
+ * variants are for file contents, which are written in place first.
+ * Changed metadata stays in the cache until the file system commits
+ * it with block_flush(), at the end of an operation; it is never
+ * evicted, so the file system keeps a transaction within
+ * journal_room().
+ *
+ * File data that has no disk block yet can be held in a buffer under
+ * a tag (block_delay_*), until the file system allocates its block.
+ *
+ * Processes trap into the file system concurrently, so every exported
+ * function holds bcache_lock while it runs, device transfers included.
+ * It is the innermost file system lock: nothing else is taken under
+ * it. Buffers handed in by the file system are kernel memory or user
+ * pages it has pinned, so a copy never page faults with it held.
+ */
+
+#ifdef LINUX_SIM
+#include <assert.h>
+#endif /* LINUX_SIM */
+
+#include "bcache.h"
+#include "block.h"
+#include "common.h"
+#include "thread.h"
+#include "util.h"
+
+#ifndef LINUX_SIM
+#include "memory.h"
+#endif /* !LINUX_SIM */
+
+#define BCACHE_HASH(b) ((b) & (BCACHE_HASH_SIZE - 1))
+
+struct bcache_buf {
+	int block_num; /* -1 if the buffer is unused */
+	char dirty;
+	char journal;  /* JOURNAL_XXX state of a dirty buffer */
+	struct bcache_buf *hash_next;
+	struct bcache_buf *lru_prev; /* towards most recently used */
+	struct bcache_buf *lru_next; /* towards least recently used */
+	char data[BLOCK_SIZE];
+};
+
+/*
+ * The kernel keeps the buffers and range_buf in their own identity
+ * mapped area (memory.h); the simulator just uses static arrays.
+ */
+#ifdef LINUX_SIM
+static struct bcache_buf buffer_mem[BCACHE_ENTRIES];
+static char range_mem[BCACHE_RA_MAX * BLOCK_SIZE];
+#endif /* LINUX_SIM */
+
+static struct bcache_buf *buffers;
+static struct bcache_buf *hash_table[BCACHE_HASH_SIZE];
+static struct bcache_buf *lru_head; /* most recently used */
+static struct bcache_buf *lru_tail; /* least recently used */
+static bcache_stats_t stats;
+static lock_t bcache_lock;
+
+/* Staging area for multi-block transfers done by the cache itself */
+static char *range_buf;
+
+/* Journal states of a buffer */
+enum {
+	JOURNAL_NONE,   /* written in place */
+	JOURNAL_DIRTY,  /* changed metadata, must be logged first */
+	JOURNAL_LOGGED, /* logged and committed, may be written in place */
+	JOURNAL_DELAYED /* held under a tag, has no disk block yet */
+};
+
+#define JOURNAL_HOMES (int)((BLOCK_SIZE - 3 * sizeof(int)) / sizeof(int))
+
+/*
+ * The first block of the journal. When count is not 0 the count
+ * blocks that follow it are a committed transaction, and home lists
+ * where each of them belongs.
+ */
+struct journal_header {
+	int magic;
+	int sequence;
+	int count;
+	int home[JOURNAL_HOMES];
+};
+
+static struct journal_header jheader;
+static int journal_start = -1; /* header block, -1 if there is no journal */
+static int journal_blocks;     /* log blocks after the header */
+
+/* Unlink buf from the LRU list */
+static void lru_remove(struct bcache_buf *buf) {
+	if (buf->lru_prev != NULL)
+		buf->lru_prev->lru_next = buf->lru_next;
+	else
+		lru_head = buf->lru_next;
+
+	if (buf->lru_next != NULL)
+		buf->lru_next->lru_prev = buf->lru_prev;
+	else
+		lru_tail = buf->lru_prev;
+}
+
+/* Put buf first in the LRU list */
+static void lru_push_front(struct bcache_buf *buf) {
+	buf->lru_prev = NULL;
+	buf->lru_next = lru_head;
+	if (lru_head != NULL)
+		lru_head->lru_prev = buf;
+	lru_head = buf;
+	if (lru_tail == NULL)
+		lru_tail = buf;
+}
+
+/* Remove buf from its hash chain */
+static void hash_remove(struct bcache_buf *buf) {
+	struct bcache_buf **p = &hash_table[BCACHE_HASH(buf->block_num)];
+
+	while (*p != NULL) {
+		if (*p == buf) {
+			*p = buf->hash_next;
+			break;
+		}
+		p = &(*p)->hash_next;
+	}
+	buf->hash_next = NULL;
+}
+
+/* Find the buffer holding block_num, or NULL */
+static struct bcache_buf *hash_lookup(int block_num) {
+	struct bcache_buf *buf = hash_table[BCACHE_HASH(block_num)];
+
+	while (buf != NULL && buf->block_num != block_num)
+		buf = buf->hash_next;
+	return buf;
+}
+
+/* Write a dirty buffer to the device */
+static int writeback(struct bcache_buf *buf) {
+	int rc = block_dev_write(buf->block_num, 1, buf->data);
+
+	if (rc == 0) {
+		buf->dirty = 0;
+		buf->journal = JOURNAL_NONE;
+		stats.writebacks++;
+		stats.dev_writes++;
+		stats.transfers++;
+	}
+	return rc;
+}
+
+/*
+ * bcache_get:
+ * Returns the buffer for block_num, making it the most recently
+ * used. On a miss the least recently used buffer is recycled, and if
+ * fill is true the block is read from the device. Returns NULL if
+ * the device access fails or every buffer is held or uncommitted.
+ */
+static struct bcache_buf *bcache_get(int block_num, int fill) {
+	struct bcache_buf *buf = hash_lookup(block_num);
+
+	if (buf != NULL) {
+		stats.hits++;
+		lru_remove(buf);
+		lru_push_front(buf);
+		return buf;
+	}
+
+	stats.misses++;
+	/*
+	 * Held buffers and metadata waiting for its commit cannot be
+	 * reused, the file system caps their number
+	 */
+	buf = lru_tail;
+	while (buf != NULL && (buf->journal == JOURNAL_DELAYED ||
+	                       (buf->dirty && buf->journal == JOURNAL_DIRTY)))
+		buf = buf->lru_prev;
+	if (buf == NULL)
+		return NULL;
+	if (buf->dirty && writeback(buf) != 0)
+		return NULL;
+	if (buf->block_num != -1)
+		hash_remove(buf);
+
+	buf->block_num = -1;
+	if (fill) {
+		if (block_dev_read(block_num, 1, buf->data) != 0)
+			return NULL;
+		stats.dev_reads++;
+		stats.transfers++;
+	}
+
+	buf->block_num = block_num;
+	buf->hash_next = hash_table[BCACHE_HASH(block_num)];
+	hash_table[BCACHE_HASH(block_num)] = buf;
+	lru_remove(buf);
+	lru_push_front(buf);
+	return buf;
+}
+
+/*
+ * bcache_init:
+ * Empty the cache. Called from block_init().
+ */
+void bcache_init(void) {
+	int i;
+
+#ifdef LINUX_SIM
+	buffers = buffer_mem;
+	range_buf = range_mem;
+#else
+	ASSERT(BCACHE_ENTRIES * sizeof(struct bcache_buf) + BCACHE_RA_MAX * BLOCK_SIZE <=
+	       BCACHE_MEM_SIZE);
+	buffers = (struct bcache_buf *)BCACHE_MEM_START;
+	range_buf = (char *)&buffers[BCACHE_ENTRIES];
+#endif /* LINUX_SIM */
+	lru_head = lru_tail = NULL;
+	for (i = 0; i < BCACHE_HASH_SIZE; i++)
+		hash_table[i] = NULL;
+	for (i = 0; i < BCACHE_ENTRIES; i++) {
+		buffers[i].block_num = -1;
+		buffers[i].dirty = 0;
+		buffers[i].journal = JOURNAL_NONE;
+		buffers[i].hash_next = NULL;
+		lru_push_front(&buffers[i]);
+	}
+	bzero((char *)&stats, sizeof(stats));
+	journal_start = -1;
+	lock_init(&bcache_lock);
+}
+
+/* Copy the cache counters into stats */
+void bcache_stats(bcache_stats_t *s) {
+	lock_acquire(&bcache_lock);
+	bcopy((char *)&stats, (char *)s, sizeof(stats));
+	lock_release(&bcache_lock);
+}
+
+/*
+ * block_read:
+ * Reads a disk block (BLOCK_SIZE bytes) from block_num
+ * into the memory pointed to by address.
+ */
+int block_read(int block_num, void *address) {
+	struct bcache_buf *buf;
+
+	lock_acquire(&bcache_lock);
+	stats.reads++;
+	buf = bcache_get(block_num, TRUE);
+	if (buf != NULL)
+		bcopy(buf->data, address, BLOCK_SIZE);
+	lock_release(&bcache_lock);
+	return (buf != NULL) ? 0 : -1;
+}
+
+/*
+ * block_write:
+ * Writes the BLOCK_SIZE bytes starting at address to the disk block
+ * block_num. The whole block is replaced, so it is never read first.
+ */
+int block_write(int block_num, void *address) {
+	struct bcache_buf *buf;
+
+	lock_acquire(&bcache_lock);
+	stats.writes++;
+	buf = bcache_get(block_num, FALSE);
+	if (buf != NULL) {
+		bcopy(address, buf->data, BLOCK_SIZE);
+		buf->dirty = 1;
+		if (journal_start != -1)
+			buf->journal = JOURNAL_DIRTY;
+	}
+	lock_release(&bcache_lock);
+	return (buf != NULL) ? 0 : -1;
+}
+
+/*
+ * block_write_data:
+ * Like block_write(), for a block that holds file data. The block is
+ * not journaled.
+ */
+int block_write_data(int block_num, void *address) {
+	struct bcache_buf *buf;
+
+	lock_acquire(&bcache_lock);
+	stats.writes++;
+	buf = bcache_get(block_num, FALSE);
+	if (buf != NULL) {
+		bcopy(address, buf->data, BLOCK_SIZE);
+		buf->dirty = 1;
+	}
+	lock_release(&bcache_lock);
+	return (buf != NULL) ? 0 : -1;
+}
+
+/*
+ * block_modify:
+ * Changes a part of a disk block. The block block_num is changed so
+ * that the part pf the block from offset until offset+data_size is
+ * replaced with the first data_size bytes from data.
+ */
+int block_modify(int block_num, int offset, int data_size, void *data) {
+	struct bcache_buf *buf;
+
+	ASSERT((offset + data_size) <= BLOCK_SIZE);
+
+	lock_acquire(&bcache_lock);
+	stats.modifies++;
+	buf = bcache_get(block_num, TRUE);
+	if (buf != NULL) {
+		bcopy(data, &buf->data[offset], data_size);
+		buf->dirty = 1;
+		if (journal_start != -1)
+			buf->journal = JOURNAL_DIRTY;
+	}
+	lock_release(&bcache_lock);
+	return (buf != NULL) ? 0 : -1;
+}
+
+/*
+ * block_modify_data:
+ * Like block_modify(), for a block that holds file data. The block is
+ * not journaled.
+ */
+int block_modify_data(int block_num, int offset, int data_size, void *data) {
+	struct bcache_buf *buf;
+
+	ASSERT((offset + data_size) <= BLOCK_SIZE);
+
+	lock_acquire(&bcache_lock);
+	stats.modifies++;
+	buf = bcache_get(block_num, TRUE);
+	if (buf != NULL) {
+		bcopy(data, &buf->data[offset], data_size);
+		buf->dirty = 1;
+	}
+	lock_release(&bcache_lock);
+	return (buf != NULL) ? 0 : -1;
+}
+
+/*
+ * block_copy_data:
+ * Copy the file data of block from to block to, in memory. Block to
+ * is replaced whole, so it is never read first. It is not journaled.
+ */
+int block_copy_data(int from, int to) {
+	struct bcache_buf *src, *dst = NULL;
+
+	lock_acquire(&bcache_lock);
+	stats.reads++;
+	stats.writes++;
+	/* src is now the most recently used, so getting dst does not recycle it */
+	src = bcache_get(from, TRUE);
+	if (src != NULL)
+		dst = bcache_get(to, FALSE);
+	if (dst != NULL) {
+		bcopy(src->data, dst->data, BLOCK_SIZE);
+		dst->dirty = 1;
+	}
+	lock_release(&bcache_lock);
+	return (dst != NULL) ? 0 : -1;
+}
+
+/*
+ * block_read_part:
+ * Read a part of a disk block. The data from the disk block block_num
+ * starting at offset until offset+bytes is read into the memory
+ * starting at address.
+ */
+int block_read_part(int block_num, int offset, int bytes, void *address) {
+	struct bcache_buf *buf;
+
+	ASSERT((offset + bytes) <= BLOCK_SIZE);
+
+	lock_acquire(&bcache_lock);
+	stats.reads++;
+	buf = bcache_get(block_num, TRUE);
+	if (buf != NULL)
+		bcopy(&buf->data[offset], address, bytes);
+	lock_release(&bcache_lock);
+	return (buf != NULL) ? 0 : -1;
+}
+
+/*
+ * read_range:
+ * Reads count consecutive blocks starting at block_num into the
+ * memory pointed to by address. Blocks that are cached are copied
+ * from memory, and each run of uncached blocks is read with a single
+ * device transfer straight into address. If cache is set the blocks
+ * read from the device are added to the cache.
+ */
+static int read_range(int block_num, int count, char *dst, int cache) {
+	struct bcache_buf *buf;
+	int i, j, run;
+
+	for (i = 0; i < count; i += run) {
+		run = 1;
+		if (hash_lookup(block_num + i) != NULL) {
+			buf = bcache_get(block_num + i, TRUE);
+			bcopy(buf->data, &dst[i * BLOCK_SIZE], BLOCK_SIZE);
+			continue;
+		}
+
+		/* Extend the run over every following uncached block */
+		while (i + run < count && hash_lookup(block_num + i + run) == NULL)
+			run++;
+
+		if (block_dev_read(block_num + i, run, &dst[i * BLOCK_SIZE]) != 0)
+			return -1;
+		stats.dev_reads += run;
+		stats.transfers++;
+
+		for (j = i; cache && j < i + run; j++) {
+			buf = bcache_get(block_num + j, FALSE);
+			if (buf == NULL)
+				return -1;
+			bcopy(&dst[j * BLOCK_SIZE], buf->data, BLOCK_SIZE);
+		}
+	}
+	return 0;
+}
+
+/*
+ * block_read_range:
+ * Reads count consecutive blocks starting at block_num into the
+ * memory pointed to by address, and keeps them in the cache.
+ */
+int block_read_range(int block_num, int count, void *address) {
+	int rc;
+
+	lock_acquire(&bcache_lock);
+	stats.reads++;
+	rc = read_range(block_num, count, address, TRUE);
+	lock_release(&bcache_lock);
+	return rc;
+}
+
+/*
+ * block_read_direct:
+ * Like block_read_range, but blocks that are not cached go straight
+ * from the device to address and are not copied into the cache. Used
+ * for bulk reads of whole pages, which are not likely to be reread
+ * through the cache.
+ */
+int block_read_direct(int block_num, int count, void *address) {
+	int rc;
+
+	lock_acquire(&bcache_lock);
+	stats.reads++;
+	rc = read_range(block_num, count, address, FALSE);
+	lock_release(&bcache_lock);
+	return rc;
+}
+
+/*
+ * write_range:
+ * Writes count consecutive blocks starting at block_num from src with
+ * a single device transfer. Cached copies of the blocks are updated
+ * and become clean.
+ */
+static int write_range(int block_num, int count, char *src) {
+	struct bcache_buf *buf;
+	int i;
+
+	stats.writes++;
+	if (block_dev_write(block_num, count, src) != 0)
+		return -1;
+	stats.dev_writes += count;
+	stats.transfers++;
+
+	for (i = 0; i < count; i++) {
+		buf = hash_lookup(block_num + i);
+		if (buf != NULL) {
+			bcopy(&src[i * BLOCK_SIZE], buf->data, BLOCK_SIZE);
+			buf->dirty = 0;
+			buf->journal = JOURNAL_NONE;
+		}
+	}
+	return 0;
+}
+
+/*
+ * block_write_range:
+ * Writes count consecutive blocks starting at block_num from the
+ * memory pointed to by address, see write_range().
+ */
+int block_write_range(int block_num, int count, void *address) {
+	int rc;
+
+	lock_acquire(&bcache_lock);
+	rc = write_range(block_num, count, address);
+	lock_release(&bcache_lock);
+	return rc;
+}
+
+/*
+ * block_readahead:
+ * Bring up to BCACHE_RA_MAX consecutive blocks starting at block_num
+ * into the cache, so the block reads that follow are hits. Blocks
+ * already cached at the start of the range are skipped.
+ */
+void block_readahead(int block_num, int count) {
+	if (count > BCACHE_RA_MAX)
+		count = BCACHE_RA_MAX;
+
+	lock_acquire(&bcache_lock);
+	while (count > 0 && hash_lookup(block_num) != NULL) {
+		block_num++;
+		count--;
+	}
+	if (count > 1)
+		read_range(block_num, count, range_buf, TRUE);
+	lock_release(&bcache_lock);
+}
+
+/*
+ * write_run:
+ * Write the dirty buffer first back to the device, together with the
+ * dirty buffers in the same journal state for the blocks following
+ * it, at most max of them in all. Returns the number of blocks
+ * written, or -1.
+ */
+static int write_run(struct bcache_buf *first, int max) {
+	struct bcache_buf *run[BCACHE_RA_MAX];
+	int i, n;
+
+	if (max > BCACHE_RA_MAX)
+		max = BCACHE_RA_MAX;
+
+	/* Gather dirty buffers for the blocks following first */
+	run[0] = first;
+	for (n = 1; n < max; n++) {
+		run[n] = hash_lookup(first->block_num + n);
+		if (run[n] == NULL || !run[n]->dirty || run[n]->journal != first->journal)
+			break;
+	}
+
+	if (n == 1)
+		return (writeback(first) == 0) ? 1 : -1;
+	for (i = 0; i < n; i++)
+		bcopy(run[i]->data, &range_buf[i * BLOCK_SIZE], BLOCK_SIZE);
+	if (write_range(first->block_num, n, range_buf) != 0)
+		return -1;
+	stats.writebacks += n;
+	return n;
+}
+
+/*
+ * flush_dirty:
+ * Write every dirty buffer in the given journal state back to the
+ * device, in ascending block order. Dirty buffers for consecutive
+ * blocks are gathered and written with one transfer.
+ */
+static int flush_dirty(int journal) {
+	struct bcache_buf *next;
+	int i;
+
+	do {
+		next = NULL;
+		for (i = 0; i < BCACHE_ENTRIES; i++) {
+			if (buffers[i].dirty && buffers[i].journal == journal &&
+			    (next == NULL || buffers[i].block_num < next->block_num))
+				next = &buffers[i];
+		}
+		if (next == NULL)
+			break;
+		if (write_run(next, BCACHE_RA_MAX) < 0)
+			return -1;
+	} while (1);
+	return 0;
+}
+
+/*
+ * block_write_back:
+ * Write the dirty file data buffers for the count blocks starting at
+ * block_num back to the device now, consecutive ones with a single
+ * transfer. Metadata is left for the next commit.
+ */
+int block_write_back(int block_num, int count) {
+	struct bcache_buf *buf;
+	int i, n = 0;
+
+	lock_acquire(&bcache_lock);
+	for (i = 0; i < count && n >= 0; i += n) {
+		n = 1;
+		buf = hash_lookup(block_num + i);
+		if (buf != NULL && buf->dirty && buf->journal == JOURNAL_NONE)
+			n = write_run(buf, count - i);
+	}
+	lock_release(&bcache_lock);
+	return (n < 0) ? -1 : 0;
+}
+
+/*
+ * block_delay_write:
+ * Like block_modify_data(), for the held buffer tag. A buffer is made
+ * for a new tag, cleared and never read from the device.
+ */
+int block_delay_write(int tag, int offset, int data_size, void *data) {
+	struct bcache_buf *buf;
+
+	ASSERT((offset + data_size) <= BLOCK_SIZE);
+
+	lock_acquire(&bcache_lock);
+	stats.modifies++;
+	buf = hash_lookup(tag);
+	if (buf == NULL) {
+		buf = bcache_get(tag, FALSE);
+		if (buf != NULL) {
+			bzero(buf->data, BLOCK_SIZE);
+			buf->dirty = 1;
+			buf->journal = JOURNAL_DELAYED;
+		}
+	}
+	if (buf != NULL)
+		bcopy(data, &buf->data[offset], data_size);
+	lock_release(&bcache_lock);
+	return (buf != NULL) ? 0 : -1;
+}
+
+/*
+ * block_delay_read:
+ * Like block_read_part(), for the held buffer tag. Returns -1 if
+ * nothing is held under tag.
+ */
+int block_delay_read(int tag, int offset, int bytes, void *address) {
+	struct bcache_buf *buf;
+
+	ASSERT((offset + bytes) <= BLOCK_SIZE);
+
+	lock_acquire(&bcache_lock);
+	stats.reads++;
+	buf = hash_lookup(tag);
+	if (buf != NULL) {
+		stats.hits++;
+		bcopy(&buf->data[offset], address, bytes);
+	}
+	lock_release(&bcache_lock);
+	return (buf != NULL) ? 0 : -1;
+}
+
+/*
+ * block_delay_place:
+ * The held buffer tag has been given the disk block block_num. It
+ * becomes a dirty file data buffer for that block, replacing the
+ * contents of any buffer already holding it.
+ */
+int block_delay_place(int tag, int block_num) {
+	struct bcache_buf *buf, *old;
+
+	lock_acquire(&bcache_lock);
+	buf = hash_lookup(tag);
+	old = hash_lookup(block_num);
+	if (buf == NULL) {
+		lock_release(&bcache_lock);
+		return -1;
+	}
+	hash_remove(buf);
+	if (old != NULL) {
+		bcopy(buf->data, old->data, BLOCK_SIZE);
+		old->dirty = 1;
+		buf->block_num = -1;
+		buf->dirty = 0;
+		buf->journal = JOURNAL_NONE;
+	}
+	else {
+		buf->block_num = block_num;
+		buf->journal = JOURNAL_NONE;
+		buf->hash_next = hash_table[BCACHE_HASH(block_num)];
+		hash_table[BCACHE_HASH(block_num)] = buf;
+	}
+	lock_release(&bcache_lock);
+	return 0;
+}
+
+/*
+ * block_delay_drop:
+ * Throw away the held buffer tag, if there is one.
+ */
+void block_delay_drop(int tag) {
+	struct bcache_buf *buf;
+
+	lock_acquire(&bcache_lock);
+	buf = hash_lookup(tag);
+	if (buf != NULL) {
+		hash_remove(buf);
+		buf->block_num = -1;
+		buf->dirty = 0;
+		buf->journal = JOURNAL_NONE;
+	}
+	lock_release(&bcache_lock);
+}
+
+/*
+ * journal_commit:
+ * Commit the changed metadata as one transaction. File data is
+ * written in place first, so committed metadata never points at
+ * blocks that were not written. Then the metadata buffers are logged
+ * with sequential transfers, the header is written as the commit
+ * record, the buffers are written in place and the header is cleared.
+ * A transaction is never split: if it does not fit in the journal it
+ * is written in place without being logged, and -1 is returned.
+ */
+static int journal_commit(void) {
+	struct bcache_buf *logged[BCACHE_ENTRIES];
+	int i, j, n, chunk;
+
+	if (journal_start == -1)
+		return 0;
+	if (flush_dirty(JOURNAL_NONE) != 0)
+		return -1;
+
+	n = 0;
+	for (i = 0; i < BCACHE_ENTRIES; i++) {
+		if (buffers[i].dirty && buffers[i].journal == JOURNAL_DIRTY)
+			logged[n++] = &buffers[i];
+	}
+	if (n == 0)
+		return 0;
+	/*
+	 * Too large to log: it is written in place, with no guarantee
+	 * against a crash, rather than left in the cache for good
+	 */
+	if (n > journal_blocks) {
+		flush_dirty(JOURNAL_DIRTY);
+		return -1;
+	}
+
+	/* Log the blocks */
+	for (i = 0; i < n; i += chunk) {
+		chunk = n - i;
+		if (chunk > BCACHE_RA_MAX)
+			chunk = BCACHE_RA_MAX;
+		for (j = 0; j < chunk; j++)
+			bcopy(logged[i + j]->data, &range_buf[j * BLOCK_SIZE], BLOCK_SIZE);
+		if (block_dev_write(journal_start + 1 + i, chunk, range_buf) != 0)
+			return -1;
+		stats.dev_writes += chunk;
+		stats.transfers++;
+	}
+
+	/* Commit */
+	jheader.sequence++;
+	jheader.count = n;
+	for (i = 0; i < n; i++) {
+		jheader.home[i] = logged[i]->block_num;
+		logged[i]->journal = JOURNAL_LOGGED;
+	}
+	if (block_dev_write(journal_start, 1, &jheader) != 0)
+		return -1;
+	stats.dev_writes++;
+	stats.transfers++;
+	stats.commits++;
+	stats.logged += n;
+
+	/* Write in place, then the transaction is no longer needed */
+	if (flush_dirty(JOURNAL_LOGGED) != 0)
+		return -1;
+	jheader.count = 0;
+	if (block_dev_write(journal_start, 1, &jheader) != 0)
+		return -1;
+	stats.dev_writes++;
+	stats.transfers++;
+	return 0;
+}
+
+/*
+ * journal_room:
+ * The number of metadata blocks that can still be changed before the
+ * transaction being built fills the journal. Without a journal nothing
+ * is held back, and every buffer is room.
+ */
+int journal_room(void) {
+	int i, n = 0;
+
+	lock_acquire(&bcache_lock);
+	if (journal_start == -1)
+		n = BCACHE_ENTRIES;
+	else {
+		for (i = 0; i < BCACHE_ENTRIES; i++) {
+			if (buffers[i].dirty && buffers[i].journal == JOURNAL_DIRTY)
+				n++;
+		}
+		n = journal_blocks - n;
+	}
+	lock_release(&bcache_lock);
+	return n;
+}
+
+/*
+ * open_journal:
+ * Use the journal whose header is block start, followed by blocks log
+ * blocks. A transaction committed but not yet written in place before
+ * a crash is written in place now. Returns the number of blocks
+ * replayed, or -1 if there is no journal at start.
+ */
+static int open_journal(int start, int blocks) {
+	struct bcache_buf *buf;
+	int i;
+
+	journal_start = -1;
+	if (block_dev_read(start, 1, &jheader) != 0 || jheader.magic != JOURNAL_MAGIC)
+		return -1;
+	if (jheader.count < 0 || jheader.count > blocks)
+		return -1;
+
+	for (i = 0; i < jheader.count; i++) {
+		if (block_dev_read(start + 1 + i, 1, range_buf) != 0 ||
+		    block_dev_write(jheader.home[i], 1, range_buf) != 0)
+			return -1;
+		/* Drop any stale copy */
+		buf = hash_lookup(jheader.home[i]);
+		if (buf != NULL) {
+			bcopy(range_buf, buf->data, BLOCK_SIZE);
+			buf->dirty = 0;
+			buf->journal = JOURNAL_NONE;
+		}
+	}
+	i = jheader.count;
+	if (i > 0) {
+		jheader.count = 0;
+		if (block_dev_write(start, 1, &jheader) != 0)
+			return -1;
+	}
+
+	journal_start = start;
+	journal_blocks = blocks;
+	if (journal_blocks > JOURNAL_HOMES)
+		journal_blocks = JOURNAL_HOMES;
+	return i;
+}
+
+/* journal_open: see open_journal() */
+int journal_open(int start, int blocks) {
+	int rc;
+
+	lock_acquire(&bcache_lock);
+	rc = open_journal(start, blocks);
+	lock_release(&bcache_lock);
+	return rc;
+}
+
+/*
+ * journal_create:
+ * Write an empty journal header to block start and use the blocks
+ * log blocks after it as the journal.
+ */
+int journal_create(int start, int blocks) {
+	int rc;
+
+	lock_acquire(&bcache_lock);
+	bzero((char *)&jheader, sizeof(jheader));
+	jheader.magic = JOURNAL_MAGIC;
+	rc = block_dev_write(start, 1, &jheader);
+	if (rc == 0) {
+		journal_start = start;
+		journal_blocks = blocks;
+		if (journal_blocks > JOURNAL_HOMES)
+			journal_blocks = JOURNAL_HOMES;
+	}
+	lock_release(&bcache_lock);
+	return (rc == 0) ? 0 : -1;
+}
+
+/*
+ * journal_close:
+ * Commit what is pending and stop journaling.
+ */
+void journal_close(void) {
+	lock_acquire(&bcache_lock);
+	journal_commit();
+	journal_start = -1;
+	lock_release(&bcache_lock);
+}
+
+/*
+ * block_flush:
+ * Write every dirty buffer back to the device. Metadata goes through
+ * the journal if there is one, after the data, so a committed block
+ * pointer never leads to a block still holding what it had before.
+ * Returns -1 if a write failed or the metadata could not be committed
+ * as one transaction.
+ */
+int block_flush(void) {
+	int rc;
+
+	lock_acquire(&bcache_lock);
+	rc = flush_dirty(JOURNAL_NONE);
+	if (journal_commit() != 0)
+		rc = -1;
+	lock_release(&bcache_lock);
+	return rc;
+}
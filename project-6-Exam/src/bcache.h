@@ -0,0 +1,70 @@
+/* Header file for bcache.c */
+
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include "block.h"
+
+/*
+ * Number of block buffers held in memory. It is a count, not a size:
+ * held data blocks and the metadata of the transaction being built
+ * cannot be evicted, and each may take up to a third of the cache
+ * (FS_DELAY_MAX and the journal), whatever the block size.
+ */
+#define BCACHE_ENTRIES 48
+
+/* Number of hash chains, must be a power of two */
+#define BCACHE_HASH_SIZE 16
+
+/* Largest number of blocks moved in one readahead or flush transfer */
+#define BCACHE_RA_MAX 8
+
+/*
+ * Counters kept by the buffer cache. reads, writes and modifies count
+ * the calls made to the cached block_* functions by the file system.
+ * dev_reads and dev_writes count the blocks actually moved to or from
+ * the device (USB or image_sim), and transfers counts the device
+ * commands used to move them.
+ */
+struct bcache_stats {
+	unsigned int reads;      /* block_read*() calls */
+	unsigned int writes;     /* block_write*() calls */
+	unsigned int modifies;   /* block_modify*() calls (read-modify-write) */
+	unsigned int hits;       /* requests served from memory */
+	unsigned int misses;     /* requests that needed a buffer */
+	unsigned int writebacks; /* dirty buffers written to the device */
+	unsigned int dev_reads;  /* blocks read from the device */
+	unsigned int dev_writes; /* blocks written to the device */
+	unsigned int transfers;  /* device read/write commands issued */
+	unsigned int commits;    /* journal transactions committed */
+	unsigned int logged;     /* blocks written to the journal */
+};
+
+typedef struct bcache_stats bcache_stats_t;
+
+void bcache_init(void);
+void bcache_stats(bcache_stats_t *stats);
+
+/*
+ * Held blocks. File data that has no disk block yet can be kept in a
+ * buffer named by a tag instead of a block number; tags start at
+ * BCACHE_DELAY_TAG, above every block number. A held buffer is never
+ * written back or reused until block_delay_place() gives it its disk
+ * block, so the caller must keep well under BCACHE_ENTRIES of them.
+ */
+#define BCACHE_DELAY_TAG 0x40000000
+
+int block_delay_write(int tag, int offset, int data_size, void *data);
+int block_delay_read(int tag, int offset, int bytes, void *address);
+int block_delay_place(int tag, int block_num);
+void block_delay_drop(int tag);
+
+/* Metadata journal, its header block starts with JOURNAL_MAGIC */
+#define JOURNAL_MAGIC 0x4a524e4c
+
+int journal_open(int start, int blocks);
+int journal_room(void);
+int journal_create(int start, int blocks);
+void journal_close(void);
+
+#endif /* !BCACHE_H */
@@ -0,0 +1,9 @@
+/* Header file for bench_sim.c, the file system benchmark in p6sh */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+/* Run the benchmark command "bench <workload> <args>" */
+void bench(int argc, char *argv[]);
+
+#endif /* !BENCH_H */
@@ -0,0 +1,485 @@
+/*
+ * File system benchmark for the fake shell.
+ *
+ * "bench <workload> <args>" runs one of the workloads below against
+ * the file system of image_sim, in the current directory. Every
+ * workload is split in phases. Each operation of a phase is timed,
+ * and the phase ends with fs_sync() so that the blocks it dirtied are
+ * written and counted too. For every phase one line is printed with
+ * the number of operations and failures, the time taken (sync
+ * included), operations per second, latency percentiles and the block
+ * cache counters (see bcache.h). Data is written in a pattern made from
+ * the file and the offset, and what is read back must match it; a
+ * mismatch, or a file that reads back short, counts as a failure.
+ * Workloads clean up after themselves, so a script can run them back
+ * to back:
+ *
+ *   bench create <n>              create, stat and unlink n files
+ *   bench seq <n> <size>          write then read n files of size bytes
+ *   bench rand <n> <size> <ops>   random block reads and writes in n files
+ *   bench append <n> <size> <rec> append rec byte records to n open files
+ *   bench tree <depth> <fanout>   mkdir, lookup and rmdir a directory tree
+ *
+ * The file system is as big as image_sim, FS_BLOCKS blocks and
+ * GROUP_INODES inodes as the Makefile makes it, so the arguments have
+ * to be kept modest unless image_sim is made bigger.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bcache.h"
+#include "bench.h"
+#include "fs.h"
+#include "kernel.h"
+#include "util.h"
+
+/* Latencies kept per phase, further operations are counted but not kept */
+#define BENCH_SAMPLES 8192
+
+/* Size of one read or write in the seq workload */
+#define BENCH_IO_SIZE 4096
+
+struct bench_phase {
+	char *name;
+	int ops;
+	int errors;
+	double start;  /* microseconds */
+	bcache_stats_t io;
+	double lat[BENCH_SAMPLES];
+};
+
+static struct bench_phase phase;
+static char io_buf[BENCH_IO_SIZE];
+static uint32_t bench_seed = 1;
+
+/* Microseconds on a monotonic clock */
+static double now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* xorshift, so a workload does the same operations every run */
+static uint32_t next_rand(void) {
+	bench_seed ^= bench_seed << 13;
+	bench_seed ^= bench_seed >> 17;
+	bench_seed ^= bench_seed << 5;
+	return bench_seed;
+}
+
+/* Fill buf with the n bytes found at offset pos of file number file */
+static void pattern_fill(char *buf, int file, int pos, int n) {
+	int i;
+
+	for (i = 0; i < n; i++)
+		buf[i] = (char)((pos + i) + ((pos + i) >> 8) * 7 + file * 31);
+}
+
+/* TRUE if the n bytes in buf are those at offset pos of file number file */
+static int pattern_ok(char *buf, int file, int pos, int n) {
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (buf[i] != (char)((pos + i) + ((pos + i) >> 8) * 7 + file * 31))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void phase_begin(char *name) {
+	phase.name = name;
+	phase.ops = 0;
+	phase.errors = 0;
+	bcache_stats(&phase.io);
+	phase.start = now_us();
+}
+
+/* Record one operation that started at t0 and returned rc */
+static void phase_op(double t0, int rc) {
+	if (phase.ops < BENCH_SAMPLES)
+		phase.lat[phase.ops] = now_us() - t0;
+	phase.ops++;
+	if (rc < 0)
+		phase.errors++;
+}
+
+/* Value below which pct percent of the kept latencies lie */
+static double percentile(int n, int pct) {
+	int i = (n * pct + 99) / 100 - 1;
+
+	return phase.lat[(i < 0) ? 0 : i];
+}
+
+static void phase_end(void) {
+	bcache_stats_t io;
+	double elapsed;
+	int n = (phase.ops < BENCH_SAMPLES) ? phase.ops : BENCH_SAMPLES;
+
+	fs_sync();
+	elapsed = now_us() - phase.start;
+	bcache_stats(&io);
+	qsort(phase.lat, n, sizeof(double), cmp_double);
+
+	printf("%-10s %6d %4d %9.2f %10.0f", phase.name, phase.ops, phase.errors,
+	       elapsed / 1e3, (elapsed > 0) ? phase.ops * 1e6 / elapsed : 0.0);
+	if (n > 0)
+		printf(" %8.1f %8.1f %8.1f %8.1f", percentile(n, 50), percentile(n, 90),
+		       percentile(n, 99), phase.lat[n - 1]);
+	else
+		printf(" %8s %8s %8s %8s", "-", "-", "-", "-");
+	printf(" %6u %6u %6u %6u %6u\n",
+	       io.dev_reads - phase.io.dev_reads, io.dev_writes - phase.io.dev_writes,
+	       io.transfers - phase.io.transfers, io.hits - phase.io.hits,
+	       io.misses - phase.io.misses);
+}
+
+static void print_header(void) {
+	printf("%-10s %6s %4s %9s %10s %8s %8s %8s %8s %6s %6s %6s %6s %6s\n",
+	       "phase", "ops", "err", "ms", "ops/s", "p50us", "p90us", "p99us",
+	       "maxus", "reads", "writes", "xfers", "hits", "misses");
+}
+
+static void file_name(char *name, char *prefix, int i) {
+	snprintf(name, MAX_FILENAME_LEN, "%s%d", prefix, i);
+}
+
+/* Create file number file, of size bytes, returns an error code or 0 */
+static int make_file(char *name, int file, int size) {
+	int fd, n, pos, ev = 0;
+
+	if ((fd = fs_open(name, MODE_WRONLY | MODE_CREAT | MODE_TRUNC)) < 0)
+		return fd;
+	for (pos = 0; pos < size && ev >= 0; pos += n) {
+		n = (size - pos < BENCH_IO_SIZE) ? size - pos : BENCH_IO_SIZE;
+		pattern_fill(io_buf, file, pos, n);
+		ev = fs_write(fd, io_buf, n);
+	}
+	fs_close(fd);
+	return (ev < 0) ? ev : 0;
+}
+
+/*
+ * Read file number file, open as fd, to its end a BENCH_IO_SIZE read
+ * at a time, checking it holds size bytes of its pattern
+ */
+static void read_back(int fd, int file, int size) {
+	int pos = 0, ev;
+	double t0;
+
+	do {
+		t0 = now_us();
+		ev = fs_read(fd, io_buf, BENCH_IO_SIZE);
+		phase_op(t0, ev);
+		if (ev > 0 && !pattern_ok(io_buf, file, pos, ev))
+			phase.errors++;
+		if (ev > 0)
+			pos += ev;
+	} while (ev > 0);
+	if (ev == 0 && pos != size)
+		phase.errors++;
+}
+
+static void unlink_files(char *prefix, int n) {
+	char name[MAX_FILENAME_LEN];
+	int i;
+
+	for (i = 0; i < n; i++) {
+		file_name(name, prefix, i);
+		fs_unlink(name);
+	}
+	fs_sync();
+}
+
+/* Metadata storm: create, stat and unlink n empty files */
+static void bench_create(int n) {
+	char name[MAX_FILENAME_LEN], buf[STAT_SIZE];
+	int i, fd, ev;
+	double t0;
+
+	phase_begin("create");
+	for (i = 0; i < n; i++) {
+		file_name(name, "c", i);
+		t0 = now_us();
+		if ((fd = fs_open(name, MODE_WRONLY | MODE_CREAT | MODE_TRUNC)) >= 0)
+			fs_close(fd);
+		phase_op(t0, fd);
+	}
+	phase_end();
+
+	phase_begin("stat");
+	for (i = 0; i < n; i++) {
+		file_name(name, "c", i);
+		t0 = now_us();
+		if ((ev = fd = fs_open(name, MODE_RDONLY)) >= 0) {
+			ev = fs_stat(fd, buf);
+			fs_close(fd);
+		}
+		phase_op(t0, ev);
+	}
+	phase_end();
+
+	phase_begin("unlink");
+	for (i = 0; i < n; i++) {
+		file_name(name, "c", i);
+		t0 = now_us();
+		phase_op(t0, fs_unlink(name));
+	}
+	phase_end();
+}
+
+/* Write n files of size bytes front to back, then read them back */
+static void bench_seq(int n, int size) {
+	char name[MAX_FILENAME_LEN];
+	int i, fd, pos, len, ev;
+	double t0;
+
+	phase_begin("seqwrite");
+	for (i = 0; i < n; i++) {
+		file_name(name, "s", i);
+		if ((fd = fs_open(name, MODE_WRONLY | MODE_CREAT | MODE_TRUNC)) < 0) {
+			phase.errors++;
+			continue;
+		}
+		for (pos = 0; pos < size; pos += BENCH_IO_SIZE) {
+			len = (size - pos < BENCH_IO_SIZE) ? size - pos : BENCH_IO_SIZE;
+			pattern_fill(io_buf, i, pos, len);
+			t0 = now_us();
+			ev = fs_write(fd, io_buf, len);
+			phase_op(t0, ev);
+		}
+		fs_close(fd);
+	}
+	phase_end();
+
+	phase_begin("seqread");
+	for (i = 0; i < n; i++) {
+		file_name(name, "s", i);
+		if ((fd = fs_open(name, MODE_RDONLY)) < 0) {
+			phase.errors++;
+			continue;
+		}
+		read_back(fd, i, size);
+		fs_close(fd);
+	}
+	phase_end();
+
+	unlink_files("s", n);
+}
+
+/*
+ * Log writers: n files are open at once and grow to size bytes by
+ * appending rec byte records to each in turn, then are read back.
+ */
+static void bench_append(int n, int size, int rec) {
+	char name[MAX_FILENAME_LEN];
+	int fds[MAX_OPEN_FILES];
+	int i, done;
+	double t0;
+
+	if (n > MAX_OPEN_FILES)
+		n = MAX_OPEN_FILES;
+	if (rec < 1 || rec > BENCH_IO_SIZE)
+		rec = 16;
+
+	phase_begin("append");
+	for (i = 0; i < n; i++) {
+		file_name(name, "a", i);
+		if ((fds[i] = fs_open(name, MODE_WRONLY | MODE_CREAT | MODE_TRUNC)) < 0)
+			phase.errors++;
+	}
+	for (done = 0; done + rec <= size; done += rec) {
+		for (i = 0; i < n; i++) {
+			if (fds[i] < 0)
+				continue;
+			pattern_fill(io_buf, i, done, rec);
+			t0 = now_us();
+			phase_op(t0, fs_write(fds[i], io_buf, rec));
+		}
+	}
+	for (i = 0; i < n; i++) {
+		if (fds[i] >= 0)
+			fs_close(fds[i]);
+	}
+	phase_end();
+
+	phase_begin("logread");
+	for (i = 0; i < n; i++) {
+		file_name(name, "a", i);
+		if ((fds[i] = fs_open(name, MODE_RDONLY)) < 0) {
+			phase.errors++;
+			continue;
+		}
+		read_back(fds[i], i, size / rec * rec);
+		fs_close(fds[i]);
+	}
+	phase_end();
+
+	unlink_files("a", n);
+}
+
+/* ops random single block reads, then writes, spread over n files */
+static void bench_rand(int n, int size, int ops) {
+	char name[MAX_FILENAME_LEN];
+	int fds[MAX_OPEN_FILES];
+	int i, write, blocks = size / BLOCK_SIZE;
+	double t0;
+
+	if (n > MAX_OPEN_FILES || blocks < 1) {
+		printf("bench rand: at most %d files of at least %d bytes\n", MAX_OPEN_FILES, BLOCK_SIZE);
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		file_name(name, "r", i);
+		if (make_file(name, i, size) < 0 || (fds[i] = fs_open(name, MODE_RDWR)) < 0) {
+			printf("bench rand: could not create %s\n", name);
+			while (--i >= 0)
+				fs_close(fds[i]);
+			unlink_files("r", n);
+			return;
+		}
+	}
+	fs_sync();
+
+	for (write = 0; write <= 1; write++) {
+		phase_begin(write ? "randwrite" : "randread");
+		for (i = 0; i < ops; i++) {
+			int file = next_rand() % n;
+			int pos = (next_rand() % blocks) * BLOCK_SIZE;
+			int ev;
+
+			/* a block is rewritten with the data it had, so reads can check it */
+			if (write)
+				pattern_fill(io_buf, file, pos, BLOCK_SIZE);
+			t0 = now_us();
+			ev = fs_lseek(fds[file], pos, SEEK_SET);
+			if (ev >= 0 && write)
+				ev = fs_write(fds[file], io_buf, BLOCK_SIZE);
+			else if (ev >= 0)
+				ev = fs_read(fds[file], io_buf, BLOCK_SIZE);
+			phase_op(t0, ev);
+			if (ev >= 0 && !write && (ev != BLOCK_SIZE || !pattern_ok(io_buf, file, pos, BLOCK_SIZE)))
+				phase.errors++;
+		}
+		phase_end();
+	}
+
+	for (i = 0; i < n; i++)
+		fs_close(fds[i]);
+	unlink_files("r", n);
+}
+
+/*
+ * Directory tree: depth levels below a directory "bt", each holding
+ * fanout directories, of which the first one holds the next level.
+ * The tree is walked with fs_chdir() so every lookup is one name.
+ */
+static void bench_tree(int depth, int fanout) {
+	char name[MAX_FILENAME_LEN], buf[STAT_SIZE];
+	int level, i, fd, ev;
+	double t0;
+
+	if (fs_mkdir("bt") < 0 || fs_chdir("bt") < 0) {
+		printf("bench tree: could not make directory bt\n");
+		return;
+	}
+
+	phase_begin("mkdir");
+	for (level = 0; level < depth; level++) {
+		for (i = 0; i < fanout; i++) {
+			file_name(name, "d", i);
+			t0 = now_us();
+			phase_op(t0, fs_mkdir(name));
+		}
+		if (level < depth - 1 && fs_chdir("d0") < 0)
+			phase.errors++;
+	}
+	for (level = 0; level < depth - 1; level++)
+		fs_chdir("..");
+	phase_end();
+
+	/* every directory of a level looked up, then one level down */
+	phase_begin("lookup");
+	for (level = 0; level < depth; level++) {
+		for (i = 0; i < fanout; i++) {
+			file_name(name, "d", i);
+			t0 = now_us();
+			if ((ev = fd = fs_open(name, MODE_RDONLY)) >= 0) {
+				ev = fs_stat(fd, buf);
+				fs_close(fd);
+			}
+			phase_op(t0, ev);
+		}
+		if (level < depth - 1) {
+			t0 = now_us();
+			phase_op(t0, fs_chdir("d0"));
+		}
+	}
+	phase_end();
+
+	/* bottom up, so every directory is empty when it goes */
+	phase_begin("rmdir");
+	for (level = depth - 1; level >= 0; level--) {
+		for (i = 0; i < fanout; i++) {
+			file_name(name, "d", i);
+			t0 = now_us();
+			phase_op(t0, fs_rmdir(name));
+		}
+		if (level > 0)
+			fs_chdir("..");
+	}
+	fs_chdir("..");
+	t0 = now_us();
+	phase_op(t0, fs_rmdir("bt"));
+	phase_end();
+}
+
+static void bench_usage(void) {
+	printf("Usage: bench create <n>\n"
+	       "       bench seq <n> <size>\n"
+	       "       bench rand <n> <size> <ops>\n"
+	       "       bench append <n> <size> <rec>\n"
+	       "       bench tree <depth> <fanout>\n");
+}
+
+void bench(int argc, char *argv[]) {
+	int i;
+
+	if (argc < 2) {
+		bench_usage();
+		return;
+	}
+	bench_seed = 1;
+
+	if (same_string("create", argv[1]) && argc == 3) {
+		print_header();
+		bench_create(atoi(argv[2]));
+	}
+	else if (same_string("seq", argv[1]) && argc == 4) {
+		print_header();
+		bench_seq(atoi(argv[2]), atoi(argv[3]));
+	}
+	else if (same_string("rand", argv[1]) && argc == 5) {
+		print_header();
+		bench_rand(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]));
+	}
+	else if (same_string("append", argv[1]) && argc == 5) {
+		print_header();
+		bench_append(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]));
+	}
+	else if (same_string("tree", argv[1]) && argc == 4) {
+		print_header();
+		bench_tree(atoi(argv[2]), atoi(argv[3]));
+	}
+	else {
+		bench_usage();
+	}
+}
@@ -1,130 +1,126 @@
-
 #include "block.h"
+#include "bcache.h"
 #include "fs.h"
 
 #include "common.h"
+#include "memory.h"
 #include "usb/scsi.h"
 #include "util.h"
 
+/* First sector of the file system area */
+static int fs_start;
+
+/* Used for sectors of a user buffer that straddle two pages */
+static char bounce[SECTOR_SIZE];
+
 /*
  * block_init:
- * Initialize the block code. For USB access, no initialization is
- * needed. However, it exists so that the interface is the same as for
- * the block_sim code.
+ * Initialize the block code. createimage puts the file system area
+ * last on the USB stick, after the kernel, the process directory and
+ * every process image, so that it can grow to the end of the device.
+ * It starts at the first sector no process in the directory uses.
  *
  */
 void block_init(void) {
-	/* We assume that block_size == sector size */
-	ASSERT(BLOCK_SIZE == SECTOR_SIZE);
+	struct directory_t *dir = (struct directory_t *)bounce;
+	int i;
+
+	fs_start = os_size + 2;
+	if (scsi_read(os_size + 1, 1, bounce) == 0) {
+		for (i = 0; i < (int)(SECTOR_SIZE / sizeof(*dir)) && dir[i].location != 0; i++)
+			if (dir[i].location + dir[i].size > fs_start)
+				fs_start = dir[i].location + dir[i].size;
+	}
+	bcache_init();
 }
 
 /*
  * block_destruct:
- * Cleanup for the block code. For USB access, no cleanup is
- * needed. However, it exists so that the interface is the same as for
- * the block_sim code.
+ * Cleanup for the block code. Dirty buffers are written back, but
+ * otherwise no cleanup is needed for USB access. It exists so that
+ * the interface is the same as for the block_sim code.
  *
  */
 void block_destruct(void) {
-	/* Nothing to do */
+	block_flush();
 }
 
 /*
- * block_read:
- * Reads a disk block (512 bytes) from block_num
- * into the memory pointed to by address.
+ * block_dev_transfer:
+ * File system block block_num is the BLOCK_SECTORS sectors starting
+ * at sector block_num * BLOCK_SECTORS of the file system area. The
+ * USB controllers transfer to and from physical addresses. Kernel
+ * memory is identity mapped and goes to the device in one command. A user buffer is moved a
+ * page at a time, straight to or from the physical page; sectors that
+ * straddle two pages go through the bounce buffer. The file system
+ * pins user buffers before calling down, so their pages stay put.
  */
-int block_read(int block_num, void *address) {
-	int rc;
-	rc = scsi_read((os_size + 2 + block_num), 1, address);
-	// if (rc > 0){
-	// 	return 0;
-	// }
-	// return -1;
-	return rc;
+static int block_dev_transfer(int write, int block_num, int count, char *address) {
+	int (*transfer)(int, int, char *) = write ? scsi_write : scsi_read;
+	int sector = fs_start + block_num * BLOCK_SECTORS;
+	int sectors = count * BLOCK_SECTORS;
+	int n, rc;
+
+	if ((uint32_t)address + count * BLOCK_SIZE <= KERNEL_MEM_END)
+		return transfer(sector, sectors, address);
+
+	while (sectors > 0) {
+		n = (PAGE_SIZE - ((uint32_t)address & PAGE_MASK)) / SECTOR_SIZE;
+		if (n > sectors)
+			n = sectors;
+
+		if (n == 0) {
+			n = 1;
+			if (write)
+				bcopy(address, bounce, SECTOR_SIZE);
+			rc = transfer(sector, 1, bounce);
+			if (!write)
+				bcopy(bounce, address, SECTOR_SIZE);
+		}
+		else {
+			/* A read from the device dirties the page */
+			rc = transfer(sector, n, (char *)page_user_phys((uint32_t)address, !write));
+		}
+		if (rc != 0)
+			return rc;
+
+		sector += n;
+		sectors -= n;
+		address += n * SECTOR_SIZE;
+	}
+	return 0;
 }
 
 /*
- * block_write:
- * Writes the 512 bytes starting at address to the disk block
- * block_num
+ * block_dev_read:
+ * Reads count consecutive file system blocks (BLOCK_SIZE bytes each)
+ * starting at block_num on the USB stick into the memory pointed to
+ * by address. Kernel memory is filled by a single READ(10) command.
+ * Only called by the buffer cache.
  */
-int block_write(int block_num, void *address) {
-	int rc;
-	rc = scsi_write((os_size + 2 + block_num), 1, address);
-	// if (rc > 0){
-	// 	return 0;
-	// }
-	// return -1;
-	return rc;
+int block_dev_read(int block_num, int count, void *address) {
+	return block_dev_transfer(FALSE, block_num, count, address);
 }
 
 /*
- * block_modify:
- * Changes a part of a disk block. The block block_num is changed so
- * that the part pf the block from offset until offset+data_size is
- * replaced with the first data_size bytes from data.
+ * block_dev_write:
+ * Writes count * BLOCK_SIZE bytes starting at address to the
+ * consecutive file system blocks starting at block_num on the USB
+ * stick. Kernel memory is written by a single WRITE(10) command. Only
+ * called by the buffer cache.
  */
-int block_modify(int block_num, int offset, int data_size, void *data) {
-	int rc;
-	char buf[BLOCK_SIZE];
-
-	ASSERT((offset + data_size) <= BLOCK_SIZE);
-
-	rc = block_read(block_num, buf);
-	if (rc == 0) {
-		bcopy(data, &buf[offset], data_size);
-		rc = block_write(block_num, buf);
-	}
-	else
-		return -1;
-
-	return rc;
+int block_dev_write(int block_num, int count, void *address) {
+	return block_dev_transfer(TRUE, block_num, count, address);
 }
 
 /*
- * block_read_part:
- * Read a part of a disk block. The data from the disk block block_num
- * starting at offset until offset+bytes is read into the memory
- * starting at address.
+ * block_dev_size:
+ * Returns the number of file system blocks that fit between the start
+ * of the file system area and the end of the USB stick, 0 if the
+ * capacity of the stick is not known.
  */
-int block_read_part(int block_num, int offset, int bytes, void *address) {
-	int rc;
-	char buf[BLOCK_SIZE];
+int block_dev_size(void) {
+	int sectors = scsi_capacity() - fs_start;
 
-	ASSERT((offset + bytes) <= BLOCK_SIZE);
-
-	rc = block_read(block_num, buf);
-	if (rc == 0) {
-		bcopy(&(buf[offset]), address, bytes);
-		return 0;
-	}
-
-	return -1;
+	return (sectors > 0) ? sectors / BLOCK_SECTORS : 0;
 }
-
-// int block_write_part(int block_num, int offset, int bytes, void *address) {
-// 	int rc;
-// 	char buf[BLOCK_SIZE];
-
-// 	ASSERT((offset + bytes) <= BLOCK_SIZE);
-
-// 	// Read the existing block data
-// 	rc = block_read(block_num, buf);
-// 	if (rc != 0) {
-// 		// Error reading the block
-// 		return -1;
-// 	}
-
-// 	// Copy the new data into the appropriate place in the buffer
-// 	bcopy(address, &(buf[offset]), bytes);
-
-// 	// Write the modified buffer back to the block
-// 	rc = block_write(block_num, buf);
-// 	if (rc != 0) {
-// 		// Error reading the block
-// 		return -1;
-// 	}
-
-// 	return 0;
-// }
\ No newline at end of file
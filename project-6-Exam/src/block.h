@@ -1,19 +1,47 @@
-/* Header file for block.c and blockFake.c */
+/* Header file for block.c, block_sim.c and bcache.c */
 
 #ifndef BLOCK_H
 #define BLOCK_H
 
 #include "common.h"
 
-#define BLOCK_SIZE SECTOR_SIZE
-#define BLOCKS (SECTORS / (BLOCK_SIZE / SECTOR_SIZE))
+/*
+ * File system block size, chosen when the file system is built
+ * (FS_BLOCK_SIZE in the Makefile) and recorded in its superblock. A
+ * block is BLOCK_SECTORS consecutive sectors on the device.
+ */
+#ifndef FS_BLOCK_SIZE
+#define FS_BLOCK_SIZE SECTOR_SIZE
+#endif
 
+#if FS_BLOCK_SIZE != 512 && FS_BLOCK_SIZE != 1024 && FS_BLOCK_SIZE != 2048 && FS_BLOCK_SIZE != 4096
+#error "FS_BLOCK_SIZE must be 512, 1024, 2048 or 4096"
+#endif
+
+#define BLOCK_SIZE FS_BLOCK_SIZE
+#define BLOCK_SECTORS (BLOCK_SIZE / SECTOR_SIZE)
+#define BLOCKS (SECTORS / BLOCK_SECTORS)
+
+/* Device access, implemented by block.c and block_sim.c */
 void block_init(void);
 void block_destruct(void);
+int block_dev_read(int block_num, int count, void *address);
+int block_dev_write(int block_num, int count, void *address);
+int block_dev_size(void);
+
+/* Cached access, implemented by bcache.c */
 int block_read(int block_num, void *address);
 int block_write(int block_num, void *address);
+int block_write_data(int block_num, void *address);
 int block_modify(int block_num, int offset, int data_size, void *data);
+int block_modify_data(int block_num, int offset, int data_size, void *data);
+int block_copy_data(int from, int to);
 int block_read_part(int block_num, int offset, int bytes, void *address);
-// int block_write_part(int block_num, int offset, int bytes, void *address);
+int block_read_range(int block_num, int count, void *address);
+int block_read_direct(int block_num, int count, void *address);
+int block_write_range(int block_num, int count, void *address);
+void block_readahead(int block_num, int count);
+int block_write_back(int block_num, int count);
+int block_flush(void);
 
 #endif /* !BLOCK_H */
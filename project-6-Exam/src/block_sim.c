@@ -1,7 +1,8 @@
 /*
  * This simulates the operation of the filesystem on Linux.
  *
- * The block function read or writes a block of the file system.
+ * The block functions read or write a block of the file system in
+ * the image_sim file. Caching is done by bcache.c on top of these.
  */
 
 #include <assert.h>
@@ -10,6 +11,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "bcache.h"
 #include "block.h"
 #include "util.h"
 
@@ -22,76 +24,53 @@ void block_init(void) {
 	if ((fp = fopen("image_sim", "r+")) == NULL) {
 		error("could not open image file:");
 	}
+	bcache_init();
 }
 
 void block_destruct(void) {
+	block_flush();
 	fclose(fp);
 }
 
-/* Read a block into memory[address] */
-int block_read(int block_num, void *address) {
+/* Read count blocks from the file into memory[address] */
+int block_dev_read(int block_num, int count, void *address) {
 	if (fseek(fp, block_num * BLOCK_SIZE, SEEK_SET) < 0) {
 		error("fseek error: ");
 	}
 
-	if (fread(address, BLOCK_SIZE, 1, fp) != 1) {
+	if (fread(address, BLOCK_SIZE, count, fp) != (size_t)count) {
 		error("fread error: ");
 	}
 #ifndef NDEBUG
-	printf("block %d read\n", block_num);
+	printf("block %d read (%d blocks)\n", block_num, count);
 #endif /* NDEBUG */
 
-	return 1;
+	return 0;
 }
 
-/* Write from memory['address'] into block 'block' in the file */
-int block_write(int block_num, void *address) {
+/* Write count blocks from memory['address'] into block 'block' in the file */
+int block_dev_write(int block_num, int count, void *address) {
 	if (fseek(fp, block_num * BLOCK_SIZE, SEEK_SET) < 0) {
 		error("fseek error: ");
 	}
 
-	if (fwrite(address, BLOCK_SIZE, 1, fp) != 1) {
+	if (fwrite(address, BLOCK_SIZE, count, fp) != (size_t)count) {
 		error("write error: ");
 	}
 #ifndef NDEBUG
-	printf("block %d written\n", block_num);
+	printf("block %d written (%d blocks)\n", block_num, count);
 #endif /* NDEBUG */
 
 	fflush(fp);
-	return 1;
+	return 0;
 }
 
-/* Modify a block */
-int block_modify(int block_num, int offset, int data_size, void *data) {
-	char buf[BLOCK_SIZE];
-
-	assert((offset + data_size) <= BLOCK_SIZE);
-
-	block_read(block_num, buf);
-	bcopy(data, &buf[offset], data_size);
-	block_write(block_num, buf);
-
-#ifndef NDEBUG
-	printf("block %d modified (%d bytes)\n", block_num, data_size);
-#endif /* NDEBUG */
-
-	return 1;
-}
-
-/* Read part of a block */
-int block_read_part(int block_num, int offset, int bytes, void *address) {
-	char buf[BLOCK_SIZE];
-
-	assert((offset + bytes) <= BLOCK_SIZE);
-
-	block_read(block_num, buf);
-	bcopy(&(buf[offset]), address, bytes);
-
-#ifndef NDEBUG
-	printf("block %d read from %d (%d bytes)\n", block_num, offset, bytes);
-#endif /* NDEBUG */
-
-	return 1;
+/* Number of blocks in the file */
+int block_dev_size(void) {
+	if (fseek(fp, 0, SEEK_END) < 0) {
+		error("fseek error: ");
+	}
+	return ftell(fp) / BLOCK_SIZE;
 }
 
 /* print an error message and exit */
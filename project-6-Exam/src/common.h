@@ -40,6 +40,15 @@ enum {
         SYSCALL_FS_MKDIR,
         SYSCALL_FS_CHDIR,       /* 25 */
         SYSCALL_FS_RMDIR,
+        SYSCALL_FS_SYNC,
+        SYSCALL_FS_READV,
+        SYSCALL_FS_WRITEV,
+        SYSCALL_FS_MMAP,        /* 30 */
+        SYSCALL_FS_MUNMAP,
+        SYSCALL_IO_RING_SETUP,
+        SYSCALL_IO_RING_ENTER,
+        SYSCALL_FS_IOSTAT,
+        SYSCALL_FS_CLONE,       /* 35 */
    SYSCALL_COUNT
 };
 
@@ -113,6 +122,48 @@ typedef struct msg msg_t;
 /* Return size of message including header */
 #define MSG_SIZE(m) (MSG_T_HEADER_SIZE + m->size)
 
+/*
+ * Asynchronous I/O ring, shared between a process and the kernel (see
+ * io_ring.c). The process fills in submission entries and advances
+ * sq_tail; the kernel advances sq_head as it takes them, and posts a
+ * completion entry for each at cq_tail. The process advances cq_head
+ * as it collects completions. Indexes count up forever and are taken
+ * modulo IO_RING_ENTRIES.
+ */
+enum
+{
+	IO_RING_ENTRIES = 16, /* must be a power of two */
+
+	/* Operations */
+	IO_OP_NOP = 0,
+	IO_OP_READ,      /* fs_read(arg, buf, size) */
+	IO_OP_WRITE,     /* fs_write(arg, buf, size) */
+	IO_OP_MBOX_SEND, /* mbox_send(arg, (msg_t *)buf) */
+	IO_OP_SLEEP      /* sleep for arg milliseconds */
+};
+
+struct io_sqe {
+	int op;
+	int arg;       /* file descriptor, mailbox or milliseconds */
+	char *buf;
+	int size;
+	int user_data; /* handed back in the completion */
+};
+
+struct io_cqe {
+	int res;       /* return value of the operation */
+	int user_data;
+};
+
+struct io_ring {
+	volatile uint32_t sq_head;
+	volatile uint32_t sq_tail;
+	volatile uint32_t cq_head;
+	volatile uint32_t cq_tail;
+	struct io_sqe sq[IO_RING_ENTRIES];
+	struct io_cqe cq[IO_RING_ENTRIES];
+};
+
 /*
  * Structure used for interpreting the process directory in the
  * "filesystem" on the USB stick .
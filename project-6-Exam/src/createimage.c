@@ -1,16 +1,26 @@
+/* for nftw() */
+#define _XOPEN_SOURCE 500
+
 #include <assert.h>
 #include <elf.h>
 #include <errno.h>
+#include <ftw.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "bcache.h"
+#include "fs.h"
+#include "inode.h"
+#include "superblock.h"
+
+/* struct directory_t, the process directory entry, is in common.h */
+
 #define IMAGE_FILE "./image"
 #define ARGS "[--extended] [--vm]" \
-" [--fs] [--kernel] <bootblock> <executable-file> ..."
+" [--fs[=<dir>]] [--fs-blocks=<n>] [--kernel] <bootblock> <executable-file> ..."
 
-#define SECTOR_SIZE 512
 #define OS_SIZE_LOC 2
 #define BOOT_MEM_LOC 0x7c00
 #define OS_MEM_LOC 0x8000
@@ -27,14 +37,10 @@ static struct {
 	int extended;
 	int kernel;
 	int fs;
+	char *fs_dir; /* host directory copied into the filesystem, or NULL */
+	int fs_blocks; /* size of the filesystem */
 } options;
 
-/* process directory entry */
-struct directory_t {
-	int location;
-	int size;
-};
-
 static struct image_t {
 	FILE *img; /* the file pointer to the image file */
 	FILE *fp;  /* the file pointer to the input file */
@@ -63,7 +69,9 @@ static void write_process_directory(struct image_t *im);
 static void process_start(struct image_t *im, int vaddr);
 static void process_end(struct image_t *im);
 
+static int fs_size(char *arg);
 static void reserve_fs_blocks(struct image_t *im, int fs_blocks);
+static void write_fs_blocks(struct image_t *im, char *dir);
 
 int main(int argc, char **argv) {
 	char *progname = argv[0];
@@ -72,6 +80,7 @@ int main(int argc, char **argv) {
 	options.vm = 0;
 	options.extended = 0;
 	options.kernel = 0;
+	options.fs_blocks = FS_BLOCKS;
 	while ((argc > 1) && (argv[1][0] == '-') && (argv[1][1] == '-')) {
 		char *option = &argv[1][2];
 
@@ -87,6 +96,13 @@ int main(int argc, char **argv) {
 		else if (strcmp(option, "fs") == 0) {
 			options.fs = 1;
 		}
+		else if (strncmp(option, "fs=", 3) == 0) {
+			options.fs = 1;
+			options.fs_dir = option + 3;
+		}
+		else if (strncmp(option, "fs-blocks=", 10) == 0) {
+			options.fs_blocks = fs_size(option + 10);
+		}
 		else {
 			error("%s: invalid option\nusage: %s %s\n", progname, progname, ARGS);
 		}
@@ -129,11 +145,6 @@ static void create_images(int nfiles, char *files[]) {
 		/* no vm, the kernel is dealt with just the same as process */
 	}
 
-	if (options.fs == 1) {
-		/* reserve some blocks for the filesystem. */
-		reserve_fs_blocks(&image, 512 + 2);
-	}
-
 	while (nfiles > 0) {
 		create_image(&image, *files);
 		nfiles--;
@@ -144,6 +155,19 @@ static void create_images(int nfiles, char *files[]) {
 		}
 	}
 
+	/*
+	 * the filesystem comes last, after every process, so that
+	 * fs_mkfs() can grow it to the end of the device
+	 */
+	if (options.fs == 1 && options.fs_dir != NULL) {
+		/* a formatted filesystem holding the files of fs_dir */
+		write_fs_blocks(&image, options.fs_dir);
+	}
+	else if (options.fs == 1) {
+		/* reserve room for the filesystem, made at boot. */
+		reserve_fs_blocks(&image, options.fs_blocks);
+	}
+
 	if (options.vm == 0) {
 		/*
 		 * if there is no vm, the os size will include all the
@@ -362,18 +386,310 @@ static void reserve_fs_blocks(struct image_t *im, int fs_blocks) {
 	int left;
 
 	fseek(im->img, 0, SEEK_END);
-	left = fs_blocks * SECTOR_SIZE + 1;
+	left = fs_blocks * BLOCK_SIZE + 1;
 	while (--left)
 		if (fputc(0, im->img) == EOF)
 			break;
 	if (left)
 		error("Unable to reserve %d blocks for filesystem\n", fs_blocks, left);
-	im->nbytes += fs_blocks * SECTOR_SIZE;
+	im->nbytes += fs_blocks * BLOCK_SIZE;
 	/* TODO: print which blocks were reserved */
 	if (options.extended == 1)
 		printf("Reserved %d blocks for the filesystem\n", fs_blocks);
 }
 
+/*
+ * Filesystem built from a host directory (--fs=<dir>). It is
+ * --fs-blocks blocks, FS_BLOCKS unless given, split in block groups
+ * laid out as fs_mkfs() in fs.c lays them out: group 0 holds the
+ * superblock, its bitmap block, the journal and its inode table, the
+ * root directory being inode 0, every other group starts with its
+ * bitmap block and inode table. After them come every directory block,
+ * then the data of every file in one extent, in the order the tree is
+ * walked, so that a file and the files next to it in its directory
+ * are read sequentially. An extent does not cross into the next
+ * group. Files of up to INODE_INLINE_MAX bytes are kept in their
+ * inode instead. Every inode is in group 0.
+ */
+#define CEIL(x, y) ((x) / (y) + ((x) % (y) ? 1 : 0))
+#define FS_TABLE_BLOCKS CEIL(GROUP_INODES, (int)(BLOCK_SIZE / sizeof(disk_inode_t)))
+
+/* A file or directory found in the host tree, its inode is its index */
+struct fs_node {
+	char name[MAX_FILENAME_LEN];
+	char *path;  /* host path, to read the data of a file */
+	int parent;  /* node of the directory holding it */
+	short type;  /* INTYPE_FILE or INTYPE_DIR */
+	int size;    /* bytes, for a file */
+};
+
+static struct fs_node fs_nodes[GROUP_INODES];
+static int fs_nnodes;
+static int fs_dirs[MAX_PATH_LEN]; /* node of the directory at each depth */
+
+static char (*fs_img)[BLOCK_SIZE];
+static int fs_nblocks;
+static int fs_next; /* next free block */
+static short fs_used[FS_GROUPS_MAX]; /* blocks taken in each group */
+static disk_superblock_t *fs_super;
+
+/*
+ * Size of the filesystem for --fs-blocks=<n>. fs_mkfs() drops a last
+ * group too short to hold data, and so does this.
+ */
+static int fs_size(char *arg) {
+	int n = atoi(arg);
+
+	if (n < FS_BLOCKS || n > FS_BLOCKS_MAX)
+		error("--fs-blocks must be from %d to %d\n", FS_BLOCKS, FS_BLOCKS_MAX);
+	if (n % GROUP_BLOCKS != 0 && n % GROUP_BLOCKS <= 1 + FS_TABLE_BLOCKS && n > GROUP_BLOCKS)
+		n -= n % GROUP_BLOCKS;
+	return n;
+}
+
+/* the bitmap block of group g, as group_bitmap_block() in fs.c */
+static int fs_bitmap_block(int g) {
+	return (g == 0) ? 1 : g * GROUP_BLOCKS;
+}
+
+/* must hash as dirindex_hash() in fs.c does */
+static unsigned int fs_name_hash(char *name) {
+	unsigned int h = 0;
+	int i;
+
+	for (i = 0; i < MAX_FILENAME_LEN && name[i] != '\0'; i++)
+		h = h * 31 + (unsigned char)name[i];
+	return h;
+}
+
+/*
+ * mark entry n of the bitmap starting at byte offset of the bitmap
+ * block of group g
+ */
+static void fs_bitmap_set(int g, int offset, int n) {
+	unsigned char *map = (unsigned char *)fs_img[fs_bitmap_block(g)] + offset;
+
+	map[n / 8] |= 0x80 >> (n % 8);
+}
+
+/* take block block in the data block bitmap of its group */
+static void fs_take(int block) {
+	fs_bitmap_set(block / GROUP_BLOCKS, 0, block % GROUP_BLOCKS);
+	fs_used[block / GROUP_BLOCKS]++;
+}
+
+/*
+ * take count contiguous blocks, returning the first; a run that would
+ * reach the next group starts after that group's bitmap and inode table
+ */
+static int fs_alloc(int count) {
+	int end = (fs_next / GROUP_BLOCKS + 1) * GROUP_BLOCKS;
+	int start;
+
+	if (fs_next + count > end && end < fs_nblocks)
+		fs_next = end + 1 + FS_TABLE_BLOCKS;
+	end = (fs_next / GROUP_BLOCKS + 1) * GROUP_BLOCKS;
+	if (fs_next + count > fs_nblocks || fs_next + count > end)
+		error("Filesystem full, %d blocks are not enough\n", fs_nblocks);
+	for (start = fs_next; fs_next < start + count; fs_next++)
+		fs_take(fs_next);
+	return start;
+}
+
+static disk_inode_t *fs_inode(int ino) {
+	int per_block = BLOCK_SIZE / sizeof(disk_inode_t);
+
+	return (disk_inode_t *)fs_img[fs_super->table_placement + ino / per_block] + ino % per_block;
+}
+
+/* nftw() callback, records one file or directory of the host tree */
+static int fs_add_node(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+	struct fs_node *node = &fs_nodes[fs_nnodes];
+	const char *name = path + ftw->base;
+
+	if (flag != FTW_D && flag != FTW_F)
+		error("Unable to read %s\n", path);
+	if (flag == FTW_F && !S_ISREG(st->st_mode)) {
+		fprintf(stderr, "Skipping %s, not a regular file\n", path);
+		return 0;
+	}
+	if (ftw->level >= MAX_PATH_LEN)
+		error("%s is nested too deep\n", path);
+	if (fs_nnodes >= GROUP_INODES)
+		error("Too many files, the filesystem has %d inodes\n", GROUP_INODES);
+	if (ftw->level > 0 && (strlen(name) >= MAX_FILENAME_LEN || name[0] == '.'))
+		error("%s: invalid name for the filesystem\n", path);
+
+	if (ftw->level > 0)
+		strcpy(node->name, name);
+	node->path = strdup(path);
+	node->parent = (ftw->level > 0) ? fs_dirs[ftw->level - 1] : 0;
+	node->type = (flag == FTW_D) ? INTYPE_DIR : INTYPE_FILE;
+	node->size = (flag == FTW_D) ? 0 : st->st_size;
+	if (node->size > BLOCK_SIZE * fs_nblocks)
+		error("%s is too big for the filesystem\n", path);
+	if (flag == FTW_D)
+		fs_dirs[ftw->level] = fs_nnodes;
+	fs_nnodes++;
+	return 0;
+}
+
+/* write directory node ino: ".", "..", its children and, if big, the index */
+static void fs_write_dir(int ino) {
+	static dirent_t entries[INODE_NDIRECT * DIRENTS_PER_BLK];
+	disk_inode_t *inode = fs_inode(ino);
+	uint16_t *index;
+	int n = 0, i, k;
+
+	memset(entries, 0, sizeof(entries));
+	entries[n].inode = ino;
+	strcpy(entries[n++].name, ".");
+	entries[n].inode = fs_nodes[ino].parent;
+	strcpy(entries[n++].name, "..");
+	for (i = 1; i < fs_nnodes; i++) {
+		if (fs_nodes[i].parent != ino)
+			continue;
+		if (n >= DIR_ENTRIES_MAX)
+			error("%s has more than %d entries\n", fs_nodes[ino].path, DIR_ENTRIES_MAX);
+		entries[n].inode = i;
+		strcpy(entries[n++].name, fs_nodes[i].name);
+	}
+
+	inode->type = INTYPE_DIR;
+	inode->nlinks = 1;
+	inode->current_size = n * sizeof(dirent_t);
+	for (i = 0; i < CEIL(n, DIRENTS_PER_BLK); i++) {
+		inode->direct[i] = fs_alloc(1);
+		memcpy(fs_img[inode->direct[i]], &entries[i * DIRENTS_PER_BLK],
+		       DIRENTS_PER_BLK * sizeof(dirent_t));
+	}
+	if (n <= DIRENTS_PER_BLK)
+		return;
+
+	inode->flags |= INFLAG_DIRINDEX;
+	inode->indirect = fs_alloc(1);
+	index = (uint16_t *)fs_img[inode->indirect];
+	for (k = 0; k < n; k++) {
+		unsigned int h = fs_name_hash(entries[k].name);
+
+		for (i = h % DIRINDEX_SLOTS; index[i] != DIRINDEX_EMPTY; i = (i + 1) % DIRINDEX_SLOTS)
+			;
+		index[i] = DIRINDEX_SLOT(h, k);
+	}
+}
+
+/* write the data of file node ino in the inode, or as one extent */
+static void fs_write_file(int ino) {
+	disk_inode_t *inode = fs_inode(ino);
+	int blocks = CEIL(fs_nodes[ino].size, BLOCK_SIZE);
+	char *data;
+	FILE *fp;
+
+	inode->type = INTYPE_FILE;
+	inode->nlinks = 1;
+	inode->current_size = fs_nodes[ino].size;
+	if (fs_nodes[ino].size <= INODE_INLINE_MAX) {
+		inode->flags = INFLAG_INLINE;
+		data = inode->data;
+	}
+	else {
+		inode->flags = INFLAG_EXTENTS;
+		inode->extents[0].start = fs_alloc(blocks);
+		inode->extents[0].length = blocks;
+		data = fs_img[inode->extents[0].start];
+	}
+
+	fp = fopen(fs_nodes[ino].path, "r");
+	if (fp == NULL)
+		error("Unable to open %s\n", fs_nodes[ino].path);
+	if (fread(data, 1, fs_nodes[ino].size, fp) != (size_t)fs_nodes[ino].size)
+		error("Unable to read %s\n", fs_nodes[ino].path);
+	fclose(fp);
+}
+
+static void write_fs_blocks(struct image_t *im, char *dir) {
+	struct journal_header {
+		int magic;
+		int sequence;
+		int count;
+	} *jheader;
+	int ngroups, ndata_blks, used, size, g, i;
+
+	fs_nblocks = options.fs_blocks;
+	ngroups = CEIL(fs_nblocks, GROUP_BLOCKS);
+	fs_img = calloc(fs_nblocks, BLOCK_SIZE);
+	if (fs_img == NULL)
+		error("Unable to allocate %d blocks\n", fs_nblocks);
+	fs_super = (disk_superblock_t *)fs_img[0];
+
+	if (nftw(dir, fs_add_node, 16, FTW_PHYS) != 0)
+		error("Unable to walk %s\n", dir);
+	if (fs_nnodes == 0 || fs_nodes[0].type != INTYPE_DIR)
+		error("%s is not a directory\n", dir);
+
+	/* superblock, bitmap and journal, as fs_mkfs() places them */
+	fs_next = 0;
+	fs_alloc(1);
+	fs_super->bitmap_placement = fs_alloc(1);
+	fs_super->journal_placement = fs_alloc(JOURNAL_BLOCKS);
+	fs_super->journal_blocks = JOURNAL_BLOCKS;
+	assert(fs_super->journal_placement == JOURNAL_START);
+	jheader = (struct journal_header *)fs_img[JOURNAL_START];
+	jheader->magic = JOURNAL_MAGIC;
+
+	/* inode table, then an inode for every file and directory */
+	fs_super->table_placement = fs_alloc(FS_TABLE_BLOCKS);
+	for (i = 0; i < fs_nnodes; i++)
+		fs_bitmap_set(0, BITMAP_BYTES, i);
+
+	/* the bitmap block and inode table of every other group */
+	for (g = 1; g < ngroups; g++)
+		for (i = 0; i < 1 + FS_TABLE_BLOCKS; i++)
+			fs_take(g * GROUP_BLOCKS + i);
+
+	/* directories first, then the file data */
+	for (i = 0; i < fs_nnodes; i++)
+		if (fs_nodes[i].type == INTYPE_DIR)
+			fs_write_dir(i);
+	for (i = 0; i < fs_nnodes; i++)
+		if (fs_nodes[i].type == INTYPE_FILE)
+			fs_write_file(i);
+
+	/* the blocks past the end of the filesystem are never free */
+	for (i = fs_nblocks; i < ngroups * GROUP_BLOCKS; i++)
+		fs_bitmap_set(ngroups - 1, 0, i % GROUP_BLOCKS);
+
+	/* data blocks are the inode tables and what was taken after them */
+	ndata_blks = 0;
+	used = 0;
+	for (g = 0; g < ngroups; g++) {
+		size = (fs_nblocks - g * GROUP_BLOCKS < GROUP_BLOCKS) ? fs_nblocks - g * GROUP_BLOCKS : GROUP_BLOCKS;
+		fs_super->groups[g].free_blocks = size - fs_used[g];
+		fs_super->groups[g].free_inodes = GROUP_INODES;
+		ndata_blks += fs_used[g] - ((g == 0) ? fs_super->table_placement : 1);
+		used += fs_used[g];
+	}
+	fs_super->groups[0].free_inodes = GROUP_INODES - fs_nnodes;
+
+	fs_super->magic = FS_MAGIC;
+	fs_super->ninodes = ngroups * GROUP_INODES;
+	fs_super->ndata_blks = ndata_blks;
+	fs_super->nblocks = fs_nblocks;
+	fs_super->ngroups = ngroups;
+	fs_super->root_inode = 0;
+	fs_super->max_filesize = FILE_SIZE_MAX;
+	fs_super->block_size = BLOCK_SIZE;
+
+	fseek(im->img, 0, SEEK_END);
+	if (fwrite(fs_img, BLOCK_SIZE, fs_nblocks, im->img) != (size_t)fs_nblocks)
+		error("Unable to write the filesystem\n");
+	im->nbytes += fs_nblocks * BLOCK_SIZE;
+	if (options.extended == 1)
+		printf("Filesystem from %s: %d files and directories, %d of %d blocks used\n",
+		       dir, fs_nnodes, used, fs_nblocks);
+	free(fs_img);
+}
+
 /* print an error message and exit */
 static void error(char *fmt, ...) {
 	va_list args;
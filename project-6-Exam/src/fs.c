@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #endif /* LINUX_SIM */
 
+#include "bcache.h"
 #include "block.h"
 #include "common.h"
 #include "fs_error.h"
@@ -16,149 +17,828 @@
 #include "thread.h"
 #include "util.h"
 
-#define BITMAP_ENTRIES 256
+#ifndef LINUX_SIM
+#include "memory.h"
+#endif /* !LINUX_SIM */
 
-static char inode_bmap[BITMAP_ENTRIES];
-static char dblk_bmap[BITMAP_ENTRIES];
-
-static int get_free_entry(unsigned char *bitmap);
-static int free_bitmap_entry(int entry, unsigned char *bitmap);
+/*
+ * Allocation bitmap of one block group. Only one group of each bitmap
+ * is kept in memory, in map, and another is loaded when an entry of
+ * that group is needed. map holds the entries bits stored at byte
+ * offset of the group's bitmap block, local entry n being bit
+ * (0x80 >> (n % 8)) of byte n / 8. Entries are numbered across the
+ * whole file system, entry n is in group n / entries. hint is the
+ * word where the next search for a free entry starts. Changes set
+ * dirty and super_block.dirty; the map is written back when another
+ * group is loaded or by fs_sync().
+ */
+#define BITMAP_WORD_BITS 32
+
+struct bitmap {
+    uint32_t map[BITMAP_BYTES / sizeof(uint32_t)];
+    int entries; /* GROUP_BLOCKS or GROUP_INODES */
+    int offset;  /* of the map in the bitmap block */
+    int group;   /* loaded in map, -1 if none */
+    int dirty;
+    int hint;
+};
+
+static struct bitmap inode_bmap = {.entries = GROUP_INODES, .offset = BITMAP_BYTES, .group = -1};
+static struct bitmap dblk_bmap = {.entries = GROUP_BLOCKS, .offset = 0, .group = -1};
+
+#define BLOCK_GROUP(block) ((block) / GROUP_BLOCKS)
+#define INODE_GROUP(inode) ((inode) / GROUP_INODES)
+
+static int get_free_entry(struct bitmap *bitmap, int group);
+static int get_free_run(struct bitmap *bitmap, int group, int count, int *start);
+static int get_bitmap_entry(int entry, struct bitmap *bitmap);
+static int free_bitmap_entry(int entry, struct bitmap *bitmap);
+static void bitmap_store(struct bitmap *bitmap);
+static void bitmap_load(struct bitmap *bitmap, int group, int fresh);
+static int group_bitmap_block(int group);
+static int group_table_block(int group);
 static inode_t name2inode(char *name);
 static blknum_t ino2blk(inode_t ino, int offset);
 static blknum_t idx2blk(int index);
+static int icache_flush(void);
+static int do_sync(void);
+static void txn_begin(void);
+static int txn_end(void);
+static int txn_step(void);
+static int do_lseek(int fd, int offset, int whence);
+static blknum_t alloc_data_block(int group, int clear);
+static void free_data_block(blknum_t block);
+static int dir_find(disk_inode_t *dir, char *name, dirent_t *entry);
+struct removal;
+static void free_indirect(blknum_t ind, int depth, struct removal *r);
+static int delay_flush(mem_inode_t *inode);
+static void delay_drop(mem_inode_t *inode);
+static int do_mkfile(char *filename);
+disk_inode_t read_inode_table(int inode_num);
+void write_inode2table(int inode_num, disk_inode_t inode);
+
+#define INODE_TABLE_ENTRIES 64
+
+/* Number of inode cache hash chains, must be a power of two */
+#define ICACHE_HASH_SIZE 32
+#define ICACHE_HASH(inode_num) ((inode_num) & (ICACHE_HASH_SIZE - 1))
+
+/*
+ * Transactions. Operations that change the file system run one at a
+ * time under txn_lock, and what each changes joins the transaction
+ * being built in the block cache, which is committed between two
+ * operations: when FS_GROUP_OPS of them, from any process, have
+ * finished (group commit), when fs_sync() is called or when the
+ * journal has less than FS_TXN_STEP blocks of room left. A step is
+ * what an operation changes between two points where the file system
+ * is consistent; most operations are one step, and the few that can
+ * change more metadata than the journal holds (large writes, removing
+ * and cloning large files) commit at such points in between, where at
+ * worst a crash leaves blocks that are never freed.
+ */
+#define FS_GROUP_OPS 8
+#define FS_TXN_STEP 8
+static int group_ops = 0;
+
+/*
+ * Blocks freed in the transaction being built stay set in the bitmap
+ * until it commits, so they are not reused, and written over, while a
+ * crash would still bring back the file that had them. A step frees at
+ * most FS_TXN_FREES blocks. Under fs_lock.
+ */
+#define FS_FREED_MAX 256
+#define FS_TXN_FREES 64
+static blknum_t freed_blocks[FS_FREED_MAX];
+static int freed_count = 0;
+
+// The uncommitted metadata cannot be evicted, so the journal must fit in the cache next to the held blocks
+#if JOURNAL_BLOCKS - 1 > BCACHE_ENTRIES / 3
+#error "the journal holds more blocks than the block cache can keep uncommitted"
+#endif
+
+/*
+ * Block I/O accounting, see fs_iostat(). The block cache counters are
+ * shared, so calls of different processes that overlap in time are
+ * each charged the I/O done in between by all of them. A page fault
+ * on a mapped file taken inside another call is charged to that
+ * call, which the process' fs_depth keeps track of.
+ */
+static struct fs_iostat iostat[FS_OP_COUNT];
 
-#define INODE_TABLE_ENTRIES 20
+// Block cache counters and time stamp counter at the start of a call
+struct iostat_mark {
+    bcache_stats_t io;
+    unsigned long long start;
+};
 #define CEIL(x, y) ((x) / (y) + ((x) % (y) ? 1 : 0))
 #define DISK_INODE_IN_BLOCK_MAX (int)(BLOCK_SIZE / sizeof(disk_inode_t))
-#define DISK_INODE_MAX (int)(CEIL((BITMAP_ENTRIES), DISK_INODE_IN_BLOCK_MAX))
+// Inode table blocks of a block group
+#define DISK_INODE_MAX (int)(CEIL((GROUP_INODES), DISK_INODE_IN_BLOCK_MAX))
+
+/*
+ * A block can be more than a kernel stack can spare, so pointer and
+ * directory blocks are read onto the stack FS_SCAN_BYTES at a time.
+ */
+#define FS_SCAN_BYTES 512
+#define PTRS_PER_SCAN (int)(FS_SCAN_BYTES / sizeof(blknum_t))
+#define DIRENTS_PER_SCAN (int)(FS_SCAN_BYTES / sizeof(dirent_t))
+#define INODES_PER_SCAN (int)(FS_SCAN_BYTES / sizeof(disk_inode_t))
 
+// Largest number of blocks moved by one transfer in fs_read and fs_write (16 KB)
+#define FS_IO_RUN_MAX (16384 / BLOCK_SIZE)
+
+// Bytes of a large write allocated in one transaction step
+#define FS_TXN_WRITE (32 * BLOCK_SIZE)
+
+/*
+ * Whole blocks that straddle two iovec segments are gathered into (or
+ * scattered from) a staging buffer of this many blocks (4 KB), so they
+ * can still share one transfer.
+ */
+#define FS_IO_STAGE_BLOCKS (4096 / BLOCK_SIZE)
+static char io_stage[FS_IO_STAGE_BLOCKS * BLOCK_SIZE];
+
+// A block of zeros, for clearing blocks and reading holes
+static char zero_block[BLOCK_SIZE];
+
+/*
+ * Delayed allocation. Blocks that small writes (less than a block)
+ * add past the end of a file are not given disk blocks by fs_write:
+ * their data is held in the block cache under a tag
+ * (block_delay_write) and only the file size changes. delay_first
+ * and delay_count of the inode name the held blocks, always the last
+ * ones of the file. They are allocated at once, as a run sized to
+ * the whole tail, and written out in contiguous runs when the file
+ * is closed, on fs_sync(), when more than FS_DELAY_MAX blocks are
+ * held (the biggest tails first) or when the oldest one has been held
+ * FS_DELAY_CYCLES. Small appends just copy into the cache. Held
+ * buffers cannot be evicted, so FS_DELAY_MAX is a hard limit: a write
+ * that would go past it is given its disk blocks at once.
+ *
+ * Held blocks must find disk blocks when they are flushed, so other
+ * allocations leave FS_DELAY_RESERVE free blocks to them: the held
+ * blocks themselves, and the pointer blocks placing them can take. A
+ * held file may need up to five, and files switched from extents to
+ * block pointers at most one per PTRS_PER_BLK blocks of the disk.
+ */
+#define FS_DELAY_MAX (BCACHE_ENTRIES / 3)
+#define FS_DELAY_CYCLES (1ULL << 31)
+#define FS_DELAY_RESERVE(held) (6 * (held) + super_block.d_super.nblocks / PTRS_PER_BLK)
+#define DELAY_TAG(inode, block_idx) (BCACHE_DELAY_TAG + (int)(((inode) - global_inode_table) << 24) + (block_idx))
+static int delay_blocks = 0;
+static int delay_placing = 0; /* in delay_flush(), may use the reserve */
+static unsigned long long delay_start;
+
+/*
+ * Reads of whole pages into page-aligned memory go from the device
+ * straight into the pages (block_read_direct) and skip the block
+ * cache, so bulk reads cost no extra copy.
+ */
+#define FS_PAGE_SIZE 4096
+#define FS_PAGE_BLOCKS (FS_PAGE_SIZE / BLOCK_SIZE)
+
+/*
+ * In-memory inode cache. Every inode the file system touches is read
+ * into this table and modified here; dirty entries are written back
+ * by fs_sync() or when their slot is reused. open_count works as a
+ * reference count: entries of open files are never reused. Entries
+ * are found through hash chains on the inode number, and the entries
+ * that are not open are kept in LRU order, so neither a lookup nor
+ * picking a slot to reuse scans the table.
+ */
 static mem_inode_t global_inode_table[INODE_TABLE_ENTRIES];
+static mem_inode_t *icache_hash[ICACHE_HASH_SIZE];
+static mem_inode_t *icache_lru_head; /* most recently used */
+static mem_inode_t *icache_lru_tail; /* least recently used */
 static mem_superblock_t super_block;
 static int debug_counter = 0;
 
-// Get a free inode
-int get_table_entry() {
-    // Store the table placement
-    int table_placement = super_block.d_super.table_placement;
-    int counter = 0;
+/*
+ * Locking. Processes trap into the file system at the same time and
+ * can be preempted anywhere in it, so what they share is guarded by
+ * locks, always taken in this order:
+ *
+ * txn_lock, the running transaction: held for the whole of an
+ * operation that changes the file system (open, close, the name space
+ * operations, sync and mkfs), so a commit never catches one half done.
+ * Writes and page-outs hold it only while they allocate blocks and
+ * grow the file, and copy their data with the inode locked alone; a
+ * commit waits for the copies under way (txn_copies). Reads,
+ * page-ins, stat and lseek do not take it. Writers pin their pages
+ * before taking it, as a page-out takes it too.
+ *
+ * ns_lock, the name space: held for the whole of an operation on
+ * names or directories (open, mkdir, link, unlink, clone, rmdir,
+ * chdir, reading a directory, mkfs), so those run one at a time. The dentry
+ * cache is under it.
+ *
+ * inode_locks, a reader/writer lock per inode cache slot, over the
+ * file's data, block map, size, position and held blocks. Reads,
+ * page-ins and stat share it, writes, page-outs, lseek and flushing
+ * held blocks take it alone. It is only taken on an entry the caller
+ * holds a reference on, so the slot is not reused under it.
+ *
+ * fs_lock, what every process shares: the bitmaps and the superblock,
+ * the inode cache lists and reference counts, the held block count,
+ * group commit and the iostat counters. It is held around allocation
+ * and cache lookups only.
+ *
+ * txn_lock, ns_lock and fs_lock can be taken again by the process
+ * holding them, as those operations nest. copy_lock, over txn_copies,
+ * is taken with nothing after it. The block cache has a lock of its own,
+ * taken last. The page fault handler calls fs_map_read() and
+ * fs_map_write() with page_map_lock held, so nothing here may page
+ * fault with an inode lock, fs_lock or the block cache lock held:
+ * user buffers are pinned before the inode is locked (user_io()).
+ */
+struct nest_lock {
+    lock_t lock;
+    pcb_t *owner; // process holding it, NULL if free
+    int depth;    // times the owner has taken it
+};
+
+struct inode_lock {
+    lock_t lock;          // guards the fields below, the map cache and the readers' position
+    condition_t unlocked; // broadcast when the lock becomes free
+    int readers;
+    int writer;
+};
+
+static struct nest_lock txn_lock;
+static struct nest_lock ns_lock;
+static struct nest_lock fs_lock;
+static struct inode_lock inode_locks[INODE_TABLE_ENTRIES];
+static lock_t stage_lock; // io_stage
+static lock_t copy_lock;  // txn_copies
+static condition_t copies_done; // broadcast when txn_copies drops to 0
+static int txn_copies;    // writes and page-outs copying data, see txn_release()
+
+#define INODE_LOCK(inode) (&inode_locks[(inode) - global_inode_table])
+
+/*
+ * Directory entry cache. Maps (parent directory inode, name) to the
+ * inode the name refers to, so path lookups do not have to read and
+ * scan directory blocks. Negative entries (inode == FSE_ERROR)
+ * remember names that do not exist.
+ */
+#define DCACHE_ENTRIES 64
+#define DCACHE_HASH_SIZE 32
+
+struct dcache_entry {
+    inode_t parent;    // -1 if the entry is unused
+    inode_t inode;     // FSE_ERROR for a negative entry
+    char name[MAX_FILENAME_LEN];
+    unsigned int last_used;
+    struct dcache_entry *hash_next;
+};
+
+static struct dcache_entry dcache[DCACHE_ENTRIES];
+static struct dcache_entry *dcache_hash[DCACHE_HASH_SIZE];
+static unsigned int dcache_clock = 0;
+
+// Hash a (parent, name) pair to a dentry cache chain
+static int dcache_hashfn(inode_t parent, char *name) {
+    unsigned int h = (unsigned int)parent;
+    for (int i = 0; i < MAX_FILENAME_LEN && name[i] != '\0'; i++) {
+        h = h * 31 + (unsigned char)name[i];
+    }
+    return h & (DCACHE_HASH_SIZE - 1);
+}
 
-    // Iterate through the inode table
-    for (int i = 0; i < DISK_INODE_MAX; i++) {
-        // Read inode table index: i
-        disk_inode_t inode_table[DISK_INODE_IN_BLOCK_MAX];
-        block_read_part(table_placement + i, 0, sizeof(disk_inode_t) * DISK_INODE_IN_BLOCK_MAX, &inode_table);
-        // Iterate through the inode table index
-        for (int j = 0; j < DISK_INODE_IN_BLOCK_MAX; j++) {
-            // Check if the inode is free
-            if (inode_table[j].nlinks == 0) {
-                inode_table[j].nlinks = 1;
-                super_block.d_super.ndata_blks++;
-                // Write inode table back to disk
-                block_modify(table_placement + i, sizeof(disk_inode_t) * j, sizeof(disk_inode_t), &inode_table[j]);
-                block_modify(0, 0, sizeof(disk_inode_t), &super_block.d_super);
-                // Check if we've reached the end of the inode table
-                if (counter >= BITMAP_ENTRIES){
-                    return FSE_BITMAP;
-                }
-                // Return the inode number
-                else {
-                    return counter;
-                }
-            } else {
-                counter++;
-            }
+// Empty the dentry cache
+static void dcache_init(void) {
+    for (int i = 0; i < DCACHE_HASH_SIZE; i++) {
+        dcache_hash[i] = NULL;
+    }
+    for (int i = 0; i < DCACHE_ENTRIES; i++) {
+        dcache[i].parent = -1;
+        dcache[i].hash_next = NULL;
+    }
+}
+
+// Find the cached entry for name in directory parent, or NULL
+static struct dcache_entry *dcache_lookup(inode_t parent, char *name) {
+    struct dcache_entry *entry = dcache_hash[dcache_hashfn(parent, name)];
+    while (entry != NULL) {
+        if (entry->parent == parent && strncmp(entry->name, name, MAX_FILENAME_LEN) == 0) {
+            entry->last_used = ++dcache_clock;
+            return entry;
         }
+        entry = entry->hash_next;
     }
-    return FSE_BITMAP;
+    return NULL;
 }
 
-// Initialize the disk inode table
-void setup_disk_inode_table(){
-    // Iterate through the inode table
-    for (int i = 0; i < DISK_INODE_MAX; i++) {
-        int current_inode_block = get_free_entry((unsigned char*)dblk_bmap);
-        super_block.d_super.ndata_blks++;
-        // Check if we're on the first block of the inode table and store as table placement
-        if(i == 0){
-            super_block.d_super.table_placement = current_inode_block;
+// Unlink an entry from its hash chain and mark it unused
+static void dcache_remove(struct dcache_entry *entry) {
+    struct dcache_entry **p = &dcache_hash[dcache_hashfn(entry->parent, entry->name)];
+    while (*p != NULL) {
+        if (*p == entry) {
+            *p = entry->hash_next;
+            break;
         }
+        p = &(*p)->hash_next;
+    }
+    entry->parent = -1;
+    entry->hash_next = NULL;
+}
+
+// Remember that name in directory parent refers to inode (FSE_ERROR if it does not exist)
+static void dcache_insert(inode_t parent, char *name, inode_t inode) {
+    struct dcache_entry *entry = dcache_lookup(parent, name);
 
-        disk_inode_t temp[DISK_INODE_IN_BLOCK_MAX];
-        // Iterate through the inode table index
-        for (int j = 0; j < DISK_INODE_IN_BLOCK_MAX; j++) {
-            // Check if we've reached the end of the inode table
-            if (super_block.d_super.ninodes >= BITMAP_ENTRIES) {
+    if (entry == NULL) {
+        // Use a free entry, or the least recently used one
+        entry = &dcache[0];
+        for (int i = 0; i < DCACHE_ENTRIES; i++) {
+            if (dcache[i].parent == -1) {
+                entry = &dcache[i];
                 break;
             }
-            // Initialize the inode
-            temp[j].current_size = 0;
-            temp[j].nlinks = 0;
-            temp[j].type = 0;
-            for (int x = 0; x < INODE_NDIRECT; x++) {
-                temp[j].direct[x] = 0;
+            if (dcache[i].last_used < entry->last_used) {
+                entry = &dcache[i];
             }
-            super_block.d_super.ninodes++;
-            get_free_entry((unsigned char*)inode_bmap);
         }
-        block_modify(current_inode_block,  0, sizeof(disk_inode_t) * DISK_INODE_IN_BLOCK_MAX, &temp);
+        if (entry->parent != -1) {
+            dcache_remove(entry);
+        }
+        entry->parent = parent;
+        bzero(entry->name, MAX_FILENAME_LEN);
+        strncpy(entry->name, name, MAX_FILENAME_LEN);
+        int h = dcache_hashfn(parent, name);
+        entry->hash_next = dcache_hash[h];
+        dcache_hash[h] = entry;
     }
-    block_modify(0, 0, sizeof(disk_superblock_t), &super_block);
+    entry->inode = inode;
+    entry->last_used = ++dcache_clock;
 }
 
-// Read inode table from disk and return the inode
-disk_inode_t read_inode_table(int inode_num) {
-    // Create inode table
-    disk_inode_t inode_table[DISK_INODE_IN_BLOCK_MAX];
+// Forget every entry in directory inode, and every name referring to it
+static void dcache_purge_inode(inode_t inode) {
+    for (int i = 0; i < DCACHE_ENTRIES; i++) {
+        if (dcache[i].parent != -1 && (dcache[i].parent == inode || dcache[i].inode == inode)) {
+            dcache_remove(&dcache[i]);
+        }
+    }
+}
+
+// Take a nest_lock, or take it once more if the current process holds it
+static void nest_acquire(struct nest_lock *l) {
+    if (l->owner == current_running) {
+        l->depth++;
+        return;
+    }
+    lock_acquire(&l->lock);
+    l->owner = current_running;
+    l->depth = 1;
+}
+
+// Undo one nest_acquire()
+static void nest_release(struct nest_lock *l) {
+    if (--l->depth == 0) {
+        l->owner = NULL;
+        lock_release(&l->lock);
+    }
+}
+
+static void nest_init(struct nest_lock *l) {
+    lock_init(&l->lock);
+    l->owner = NULL;
+    l->depth = 0;
+}
+
+// Lock an inode for reading, shared with other readers
+static void inode_lock_shared(mem_inode_t *inode) {
+    struct inode_lock *il = INODE_LOCK(inode);
+
+    lock_acquire(&il->lock);
+    while (il->writer) {
+        condition_wait(&il->lock, &il->unlocked);
+    }
+    il->readers++;
+    lock_release(&il->lock);
+}
+
+static void inode_unlock_shared(mem_inode_t *inode) {
+    struct inode_lock *il = INODE_LOCK(inode);
+
+    lock_acquire(&il->lock);
+    if (--il->readers == 0) {
+        condition_broadcast(&il->unlocked);
+    }
+    lock_release(&il->lock);
+}
+
+// Lock an inode for writing, waiting until nobody else has it locked
+static void inode_lock(mem_inode_t *inode) {
+    struct inode_lock *il = INODE_LOCK(inode);
+
+    lock_acquire(&il->lock);
+    while (il->writer || il->readers > 0) {
+        condition_wait(&il->lock, &il->unlocked);
+    }
+    il->writer = 1;
+    lock_release(&il->lock);
+}
+
+// Like inode_lock(), but returns FALSE instead of waiting
+static int inode_trylock(mem_inode_t *inode) {
+    struct inode_lock *il = INODE_LOCK(inode);
+    int locked = FALSE;
+
+    lock_acquire(&il->lock);
+    if (!il->writer && il->readers == 0) {
+        il->writer = 1;
+        locked = TRUE;
+    }
+    lock_release(&il->lock);
+    return locked;
+}
+
+static void inode_unlock(mem_inode_t *inode) {
+    struct inode_lock *il = INODE_LOCK(inode);
+
+    lock_acquire(&il->lock);
+    il->writer = 0;
+    condition_broadcast(&il->unlocked);
+    lock_release(&il->lock);
+}
+
+// Set up the file system locks, once at boot
+static void fs_locks_init(void) {
+    nest_init(&txn_lock);
+    nest_init(&ns_lock);
+    nest_init(&fs_lock);
+    lock_init(&stage_lock);
+    lock_init(&copy_lock);
+    condition_init(&copies_done);
+    txn_copies = 0;
+    for (int i = 0; i < INODE_TABLE_ENTRIES; i++) {
+        lock_init(&inode_locks[i].lock);
+        condition_init(&inode_locks[i].unlocked);
+        inode_locks[i].readers = 0;
+        inode_locks[i].writer = 0;
+    }
+}
+
+/*
+ * Get a free inode, from group if it has one. Returns the inode
+ * number, with nlinks set to claim it, or FSE_BITMAP.
+ */
+int get_table_entry(int group) {
+    nest_acquire(&fs_lock);
+    int inode_num = get_free_entry(&inode_bmap, group);
+    nest_release(&fs_lock);
+
+    if (inode_num == -1) {
+        return FSE_BITMAP;
+    }
+    // Claim the inode through the inode cache
+    disk_inode_t inode = read_inode_table(inode_num);
+    inode.nlinks = 1;
+    write_inode2table(inode_num, inode);
+    return inode_num;
+}
+
+/*
+ * Group for a new directory: the one with the most free blocks among
+ * those with a free inode, so that directories, and the files that go
+ * with them, spread over the file system. Called with fs_lock held.
+ */
+static int dir_group(void) {
+    int best = 0;
+
+    for (int g = 1; g < super_block.d_super.ngroups; g++) {
+        if (super_block.d_super.groups[g].free_inodes > 0 &&
+            (super_block.d_super.groups[best].free_inodes == 0 ||
+             super_block.d_super.groups[g].free_blocks > super_block.d_super.groups[best].free_blocks)) {
+            best = g;
+        }
+    }
+    return best;
+}
+
+/*
+ * Set up block group group of a new file system of nblocks blocks:
+ * both bitmaps cleared, the bitmap block and the inode table taken
+ * and the inode table cleared. Group 0 has its bitmap block and inode
+ * table placed by fs_mkfs().
+ */
+static void setup_group(int group, int nblocks) {
+    int first = group * GROUP_BLOCKS;
+    int size = (nblocks - first < GROUP_BLOCKS) ? nblocks - first : GROUP_BLOCKS;
+
+    super_block.d_super.groups[group].free_blocks = size;
+    super_block.d_super.groups[group].free_inodes = GROUP_INODES;
+    bitmap_load(&inode_bmap, group, TRUE);
+    bitmap_load(&dblk_bmap, group, TRUE);
+
+    // Blocks past the end of a short last group are never free
+    for (int i = size; i < GROUP_BLOCKS; i++) {
+        ((unsigned char*)dblk_bmap.map)[i / 8] |= 0x80 >> (i % 8);
+    }
 
+    block_write(group_bitmap_block(group), zero_block);
+    if (group > 0) {
+        get_bitmap_entry(group_bitmap_block(group), &dblk_bmap);
+    }
+    // The inodes start out cleared
+    for (int i = 0; i < DISK_INODE_MAX; i++) {
+        get_bitmap_entry(group_table_block(group) + i, &dblk_bmap);
+        block_write(group_table_block(group) + i, zero_block);
+        super_block.d_super.ndata_blks++;
+    }
+    super_block.d_super.ninodes += GROUP_INODES;
+}
+
+// Read an inode from the on-disk inode table
+static void inode_disk_read(inode_t inode_num, disk_inode_t *inode) {
     // Calculate which block the inode is in
-    int which_inode_table = (inode_num / DISK_INODE_IN_BLOCK_MAX);
+    int which_inode_table = (inode_num % GROUP_INODES) / DISK_INODE_IN_BLOCK_MAX;
 
-    // Calculate which index in the inode table the inode is ink
+    // Calculate which index in the inode table the inode is in
     int inode_table_index = (inode_num % DISK_INODE_IN_BLOCK_MAX);
 
-    // Read the inode table from disk
-    block_read_part(super_block.d_super.table_placement + which_inode_table, inode_table_index*sizeof(disk_inode_t), sizeof(disk_inode_t), &inode_table[inode_table_index]);
-    
-    // Return the inode
-    return inode_table[inode_table_index];
+    block_read_part(group_table_block(INODE_GROUP(inode_num)) + which_inode_table, inode_table_index*sizeof(disk_inode_t), sizeof(disk_inode_t), inode);
 }
 
-// Write inode to disk
-void write_inode2table(int inode_num, disk_inode_t inode){
-    disk_inode_t inode_table;
-
+// Write an inode to the on-disk inode table
+static void inode_disk_write(inode_t inode_num, disk_inode_t *inode) {
     // Calculate which block the inode is in
-    int which_inode_table = (inode_num / DISK_INODE_IN_BLOCK_MAX);
+    int which_inode_table = (inode_num % GROUP_INODES) / DISK_INODE_IN_BLOCK_MAX;
 
     // Calculate which index in the inode table the inode is in
     int inode_table_index = (inode_num % DISK_INODE_IN_BLOCK_MAX);
 
-    // Read the inode table from disk
-    block_read_part(super_block.d_super.table_placement + which_inode_table, inode_table_index*sizeof(disk_inode_t), sizeof(disk_inode_t), &inode_table);
+    block_modify(group_table_block(INODE_GROUP(inode_num)) + which_inode_table, inode_table_index*sizeof(disk_inode_t), sizeof(disk_inode_t), inode);
+}
+
+// Take an inode cache entry out of the LRU list
+static void icache_lru_remove(mem_inode_t *entry) {
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    }
+    else {
+        icache_lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    }
+    else {
+        icache_lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+// Put an inode cache entry first in the LRU list
+static void icache_lru_push_front(mem_inode_t *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = icache_lru_head;
+    if (icache_lru_head != NULL) {
+        icache_lru_head->lru_prev = entry;
+    }
+    icache_lru_head = entry;
+    if (icache_lru_tail == NULL) {
+        icache_lru_tail = entry;
+    }
+}
+
+// Take an inode cache entry off its hash chain
+static void icache_hash_remove(mem_inode_t *entry) {
+    mem_inode_t **p = &icache_hash[ICACHE_HASH(entry->inode_num)];
+
+    while (*p != NULL) {
+        if (*p == entry) {
+            *p = entry->hash_next;
+            break;
+        }
+        p = &(*p)->hash_next;
+    }
+    entry->hash_next = NULL;
+}
+
+// Empty the inode cache
+static void icache_init(void) {
+    icache_lru_head = NULL;
+    icache_lru_tail = NULL;
+    for (int i = 0; i < ICACHE_HASH_SIZE; i++) {
+        icache_hash[i] = NULL;
+    }
+    for (int i = 0; i < INODE_TABLE_ENTRIES; i++) {
+        bzero((char*)&global_inode_table[i], sizeof(mem_inode_t));
+        global_inode_table[i].inode_num = -1;
+        icache_lru_push_front(&global_inode_table[i]);
+    }
+    delay_blocks = 0;
+}
+
+/*
+ * Take a reference on an inode cache entry, an open entry is never
+ * reused. iref(), iput() and iget() are called with fs_lock held.
+ */
+static void iref(mem_inode_t *entry) {
+    if (entry->open_count++ == 0) {
+        icache_lru_remove(entry);
+    }
+}
+
+// Drop a reference taken by iref()
+static void iput(mem_inode_t *entry) {
+    if (--entry->open_count == 0) {
+        icache_lru_push_front(entry);
+    }
+}
+
+/*
+ * icache_flush:
+ * Write every dirty cached inode back to the inode table, placing the
+ * held blocks of open files first. An open inode is flushed with it
+ * locked, so a write in progress is not caught half done; the others
+ * cannot be locked by anyone. Each inode can take a block of the
+ * journal of its own, so the transaction is committed between two
+ * of them if it fills up. Called with txn_lock and no inode lock held.
+ */
+static int icache_flush(void) {
+    int rc = FSE_OK;
+
+    for (int i = 0; i < INODE_TABLE_ENTRIES; i++) {
+        mem_inode_t *inode = &global_inode_table[i];
+
+        nest_acquire(&fs_lock);
+        if (inode->open_count == 0) {
+            if (inode->inode_num != -1 && inode->dirty) {
+                inode_disk_write(inode->inode_num, &inode->d_inode);
+                inode->dirty = 0;
+            }
+            nest_release(&fs_lock);
+        }
+        else {
+            iref(inode);
+            nest_release(&fs_lock);
+
+            inode_lock(inode);
+            if (delay_flush(inode) != FSE_OK) {
+                rc = FSE_ERROR;
+            }
+            if (inode->dirty) {
+                inode_disk_write(inode->inode_num, &inode->d_inode);
+                inode->dirty = 0;
+            }
+            inode_unlock(inode);
+
+            nest_acquire(&fs_lock);
+            iput(inode);
+            nest_release(&fs_lock);
+        }
+        if (txn_step() != FSE_OK) {
+            rc = FSE_ERROR;
+        }
+    }
+    return rc;
+}
+
+/*
+ * iget:
+ * Returns the inode cache entry for inode_num, reading the inode from
+ * disk if it is not cached. The least recently used entry that is not
+ * open, unused entries first, is reused for it. Returns NULL if every
+ * entry belongs to an open file.
+ */
+static mem_inode_t *iget(inode_t inode_num) {
+    mem_inode_t *entry;
+
+    for (entry = icache_hash[ICACHE_HASH(inode_num)]; entry != NULL; entry = entry->hash_next) {
+        if (entry->inode_num == inode_num) {
+            if (entry->open_count == 0) {
+                icache_lru_remove(entry);
+                icache_lru_push_front(entry);
+            }
+            return entry;
+        }
+    }
+
+    entry = icache_lru_tail;
+    if (entry == NULL) {
+        return NULL;
+    }
+    icache_lru_remove(entry);
+    if (entry->inode_num != -1) {
+        if (entry->dirty) {
+            inode_disk_write(entry->inode_num, &entry->d_inode);
+        }
+        icache_hash_remove(entry);
+    }
+
+    bzero((char*)entry, sizeof(mem_inode_t));
+    inode_disk_read(inode_num, &entry->d_inode);
+    entry->inode_num = inode_num;
+    entry->hash_next = icache_hash[ICACHE_HASH(inode_num)];
+    icache_hash[ICACHE_HASH(inode_num)] = entry;
+    icache_lru_push_front(entry);
+    return entry;
+}
+
+/*
+ * Returns the inode cache entry for inode_num with a reference taken,
+ * or NULL after doing to_disk on the inode table if every slot is
+ * held by an open file.
+ */
+static mem_inode_t *iget_ref(inode_t inode_num, disk_inode_t *inode, void (*to_disk)(inode_t, disk_inode_t *)) {
+    nest_acquire(&fs_lock);
+    mem_inode_t *entry = iget(inode_num);
+    if (entry != NULL) {
+        iref(entry);
+    }
+    else {
+        to_disk(inode_num, inode);
+    }
+    nest_release(&fs_lock);
+    return entry;
+}
+
+// Drop the reference taken by iget_ref()
+static void iput_ref(mem_inode_t *entry) {
+    nest_acquire(&fs_lock);
+    iput(entry);
+    nest_release(&fs_lock);
+}
+
+// Return a copy of an inode, through the inode cache
+disk_inode_t read_inode_table(int inode_num) {
+    disk_inode_t inode;
+    mem_inode_t *entry = iget_ref(inode_num, &inode, inode_disk_read);
+
+    if (entry != NULL) {
+        inode_lock_shared(entry);
+        inode = entry->d_inode;
+        inode_unlock_shared(entry);
+        iput_ref(entry);
+    }
+    return inode;
+}
+
+// Update an inode in the inode cache, it is written to disk later
+void write_inode2table(int inode_num, disk_inode_t inode){
+    mem_inode_t *entry = iget_ref(inode_num, &inode, inode_disk_write);
+
+    if (entry != NULL) {
+        inode_lock(entry);
+        entry->d_inode = inode;
+        entry->dirty = 1;
+        entry->map_leaf = 0;
+        inode_unlock(entry);
+        iput_ref(entry);
+    }
+}
 
-    // Write the inode to the inode table
-    block_modify(super_block.d_super.table_placement + which_inode_table, inode_table_index*sizeof(disk_inode_t), sizeof(disk_inode_t), &inode);
+/*
+ * Add delta to the link count of an inode and return the new count.
+ * It is changed in place, so a write to the file going on meanwhile
+ * is not undone by an old copy of the inode.
+ */
+static int inode_add_links(inode_t inode_num, int delta) {
+    disk_inode_t inode;
+    mem_inode_t *entry = iget_ref(inode_num, &inode, inode_disk_read);
+
+    if (entry == NULL) {
+        inode.nlinks += delta;
+        write_inode2table(inode_num, inode);
+        return inode.nlinks;
+    }
+    inode_lock(entry);
+    int nlinks = entry->d_inode.nlinks += delta;
+    entry->dirty = 1;
+    inode_unlock(entry);
+    iput_ref(entry);
+    return nlinks;
 }
 
 /*
  * Exported functions.
  */
 void fs_init(void) {
+    fs_locks_init();
     block_init();
+    dcache_init();
+    icache_init();
+    freed_count = 0;
+
+    // Finish any metadata transaction a crash cut short, before trusting the superblock
+    journal_open(JOURNAL_START, JOURNAL_BLOCKS - 1);
 
     // Check magic in superblock if there do not make, else make.
     block_read_part(0, 0, sizeof(disk_superblock_t), &super_block.d_super);
 
-    // Check if the file system is initialized
-    if (super_block.d_super.magic != 0x6969){
+    // Check if the file system is initialized, with this block size
+    if (super_block.d_super.magic != FS_MAGIC || super_block.d_super.block_size != BLOCK_SIZE) {
         fs_mkfs();
     }
     else {
-        // Read the bitmap
-        super_block.ibmap = super_block.d_super.bitmap_placement;
-        super_block.dbmap = super_block.d_super.bitmap_placement;
-        block_read_part(super_block.dbmap, 0, BITMAP_ENTRIES, (unsigned char*)dblk_bmap);
-        block_read_part(super_block.ibmap, BITMAP_ENTRIES, BITMAP_ENTRIES, (unsigned char*)inode_bmap);
+        // Bitmaps are read a group at a time, when they are needed
+        inode_bmap.group = -1;
+        dblk_bmap.group = -1;
+        super_block.dirty = 0;
     }
     // Mount the filesystem
     fs_mount();
@@ -168,61 +848,73 @@ void fs_init(void) {
     for (int i = 0; i < MAX_OPEN_FILES; i++) {
         current_running->filedes[i].mode = MODE_UNUSED;
     }
+    current_running->fd_map = 0;
 
-    // Setup global inode table
-    for (int i = 0; i < INODE_TABLE_ENTRIES; i++) {
-        global_inode_table[i].open_count = 0;
-        global_inode_table[i].dirty = 0;
-        global_inode_table[i].pos = 0;
-        global_inode_table[i].inode_num = -1;
-        global_inode_table[i].d_inode.type = 0;
-        global_inode_table[i].d_inode.nlinks = 0;
-        global_inode_table[i].d_inode.current_size = 0;
-        for (int j = 0; j < INODE_NDIRECT; j++) {
-            global_inode_table[i].d_inode.direct[j] = 0;
-        }
-    }
+    bzero((char *)iostat, sizeof(iostat));
 }
 
 /*
- * Make a new file system.
+ * Make a new file system, as big as the device allows.
  * Argument: kernel size
  */
 void fs_mkfs(void) {
-    // Create Superblock
-    super_block.d_super.max_filesize = (BLOCK_SIZE * INODE_NDIRECT);
-    super_block.d_super.magic = 0x6969;
-    super_block.d_super.ninodes = 0;
-    super_block.d_super.ndata_blks = 0;
-    super_block.d_super.max_filesize = (BLOCK_SIZE * INODE_NDIRECT);
-
-
-    // Initialize inode bitmap and datablock bitmap
-    for (int i = 0; i < BITMAP_ENTRIES; i++) {
-        inode_bmap[i] = 0;
-        dblk_bmap[i] = 0;
+    int nblocks = block_dev_size();
+
+    txn_begin();
+    nest_acquire(&ns_lock);
+    nest_acquire(&fs_lock);
+
+    // Forget names and inodes from any previous file system
+    journal_close();
+    dcache_init();
+    icache_init();
+    freed_count = 0;
+    inode_bmap.group = -1;
+    dblk_bmap.group = -1;
+
+    // Size the file system, dropping a last group too short to hold data
+    if (nblocks < FS_BLOCKS) {
+        nblocks = FS_BLOCKS;
+    }
+    if (nblocks > FS_BLOCKS_MAX) {
+        nblocks = FS_BLOCKS_MAX;
+    }
+    if (nblocks % GROUP_BLOCKS != 0 && nblocks % GROUP_BLOCKS <= 1 + DISK_INODE_MAX && nblocks > GROUP_BLOCKS) {
+        nblocks -= nblocks % GROUP_BLOCKS;
     }
 
-    // Allocate first inode for root directory
-    int super_block_entry = get_free_entry((unsigned char*)dblk_bmap);
-
-    // Allocate second data block for the bitmap
-    super_block.d_super.bitmap_placement = get_free_entry((unsigned char*)dblk_bmap);
+    // Create Superblock
+    bzero((char*)&super_block.d_super, sizeof(disk_superblock_t));
+    super_block.d_super.max_filesize = FILE_SIZE_MAX;
+    super_block.d_super.magic = FS_MAGIC;
+    super_block.d_super.block_size = BLOCK_SIZE;
+    super_block.d_super.nblocks = nblocks;
+    super_block.d_super.ngroups = CEIL(nblocks, GROUP_BLOCKS);
+
+    // Superblock, bitmap block and journal, then the inode table of group 0
+    super_block.d_super.bitmap_placement = 1;
+    super_block.d_super.journal_placement = JOURNAL_START;
+    super_block.d_super.journal_blocks = JOURNAL_BLOCKS;
+    super_block.d_super.table_placement = JOURNAL_START + JOURNAL_BLOCKS;
+
+    // Set up every group, group 0 last so its bitmaps stay loaded
+    for (int g = super_block.d_super.ngroups - 1; g >= 0; g--) {
+        setup_group(g, nblocks);
+    }
+    for (int i = 0; i < JOURNAL_START + JOURNAL_BLOCKS; i++) {
+        get_bitmap_entry(i, &dblk_bmap);
+    }
+    blknum_t root_block = get_free_entry(&dblk_bmap, 0);
+    nest_release(&fs_lock);
 
-    // Setup inode table and write to disk
-    setup_disk_inode_table();
     // Setup root directory inode
-    int current_inode = get_table_entry();
+    int current_inode = get_table_entry(0);
     disk_inode_t root_inode = read_inode_table(current_inode);
-    root_inode.direct[0] = get_free_entry((unsigned char*)dblk_bmap);
+    root_inode.direct[0] = root_block;
 
     // Create root directory entries "." and ".."
-    dirent_t root[DIRENTS_PER_BLK];
-    for (int i = 0; i < DIRENTS_PER_BLK; i++) {
-        root[i].inode = (inode_t)0;
-        bzero((char*)root[i].name, MAX_FILENAME_LEN);
-        root[i].name[0] = '\0';
-    }
+    dirent_t root[2];
+    bzero((char*)root, sizeof(root));
 
     root[0].inode = current_inode;
     bzero((char*)root[0].name, MAX_FILENAME_LEN);
@@ -237,19 +929,22 @@ void fs_mkfs(void) {
     root_inode.nlinks = 1;
     root_inode.current_size = sizeof(dirent_t) * 2;
     super_block.d_super.root_inode = current_inode;
-    
-    // Store the bitmap placement in the superblock
-	super_block.ibmap = super_block.d_super.bitmap_placement;
-    super_block.dbmap = super_block.d_super.bitmap_placement;
 
     // Write superblock to disk
-    block_write(super_block_entry, &super_block.d_super);
+    block_modify(0, 0, sizeof(disk_superblock_t), &super_block.d_super);
 
-    // Write root directory entries to disk
-    block_write(root_inode.direct[0], &root);
+    // Write root directory entries to disk, the rest of the block empty
+    block_write(root_inode.direct[0], zero_block);
+    block_modify(root_inode.direct[0], 0, sizeof(root), &root);
 
     // Write root directory inode to disk
     write_inode2table(current_inode, root_inode);
+
+    // Make the new file system durable, through the new journal
+    journal_create(JOURNAL_START, JOURNAL_BLOCKS - 1);
+    do_sync();
+    nest_release(&ns_lock);
+    txn_end();
 }
 
 // Mount the filesystem
@@ -257,42 +952,197 @@ void fs_mount(void) {
     current_running->cwd = super_block.d_super.root_inode;
 }
 
-// Update the bitmap
-void fs_update_bitmap(void) {
-    block_modify((int)super_block.dbmap, 0, BITMAP_ENTRIES, (unsigned char*)dblk_bmap);
-    block_modify((int)super_block.ibmap, BITMAP_ENTRIES, BITMAP_ENTRIES, (unsigned char*)inode_bmap);
+/*
+ * txn_store:
+ * Put the dirty cached inodes, the bitmaps and the free counts of the
+ * superblock in the block cache, where they join the transaction being
+ * built. Called with txn_lock held: no operation is changing them.
+ */
+static void txn_store(void) {
+    nest_acquire(&fs_lock);
+    for (int i = 0; i < INODE_TABLE_ENTRIES; i++) {
+        mem_inode_t *inode = &global_inode_table[i];
+        if (inode->inode_num != -1 && inode->dirty) {
+            inode_disk_write(inode->inode_num, &inode->d_inode);
+            inode->dirty = 0;
+        }
+    }
+    if (super_block.dirty) {
+        fs_update_bitmap();
+    }
+    nest_release(&fs_lock);
 }
 
-/* Extract every directory name out of a path. This consists of replacing every /
- * with '\0' (Taken from shell_sim.c and modified a bit)*/ 
-int parse_path(char *path, char *argv[MAX_PATH_LEN], char buf[MAX_FILENAME_LEN * 2]) {
-    char *s = path;
-    int argc = 0;
-    char *p = buf;  // pointer to the current position in buf
-
-    // Handle the root directory as a special case
-    if (*s == '/') {
-        argv[argc++] = "/";
-        s++;
+/*
+ * txn_commit:
+ * Commit the transaction being built, called with txn_lock held at a
+ * consistent point. Returns FSE_ERROR if it could not be committed
+ * whole: one too large for the journal is written in place instead.
+ */
+static int txn_commit(void) {
+    // Writes already in the transaction get their data into the cache first
+    lock_acquire(&copy_lock);
+    while (txn_copies > 0) {
+        condition_wait(&copy_lock, &copies_done);
     }
+    lock_release(&copy_lock);
 
-    while (*s != '\0') {
-        argv[argc] = p;
-        while (*s != '/' && *s != '\0') {
-            *p++ = *s++;
-        }
-        *p++ = '\0';  // null terminate the directory/file name
-        argc++;
-
-        // Skip the '/' character
-        if (*s == '/') {
-            s++;
-        }
+    // What the transaction freed is free once it commits
+    nest_acquire(&fs_lock);
+    while (freed_count > 0) {
+        free_bitmap_entry(freed_blocks[--freed_count], &dblk_bmap);
     }
-    return argc;
+    nest_release(&fs_lock);
+
+    txn_store();
+    int rc = (block_flush() == 0) ? FSE_OK : FSE_ERROR;
+    nest_acquire(&fs_lock);
+    group_ops = 0;
+    nest_release(&fs_lock);
+    return rc;
 }
 
-// Validate the name of a file or directory
+/*
+ * True if the next step of an operation might not fit in the journal,
+ * with the inodes, bitmaps and superblock txn_store() adds to it, or
+ * might free more blocks than freed_blocks has room for.
+ */
+static int txn_full(void) {
+    return journal_room() < FS_TXN_STEP || freed_count > FS_FREED_MAX - FS_TXN_FREES;
+}
+
+// Commit at a consistent point inside an operation, if the journal is filling up
+static int txn_step(void) {
+    return txn_full() ? txn_commit() : FSE_OK;
+}
+
+// Start an operation that changes the file system, called with no other file system lock held
+static void txn_begin(void) {
+    nest_acquire(&txn_lock);
+}
+
+/*
+ * txn_end:
+ * Finish an operation started by txn_begin(). The outermost one
+ * stores what the operation changed in the block cache, so the room
+ * left in the journal is known, and commits the transaction if its
+ * group is complete or the journal is filling up. Returns FSE_ERROR if
+ * that commit failed.
+ */
+static int txn_end(void) {
+    int rc = FSE_OK;
+
+    if (txn_lock.depth == 1) {
+        nest_acquire(&fs_lock);
+        int sync = (group_ops >= FS_GROUP_OPS);
+        nest_release(&fs_lock);
+        if (sync) {
+            rc = do_sync();
+        }
+        else {
+            txn_store();
+            rc = txn_step();
+        }
+    }
+    nest_release(&txn_lock);
+    return rc;
+}
+
+/*
+ * txn_release:
+ * Like txn_end(), for a write or page-out that still has its inode
+ * locked: a complete group is left for the next operation to commit,
+ * as a group commit locks every open inode. If copy is TRUE the caller
+ * goes on to copy its data, and commits wait until it calls
+ * txn_copied().
+ */
+static int txn_release(int copy) {
+    int rc = FSE_OK;
+
+    if (txn_lock.depth == 1) {
+        txn_store();
+        rc = txn_step();
+    }
+    if (copy) {
+        lock_acquire(&copy_lock);
+        txn_copies++;
+        lock_release(&copy_lock);
+    }
+    nest_release(&txn_lock);
+    return rc;
+}
+
+// The data copy announced to txn_release() is in the block cache
+static void txn_copied(void) {
+    lock_acquire(&copy_lock);
+    if (--txn_copies == 0) {
+        condition_broadcast(&copies_done);
+    }
+    lock_release(&copy_lock);
+}
+
+/*
+ * Place the held blocks and commit everything, then write all cached
+ * file system blocks back to disk. Called with txn_lock held and no
+ * inode lock held. Returns FSE_ERROR if anything could not be written
+ * or committed whole.
+ */
+static int do_sync(void) {
+    // Held file data first, placing it changes the inodes and bitmaps
+    int rc = icache_flush();
+    if (txn_commit() != FSE_OK) {
+        rc = FSE_ERROR;
+    }
+    return rc;
+}
+
+// An operation changing the file system has finished, txn_end() commits its group
+static void fs_op_done(void) {
+    nest_acquire(&fs_lock);
+    group_ops++;
+    nest_release(&fs_lock);
+}
+
+// Update the bitmaps, and the free counts in the superblock
+void fs_update_bitmap(void) {
+    nest_acquire(&fs_lock);
+    bitmap_store(&dblk_bmap);
+    bitmap_store(&inode_bmap);
+    block_modify(0, 0, sizeof(disk_superblock_t), &super_block.d_super);
+    super_block.dirty = 0;
+    nest_release(&fs_lock);
+}
+
+/* Extract every directory name out of a path. This consists of replacing every /
+ * with '\0' (Taken from shell_sim.c and modified a bit)*/ 
+int parse_path(char *path, char *argv[MAX_PATH_LEN], char buf[MAX_FILENAME_LEN * 2]) {
+    char *s = path;
+    int argc = 0;
+    char *p = buf;  // pointer to the current position in buf
+
+    // Handle the root directory as a special case
+    if (*s == '/') {
+        argv[argc++] = "/";
+        s++;
+    }
+
+    while (*s != '\0') {
+        argv[argc] = p;
+        while (*s != '/' && *s != '\0') {
+            *p++ = *s++;
+        }
+        *p++ = '\0';  // null terminate the directory/file name
+        argc++;
+
+        // Skip the '/' character
+        if (*s == '/') {
+            s++;
+        }
+    }
+    return argc;
+}
+
+// Validate the name of a file or directory
 int validate_name(char *name) {
     char banned_names[15][MAX_FILENAME_LEN] = {".", "..", "/", "", "\0", "*", "?", ":", "<", ">", "|", "\"", "\\"};
     for (int i = 0; i < 15; i++) {
@@ -309,53 +1159,85 @@ int validate_name(char *name) {
 // Create a new inode
 int create_inode(inode_t* inode_num, inode_t found_inode, int inode_type) {
     // Get a free inode
-    *inode_num = get_table_entry();
+    nest_acquire(&fs_lock);
+    int group = (inode_type == INTYPE_DIR) ? dir_group() : INODE_GROUP(found_inode);
+    nest_release(&fs_lock);
+    *inode_num = get_table_entry(group);
+    if (*inode_num < 0) {
+        return FSE_BITMAP;
+    }
 
     // Read inode from disk
     disk_inode_t current_inode = read_inode_table(*inode_num);
 
-    // Give the inode a data block
-    current_inode.direct[0] = get_free_entry((unsigned char*)dblk_bmap);
+    // Regular files start out empty, with their data inline in the inode
+    if (inode_type == INTYPE_FILE) {
+        current_inode.type = INTYPE_FILE;
+        current_inode.nlinks = 1;
+        current_inode.current_size = 0;
+        current_inode.flags = INFLAG_INLINE;
+        bzero(current_inode.data, INODE_INLINE_MAX);
+        write_inode2table(*inode_num, current_inode);
+        return FSE_OK;
+    }
+
+    // Give the directory a data block
+    nest_acquire(&fs_lock);
+    current_inode.direct[0] = get_free_entry(&dblk_bmap, INODE_GROUP(*inode_num));
+    nest_release(&fs_lock);
     int data_block = current_inode.direct[0];
 
-    // Check if we were able to get a free inode and data block
-    if (data_block == -1 || *inode_num == -1) {
+    // Check if we were able to get a free data block, else give the inode back
+    if (data_block == -1) {
+        bzero((char*)&current_inode, sizeof(disk_inode_t));
+        write_inode2table(*inode_num, current_inode);
+        nest_acquire(&fs_lock);
+        free_bitmap_entry(*inode_num, &inode_bmap);
+        nest_release(&fs_lock);
         return FSE_BITMAP;
     }
 
-    dirent_t dir[DIRENTS_PER_BLK];
-    // Null out blocks
-    for (int i = 0; i < DIRENTS_PER_BLK; i++) {
-        dir[i].inode = (inode_t)0;
-        bzero((char*)dir[i].name, MAX_FILENAME_LEN);
-        dir[i].name[0] = '\0';
-    }
+    dirent_t dir[2];
+    // Null out entries, padding included
+    bzero((char*)dir, sizeof(dir));
+
     // Add "." and ".." entries
-    if (inode_type == INTYPE_DIR) {
-        dir[0].inode = *inode_num;
-        bzero((char*)dir[0].name, MAX_FILENAME_LEN);
-        strcpy(dir[0].name, ".");
+    dir[0].inode = *inode_num;
+    strcpy(dir[0].name, ".");
 
-        dir[1].inode = found_inode;
-        bzero((char*)dir[1].name, MAX_FILENAME_LEN);
-        strcpy(dir[1].name, "..");
+    dir[1].inode = found_inode;
+    strcpy(dir[1].name, "..");
 
-        current_inode.type = INTYPE_DIR;
-        current_inode.nlinks = 1;
-        current_inode.current_size = sizeof(dirent_t) * 2;
-    }
-    // Special file case
-    else if (inode_type == INTYPE_FILE) {
-        current_inode.type = INTYPE_FILE;
-        current_inode.nlinks = 1;
-        current_inode.current_size = 0;
-    }
-    // Modify and write inode to disk
-    block_modify(data_block, 0, sizeof(dirent_t) * DIRENTS_PER_BLK, &dir);
+    current_inode.type = INTYPE_DIR;
+    current_inode.nlinks = 1;
+    current_inode.current_size = sizeof(dirent_t) * 2;
+
+    // Modify and write inode to disk, the rest of the block empty
+    block_write(data_block, zero_block);
+    block_modify(data_block, 0, sizeof(dir), &dir);
     write_inode2table(*inode_num, current_inode);
     return FSE_OK;
 }
 
+/*
+ * A file being removed. Removing a large file can take more than one
+ * transaction: before a commit in the middle, what is already freed is
+ * cut off the inode and its pointer blocks, so the file, which has no
+ * name by then, never points at a free block.
+ */
+struct removal {
+    inode_t inode_num;
+    disk_inode_t *inode; // the caller's copy, freed parts cleared
+};
+
+// Commit in the middle of a removal if the journal is filling up
+static void remove_step(struct removal *r) {
+    if (txn_full()) {
+        write_inode2table(r->inode_num, *r->inode);
+        txn_commit();
+    }
+}
+
 // Remove inode
 int remove_inode(inode_t inode_num) {
     // Read inode from disk
@@ -366,19 +1248,53 @@ int remove_inode(inode_t inode_num) {
         return FSE_NOTEXIST; // Inode does not exist
     }
 
-    // Clear blocks
+    // Data held for it never got blocks, it is just thrown away
+    mem_inode_t *entry = iget_ref(inode_num, &active_inode, inode_disk_read);
+    if (entry != NULL) {
+        inode_lock(entry);
+        delay_drop(entry);
+        inode_unlock(entry);
+        iput_ref(entry);
+    }
+
+    // Clear blocks, an inline file has none
+    struct removal r = {inode_num, &active_inode};
+    if (active_inode.flags & INFLAG_INLINE) {
+        bzero(active_inode.data, INODE_INLINE_MAX);
+    }
+    else if (active_inode.flags & INFLAG_EXTENTS) {
+        for (int i = 0; i < INODE_NEXTENT; i++) {
+            struct extent *ext = &active_inode.extents[i];
+            while (ext->start != 0 && ext->length > 0) {
+                free_data_block(ext->start + --ext->length);
+                remove_step(&r);
+            }
+        }
+        bzero((char*)active_inode.extents, sizeof(active_inode.extents));
+    }
     for (int i = 0; i < INODE_NDIRECT; i++) {
         if (active_inode.direct[i] != 0) {
-            char buf[BLOCK_SIZE];
-            bzero((char*)&buf, BLOCK_SIZE);
-            block_write(active_inode.direct[i], &buf);
-            free_bitmap_entry(active_inode.direct[i], (unsigned char*)dblk_bmap);
+            free_data_block(active_inode.direct[i]);
             active_inode.direct[i] = 0;
+            remove_step(&r);
         }
     }
+    if (active_inode.flags & INFLAG_DIRINDEX) {
+        free_data_block(active_inode.indirect);
+        active_inode.indirect = 0;
+    }
+    free_indirect(active_inode.indirect, 1, &r);
+    active_inode.indirect = 0;
+    free_indirect(active_inode.dindirect, 2, &r);
+    active_inode.dindirect = 0;
+
+    // The inode number can be reused, so forget every name involving it
+    dcache_purge_inode(inode_num);
 
     // Free inode entry
-    free_bitmap_entry(inode_num, (unsigned char*)inode_bmap);
+    nest_acquire(&fs_lock);
+    free_bitmap_entry(inode_num, &inode_bmap);
+    nest_release(&fs_lock);
     bzero((char*)&active_inode, sizeof(disk_inode_t));
 
     // Write back inode to inode table
@@ -386,137 +1302,252 @@ int remove_inode(inode_t inode_num) {
     return FSE_OK; // Inode removed successfully
 }
 
-// Creater directory entry in parent directory
-int create_directory_entry(inode_t parent_inode_num, char *name, inode_t new_inode_num) {
-    // Read parent inode from table
-    disk_inode_t parent_inode = read_inode_table(parent_inode_num);
-    dirent_t dir[DIRENTS_PER_BLK];
-    int free_entry_found = 0;
-    blknum_t current_block = 0;
-    
-    // Check existing blocks for free entry
-    for (int i = 0; i < INODE_NDIRECT; i++) {
-        current_block = parent_inode.direct[i];
-        if (current_block == 0) {
+/*
+ * Directory layout. The entries of a directory are kept packed: entry
+ * k is slot k % DIRENTS_PER_BLK of direct block k / DIRENTS_PER_BLK,
+ * and current_size is the number of entries times sizeof(dirent_t).
+ * A directory that fits in one block is only that block. A bigger
+ * one also gets a hash index (INFLAG_DIRINDEX) in the block named by
+ * its indirect pointer, which directories do not use otherwise. The
+ * index is an open addressed table of DIRINDEX_SLOTS slots, each
+ * holding eight bits of the name's hash above the entry number plus
+ * one. A lookup reads the index block and, most of the time, only the
+ * one directory block holding the name.
+ */
+
+// Hash a file name for the directory index (createimage.c has a copy)
+static unsigned int dirindex_hash(char *name) {
+    unsigned int h = 0;
+    for (int i = 0; i < MAX_FILENAME_LEN && name[i] != '\0'; i++) {
+        h = h * 31 + (unsigned char)name[i];
+    }
+    return h;
+}
+
+// Read or write entry k of a directory
+static void dir_entry_read(disk_inode_t *dir, int k, dirent_t *entry) {
+    block_read_part(dir->direct[k / DIRENTS_PER_BLK], (k % DIRENTS_PER_BLK) * sizeof(dirent_t), sizeof(dirent_t), entry);
+}
+
+static void dir_entry_write(disk_inode_t *dir, int k, dirent_t *entry) {
+    block_modify(dir->direct[k / DIRENTS_PER_BLK], (k % DIRENTS_PER_BLK) * sizeof(dirent_t), sizeof(dirent_t), entry);
+}
+
+/*
+ * Probe the index of dir for name. Returns the index slot holding
+ * entry k for name if k is not -1, otherwise the slot of name's entry,
+ * or -1 if there is none. The entry found is stored in entry.
+ */
+static int dirindex_probe(disk_inode_t *dir, char *name, int k, dirent_t *entry) {
+    unsigned int h = dirindex_hash(name);
+    uint16_t slot;
+
+    for (int n = 0; n < DIRINDEX_SLOTS; n++) {
+        int i = (h + n) % DIRINDEX_SLOTS;
+        block_read_part(dir->indirect, i * sizeof(uint16_t), sizeof(uint16_t), &slot);
+        if (slot == DIRINDEX_EMPTY) {
+            break;
+        }
+        if (slot == DIRINDEX_DELETED || (slot >> 8) != (h & 0xff)) {
+            continue;
+        }
+        int found = (slot & 0xff) - 1;
+        if (k != -1) {
+            if (found == k) {
+                return i;
+            }
             continue;
         }
-        // Read directory entries from current parent block
-        block_read_part(current_block, 0, sizeof(dirent_t) * DIRENTS_PER_BLK, &dir);
-        // Find free entry
-        for (int j = 0; j < DIRENTS_PER_BLK; j++) {
-            // If free entry found, write new entry to disk
-            if (dir[j].name[0] == '\0') {
-                dir[j].inode = new_inode_num;
-                strcpy(dir[j].name, name);
-                block_modify(current_block, j * sizeof(dirent_t), sizeof(dirent_t), &dir[j]);
-                parent_inode.current_size += sizeof(dirent_t);
-                free_entry_found = 1;
+        dir_entry_read(dir, found, entry);
+        if (strncmp(name, entry->name, MAX_FILENAME_LEN) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Set the index slot for name to entry k (-1 to remove it)
+static void dirindex_set(disk_inode_t *dir, char *name, int old_k, int k) {
+    unsigned int h = dirindex_hash(name);
+    uint16_t slot;
+    dirent_t entry;
+    int i;
+
+    if (old_k != -1) {
+        i = dirindex_probe(dir, name, old_k, &entry);
+    }
+    else {
+        // Find the first empty or deleted slot
+        for (i = h % DIRINDEX_SLOTS; ; i = (i + 1) % DIRINDEX_SLOTS) {
+            block_read_part(dir->indirect, i * sizeof(uint16_t), sizeof(uint16_t), &slot);
+            if (slot == DIRINDEX_EMPTY || slot == DIRINDEX_DELETED) {
                 break;
             }
         }
-        if (free_entry_found) {
-            break;
+    }
+    if (i == -1) {
+        return;
+    }
+    slot = (k == -1) ? DIRINDEX_DELETED : DIRINDEX_SLOT(h, k);
+    block_modify(dir->indirect, i * sizeof(uint16_t), sizeof(uint16_t), &slot);
+}
+
+// Give a directory an index covering all its entries
+static int dirindex_build(disk_inode_t *dir) {
+    int entries = dir->current_size / sizeof(dirent_t);
+    dirent_t entry;
+
+    dir->indirect = alloc_data_block(BLOCK_GROUP(dir->direct[0]), TRUE);
+    if (dir->indirect == 0) {
+        return FSE_BITMAP;
+    }
+    dir->flags |= INFLAG_DIRINDEX;
+    for (int k = 0; k < entries; k++) {
+        dir_entry_read(dir, k, &entry);
+        dirindex_set(dir, entry.name, -1, k);
+    }
+    return FSE_OK;
+}
+
+/*
+ * dir_find:
+ * Returns the number of the entry called name in a directory, and
+ * stores the entry itself in entry. Returns -1 if there is no such
+ * entry.
+ */
+static int dir_find(disk_inode_t *dir, char *name, dirent_t *entry) {
+    if (dir->flags & INFLAG_DIRINDEX) {
+        int i = dirindex_probe(dir, name, -1, entry);
+        if (i == -1) {
+            return -1;
         }
+        uint16_t slot;
+        block_read_part(dir->indirect, i * sizeof(uint16_t), sizeof(uint16_t), &slot);
+        return (slot & 0xff) - 1;
     }
-    
-    // If no free entry found, allocate a new block
-    if (!free_entry_found) {
-        // Check if parent directory is full
-        if (parent_inode.current_size >= (INODE_NDIRECT * BLOCK_SIZE)) {
-            return FSE_INVALIDBLOCK;
+
+    // Small directory, scan its only block
+    int entries = dir->current_size / sizeof(dirent_t);
+    dirent_t dirents[DIRENTS_PER_SCAN];
+    if (entries > DIRENTS_PER_BLK) {
+        entries = DIRENTS_PER_BLK;
+    }
+    for (int base = 0; base < entries; base += DIRENTS_PER_SCAN) {
+        int n = (entries - base < DIRENTS_PER_SCAN) ? entries - base : DIRENTS_PER_SCAN;
+        block_read_part(dir->direct[0], base * sizeof(dirent_t), sizeof(dirent_t) * n, &dirents);
+        for (int k = 0; k < n; k++) {
+            if (dirents[k].name[0] != '\0' && strncmp(name, dirents[k].name, MAX_FILENAME_LEN) == 0) {
+                *entry = dirents[k];
+                return base + k;
+            }
         }
-        // Allocate new block
-        current_block = get_free_entry((unsigned char*)dblk_bmap);
-        if (current_block == -1) {
+    }
+    return -1;
+}
+
+// Creater directory entry in parent directory
+int create_directory_entry(inode_t parent_inode_num, char *name, inode_t new_inode_num) {
+    // Read parent inode from table
+    disk_inode_t parent_inode = read_inode_table(parent_inode_num);
+    int k = parent_inode.current_size / sizeof(dirent_t);
+    blknum_t *block = &parent_inode.direct[k / DIRENTS_PER_BLK];
+    blknum_t new_block = 0;
+    dirent_t dir;
+
+    // Check if parent directory is full
+    if (k >= DIR_ENTRIES_MAX) {
+        return FSE_INVALIDBLOCK;
+    }
+
+    // The new entry goes last, in a new block if the last one is full
+    if (*block == 0) {
+        *block = new_block = alloc_data_block(INODE_GROUP(parent_inode_num), TRUE);
+        if (*block == 0) {
             return FSE_INVALIDBLOCK;
         }
-        // Update parent inode
-        parent_inode.current_size += sizeof(dirent_t);
-        parent_inode.direct[parent_inode.current_size / BLOCK_SIZE] = current_block;
-        dir[0].inode = new_inode_num;
-        strcpy(dir[0].name, name);
-        block_modify(current_block, 0, sizeof(dirent_t), &dir[0]);
     }
-    
+    bzero((char*)&dir, sizeof(dirent_t));
+    dir.inode = new_inode_num;
+    strncpy(dir.name, name, MAX_FILENAME_LEN);
+    dir_entry_write(&parent_inode, k, &dir);
+    parent_inode.current_size += sizeof(dirent_t);
+
+    // Keep the index up to date, or start one when the first block fills up
+    if (parent_inode.flags & INFLAG_DIRINDEX) {
+        dirindex_set(&parent_inode, name, -1, k);
+    }
+    else if (k + 1 > DIRENTS_PER_BLK && dirindex_build(&parent_inode) != FSE_OK) {
+        // Without an index only the first block is searched, so take the entry back
+        bzero((char*)&dir, sizeof(dirent_t));
+        dir_entry_write(&parent_inode, k, &dir);
+        if (new_block != 0) {
+            free_data_block(new_block);
+        }
+        return FSE_BITMAP;
+    }
+
     write_inode2table(parent_inode_num, parent_inode);
+    dcache_insert(parent_inode_num, name, new_inode_num);
     return FSE_OK;
 }
 
 // Remove directory entry from parent directory
 int remove_directory_entry(inode_t parent_inode_num, char* filename ) {
-    dirent_t last_dir;
-    blknum_t last_block = -1;
-    int last_index = -1;
-
     // Read parent inode
     disk_inode_t parent_inode = read_inode_table(parent_inode_num);
-    // Find the last entry first
-    int found = 0;
-    for (int i = 0; i < INODE_NDIRECT; i++) {
-        blknum_t current_block = parent_inode.direct[i];
-        dirent_t dir[DIRENTS_PER_BLK];
-        // Read directory entries from current parent block
-        block_read_part(current_block, 0, sizeof(dirent_t) * DIRENTS_PER_BLK, &dir);
-        // Search for the last entry
-        for (int j = 2; j < DIRENTS_PER_BLK; j++) {
-            // If entry is not empty, store it as the last entry
-            if (dir[j].inode != (inode_t)0) {
-                last_dir = dir[j];
-                last_block = current_block;
-                last_index = j;
-            } else {
-                found = 1;
-                break;
-            }
-        }
-        if (found) {
-            break;
-        }
+    int last = parent_inode.current_size / sizeof(dirent_t) - 1;
+    dirent_t dir, last_dir;
+
+    // Find the entry we are trying to remove, "." and ".." stay
+    int k = dir_find(&parent_inode, filename, &dir);
+    if (k < 2) {
+        return FSE_ERROR;
     }
 
-    // Remove the found entry and replace it with the last entry
-    found = 0;
-    // Find the entry we are trying to remove
-    for (int i = 0; i < INODE_NDIRECT; i++) {
-        blknum_t current_block = parent_inode.direct[i];
-        dirent_t dir[DIRENTS_PER_BLK];
-        block_read_part(current_block, 0, sizeof(dirent_t) * DIRENTS_PER_BLK, &dir);
-		
-		int j = 2;
-        for (; j < DIRENTS_PER_BLK; j++) {
-            // Check if the entry is the one we are trying to remove
-            if (same_string(dir[j].name, filename)) {
-                // Check if the entry is the last entry
-                if (current_block == last_block && j == last_index) {
-                    // This is the last entry, just clear it
-					dir[j].inode = (inode_t)0;
-					dir[j].name[0] = '\0';
-                } else {
-                    // Replace with the last entry
-                    dir[j] = last_dir;
-                }
-                block_modify(current_block, sizeof(dirent_t) * j, sizeof(dirent_t), &dir[j]);
-                found = 1;
-                break;
-            }
-        }
-        if (found) {
-            // Remove the last entry now
-            if (current_block != last_block || j != last_index) {
-                // Only remove the last entry if it's not the same as the one just removed
-                dirent_t empty_dir;
-				bzero((char*)&empty_dir, sizeof(dirent_t));
-                block_modify(last_block, sizeof(dirent_t) * last_index, sizeof(dirent_t), &empty_dir);
-            }
-            parent_inode.current_size -= sizeof(dirent_t);
-            write_inode2table(parent_inode_num, parent_inode);
-            return FSE_OK;
+    // The name no longer exists in this directory
+    dcache_insert(parent_inode_num, filename, FSE_ERROR);
+    if (parent_inode.flags & INFLAG_DIRINDEX) {
+        dirindex_set(&parent_inode, filename, k, -1);
+    }
+
+    // Move the last entry into the hole to keep the entries packed
+    if (k != last) {
+        dir_entry_read(&parent_inode, last, &last_dir);
+        dir_entry_write(&parent_inode, k, &last_dir);
+        if (parent_inode.flags & INFLAG_DIRINDEX) {
+            dirindex_set(&parent_inode, last_dir.name, last, k);
         }
     }
-    return FSE_ERROR;
+    bzero((char*)&dir, sizeof(dirent_t));
+    dir_entry_write(&parent_inode, last, &dir);
+
+    parent_inode.current_size -= sizeof(dirent_t);
+    write_inode2table(parent_inode_num, parent_inode);
+    return FSE_OK;
 }
 
-int fs_open(const char *filename, int mode) {
+/*
+ * fd_alloc:
+ * Give the inode cache entry idx the lowest free file descriptor of
+ * the current process, taking a reference on it. The free descriptors
+ * are the clear bits of fd_map. Returns the descriptor, or
+ * FSE_NOMOREFDTE if all are in use. Called with fs_lock held.
+ */
+static int fd_alloc(int idx, int mode) {
+    uint32_t free = ~current_running->fd_map;
+    int fd = (free != 0) ? __builtin_ctz(free) : MAX_OPEN_FILES;
+
+    if (fd >= MAX_OPEN_FILES) {
+        return FSE_NOMOREFDTE;
+    }
+    current_running->fd_map |= 1u << fd;
+    current_running->filedes[fd].idx = idx;
+    current_running->filedes[fd].mode = mode;
+    iref(&global_inode_table[idx]);
+    return fd;
+}
+
+static int do_open(const char *filename, int mode) {
     int inode_num = name2inode((char*)filename);
     int global_index = 0;
 
@@ -531,7 +1562,7 @@ int fs_open(const char *filename, int mode) {
         }
         // If the file does not exist, create it
 		else  {
-			int ev = fs_mkfile((char*)filename);
+			int ev = do_mkfile((char*)filename);
 			if (ev > 0) {
 				inode_num = ev;
 			}
@@ -544,281 +1575,1587 @@ int fs_open(const char *filename, int mode) {
         return FSE_NOTEXIST;
     }
 
-    // Find free entry in global inode table
-    int found_slot = -1;
-    for (global_index = 0; global_index < INODE_TABLE_ENTRIES; global_index++) {
-        // Check if file is already open
-        if (global_inode_table[global_index].open_count > 0) {
-            // Check if file is already open
-            if (global_inode_table[global_index].inode_num == inode_num) {
-                global_inode_table[global_index].open_count++;
-                found_slot = global_index;
-                break;
-            }
-        }
-        // Check if file is not open
-        else if (global_inode_table[global_index].open_count == 0) {
-            disk_inode_t temp = read_inode_table(inode_num);
-            bcopy((char*)&temp, (char*)&global_inode_table[global_index].d_inode, sizeof(disk_inode_t));
-            // Fill in global inode table entry
-            global_inode_table[global_index].inode_num = inode_num;
-            global_inode_table[global_index].open_count++;
-            global_inode_table[global_index].dirty = 0;
-            global_inode_table[global_index].pos = 0;
-            global_inode_table[global_index].pos_block = 0;
-            found_slot = global_index;
-            break;
-        }
+    // Get the inode from the inode cache, the slot is kept by the descriptor
+    nest_acquire(&fs_lock);
+    mem_inode_t *inode = iget(inode_num);
+    if (inode == NULL) {
+        nest_release(&fs_lock);
+        return FSE_INODETABLEFULL;
     }
-    if (found_slot == -1) {
-        return FSE_ERROR;
+    int found_slot = inode - global_inode_table;
+
+    // The first open of an inode starts reading at the beginning
+    if (inode->open_count == 0) {
+        inode->pos = 0;
+        inode->pos_block = 0;
+        inode->ra_next = 0;
+        inode->ra_window = 0;
     }
 
+    int fd = FSE_ERROR;
     // Check if file is a regular file
     if (global_inode_table[found_slot].d_inode.type == INTYPE_FILE) {
-        for (int i = 0; i < MAX_OPEN_FILES; i++) {
-            // Check if file descriptor is open
-            if (current_running->filedes[i].mode == MODE_UNUSED) {
-                // Fill in file descriptor table entry
-                current_running->filedes[i].idx = found_slot;
-                current_running->filedes[i].mode = mode;
-                if (mode != MODE_RDONLY) {
-                    global_inode_table[found_slot].pos = global_inode_table[found_slot].d_inode.current_size;
-                }
-                return i;
-            } else {
-                return FSE_NOMOREFDTE;
-            }
-        }
+        fd = fd_alloc(found_slot, mode);
     }
-    // Check if file is a directory
-    else if (global_inode_table[found_slot].d_inode.type == INTYPE_DIR) {
-        // Check if write mode is enabled and return error if it is enabled for a directory
-        if (mode == (MODE_WRONLY | MODE_CREAT | MODE_TRUNC)) {
-            return FSE_ERROR;
-        }
-        for (int i = 0; i < MAX_OPEN_FILES; i++) {
-            // Check if file descriptor is open
-            if (current_running->filedes[i].mode == MODE_UNUSED) {
-                current_running->filedes[i].idx = found_slot;
-                current_running->filedes[i].mode = mode;
-                return i;
-            }
-        }
-        return FSE_NOMOREFDTE;
+    // Check if file is a directory, write mode is an error for one
+    else if (global_inode_table[found_slot].d_inode.type == INTYPE_DIR &&
+             mode != (MODE_WRONLY | MODE_CREAT | MODE_TRUNC)) {
+        fd = fd_alloc(found_slot, mode);
     }
-    return FSE_ERROR;
+    nest_release(&fs_lock);
+
+    // Writers start at the end of the file
+    if (fd >= 0 && inode->d_inode.type == INTYPE_FILE && mode != MODE_RDONLY) {
+        inode_lock(inode);
+        inode->pos = inode->d_inode.current_size;
+        inode_unlock(inode);
+    }
+    return fd;
 }
 
-int fs_close(int fd) {
+static int do_close(int fd) {
     // Check if we are trying to close a file descriptor that is not open
-    if (current_running->filedes[fd].mode == MODE_UNUSED) {
+    if (fd < 0 || fd >= MAX_OPEN_FILES || current_running->filedes[fd].mode == MODE_UNUSED) {
         return FSE_ERROR;
     }
-    // Get inode from global inode table
+    // Get inode from global inode table, an io ring borrowing the descriptor sees it open or closed
+    nest_acquire(&fs_lock);
     mem_inode_t* active_inode = &global_inode_table[current_running->filedes[fd].idx];
     current_running->filedes[fd].idx = -1;
     current_running->filedes[fd].mode = MODE_UNUSED;
-
-    // Check if file is open by any other processes
-    if (active_inode->open_count > 1) {
-        active_inode->open_count--;
-    }
-    else {
-        // Check if file is dirty and write to disk if it is
-        if (active_inode->dirty == 1) {
-            write_inode2table(active_inode->inode_num, active_inode->d_inode);
-            active_inode->dirty = 0;
-        }
-        // Clear inode entry in global inode table
-        bzero((char*)&active_inode->d_inode, sizeof(disk_inode_t));
-        active_inode->inode_num = 0;
+    current_running->fd_map &= ~(1u << fd);
+    nest_release(&fs_lock);
+
+    // Place the held blocks, now that the file's size is known
+    inode_lock(active_inode);
+    int rc = delay_flush(active_inode);
+    inode_unlock(active_inode);
+
+    // Drop the reference, the inode stays cached until its slot is needed
+    nest_acquire(&fs_lock);
+    iput(active_inode);
+    if (active_inode->open_count == 0) {
         active_inode->pos = 0;
-        active_inode->open_count = 0;
+        active_inode->pos_block = 0;
     }
-    return 0;
+    nest_release(&fs_lock);
+    // The changes are committed together with those of other operations
+    fs_op_done();
+    return (rc == FSE_OK) ? 0 : rc;
 }
 
-int fs_read(int fd, char *buffer, int size) {
-    // Check if file descriptor is open
-    if (current_running->filedes[fd].mode == MODE_UNUSED) {
-        return FSE_ERROR;
+/*
+ * Block map. The blocks of a file are found through the INODE_NDIRECT
+ * direct pointers, then through the indirect block and last through
+ * the double indirect block, each holding PTRS_PER_BLK pointers. A
+ * pointer of 0 means the block is not allocated. Regular files start
+ * out mapped by extents instead (INFLAG_EXTENTS), and are switched to
+ * pointers if they need more than INODE_NEXTENT runs. They start out
+ * inline (INFLAG_INLINE), with no blocks, until they outgrow
+ * INODE_INLINE_MAX bytes. An extent
+ * starting at block 0, which is the superblock, is a hole. Files are
+ * sparse: blocks that were never written are not allocated and read
+ * as zeros.
+ */
+
+/*
+ * Allocate a data block, cleared if clear is set, in block group
+ * group unless it is full. Freed blocks keep their contents, so blocks
+ * whose old contents could be read back (pointer and directory blocks)
+ * need clearing; a file's data blocks are written whole, or have
+ * their unwritten part cleared (inode_alloc_bytes()). Returns 0 if the
+ * disk is full.
+ */
+static blknum_t alloc_data_block(int group, int clear) {
+    nest_acquire(&fs_lock);
+    int block = get_free_entry(&dblk_bmap, group);
+
+    if (block != -1) {
+        super_block.d_super.ndata_blks++;
+        block_modify(0, 0, sizeof(disk_superblock_t), &super_block.d_super);
     }
-    // Get inode from global inode table
-    mem_inode_t* active_inode = &global_inode_table[current_running->filedes[fd].idx];
-    if (active_inode->d_inode.type == INTYPE_DIR) {
-        // Check if we're trying to read more than a directory
-        if (size > (int)sizeof(dirent_t)) {
-            return FSE_OK;
-        }
-        // Check if file is a directory
-        if (active_inode->d_inode.direct[active_inode->pos_block] != 0) {
-            dirent_t dir;
-            // Simply here to be "used" has no effect on the code
-            fs_lseek(fd, 0, SEEK_CUR);
-            block_read_part(active_inode->d_inode.direct[active_inode->pos_block], active_inode->pos % (sizeof(dirent_t) * DIRENTS_PER_BLK), size, &dir);
-            // If the directory entry is not empty, copy it to the buffer
-            if (dir.name[0] != '\0') {
-                active_inode->pos += size;
-                if (active_inode->pos % (sizeof(dirent_t) * DIRENTS_PER_BLK) == 0) {
-                    active_inode->pos_block++;
-                }
-                bcopy((char *)&dir, buffer, size);
-                return 1;
-            }
-        }
+    nest_release(&fs_lock);
+    if (block == -1) {
         return 0;
     }
+    if (clear) {
+        block_write(block, zero_block);
+    }
+    return block;
+}
 
-    // Check if file is a regular file
-    else if (active_inode->d_inode.type == INTYPE_FILE) {
-        // Check if file is open for reading or reading and writing
-        if (current_running->filedes[fd].mode == (MODE_RDONLY)) {
-            // Check if file is empty
-            if (active_inode->d_inode.current_size == 0) {
-                return FSE_OK;
-            }
-            else {
-                // Get the first available block
-                blknum_t active_block_idx = active_inode->d_inode.direct[active_inode->pos_block];
-                // Set read position to the beginning of the block
-                fs_lseek(fd, 0, SEEK_SET);
-                if (active_block_idx == 0) {
-                    return 0;
-                }
-                // Read the data from the block
-                block_read(active_block_idx, buffer);
+/*
+ * Shared blocks. fs_clone() gives a new file the data blocks of
+ * another instead of copies. A block owned by more than one file
+ * keeps the number of its extra owners in the reference table of its
+ * group, one byte per block in REF_TABLE_BLOCKS blocks that are made
+ * when the group gets its first shared block and kept from then on.
+ * A count of 0 means one owner, or none if the block is free.
+ * free_data_block() drops a reference, and a file about to write to a
+ * shared block gets a copy of its own first (inode_unshare()). The
+ * table is metadata, so changes to it go through the journal. The
+ * counts are read and changed with fs_lock held.
+ */
+#define REF_TABLE_BLOCKS CEIL(GROUP_BLOCKS, BLOCK_SIZE)
+#define REFS_MAX 0xff
 
-                // Update file descriptor
-                active_inode->pos += size;
-                active_inode->pos_block++;
+// Extra owners of a data block
+static int block_refs(blknum_t block) {
+    blknum_t table = super_block.d_super.groups[BLOCK_GROUP(block)].ref_table;
+    int entry = block % GROUP_BLOCKS;
+    unsigned char refs = 0;
 
-                // Return the number of bytes read
-                return size;
-                }
+    if (table != 0) {
+        block_read_part(table + entry / BLOCK_SIZE, entry % BLOCK_SIZE, 1, &refs);
+    }
+    return refs;
+}
+
+// Set the extra owners of a data block, making the table of its group if it has none
+static int block_set_refs(blknum_t block, int refs) {
+    int group = BLOCK_GROUP(block);
+    int entry = block % GROUP_BLOCKS;
+    unsigned char count = refs;
+
+    if (super_block.d_super.groups[group].ref_table == 0) {
+        int start;
+        int length = get_free_run(&dblk_bmap, group, REF_TABLE_BLOCKS, &start);
+        if (length < REF_TABLE_BLOCKS) {
+            for (int i = 0; i < length; i++) {
+                free_bitmap_entry(start + i, &dblk_bmap);
             }
+            return FSE_BITMAP;
         }
-    return FSE_ERROR;
+        for (int i = 0; i < REF_TABLE_BLOCKS; i++) {
+            block_write(start + i, zero_block);
+        }
+        super_block.d_super.groups[group].ref_table = start;
+        super_block.d_super.ndata_blks += REF_TABLE_BLOCKS;
+        block_modify(0, 0, sizeof(disk_superblock_t), &super_block.d_super);
+    }
+    blknum_t table = super_block.d_super.groups[group].ref_table;
+    return (block_modify(table + entry / BLOCK_SIZE, entry % BLOCK_SIZE, 1, &count) == 0) ? FSE_OK : FSE_ERROR;
 }
 
-int fs_write(int fd, char *buffer, int size) {
-    // Get inode from global inode table
-    mem_inode_t* active_inode = &global_inode_table[current_running->filedes[fd].idx];
+/*
+ * Drop a reference to a data block. The last one frees the block when
+ * the transaction commits (freed_blocks); the caller is its only owner
+ * by then, so nobody can share it before it is freed. A step that
+ * frees more than FS_TXN_FREES blocks gives the rest back at once.
+ */
+static void free_data_block(blknum_t block) {
+    nest_acquire(&fs_lock);
+    int refs = block_refs(block);
+    if (refs > 0) {
+        block_set_refs(block, refs - 1);
+    }
+    else if (freed_count < FS_FREED_MAX) {
+        freed_blocks[freed_count++] = block;
+    }
+    else {
+        free_bitmap_entry(block, &dblk_bmap);
+    }
+    nest_release(&fs_lock);
+}
 
-    // Check if file is open, read only, or a directory
-    if ((current_running->filedes[fd].mode == MODE_UNUSED) ||
-        (current_running->filedes[fd].mode == MODE_RDONLY) ||
-        (active_inode->d_inode.type == INTYPE_DIR)) {
-        return FSE_ERROR;
+// Free an indirect block and every block below it, depth levels down
+static void free_indirect(blknum_t ind, int depth, struct removal *r) {
+    blknum_t ptrs[PTRS_PER_SCAN];
+
+    if (ind == 0) {
+        return;
     }
+    for (int base = 0; base < PTRS_PER_BLK; base += PTRS_PER_SCAN) {
+        block_read_part(ind, base * sizeof(blknum_t), sizeof(ptrs), ptrs);
+        for (int i = 0; i < PTRS_PER_SCAN; i++) {
+            if (ptrs[i] == 0) {
+                continue;
+            }
+            if (depth > 1) {
+                free_indirect(ptrs[i], depth - 1, r);
+            }
+            else {
+                free_data_block(ptrs[i]);
+            }
+            if (txn_full()) {
+                block_modify(ind, 0, (base + i + 1) * sizeof(blknum_t), zero_block);
+                remove_step(r);
+            }
+        }
+    }
+    free_data_block(ind);
+}
 
-    // Calculate which block to write to
-    int block_num = active_inode->pos / BLOCK_SIZE;
-    int rest = 0;
-    // Calculate the remaining space in the current block
-    int space_left_in_block = BLOCK_SIZE - (active_inode->pos % BLOCK_SIZE);
-    if (size <= space_left_in_block) {
-        // If the data fits into the remaining space of the current block, write it all
-        rest = size;
-    } else {
-        // Otherwise, write only as much as the remaining space in the current block allows
-        rest = space_left_in_block;
+/*
+ * Return pointer idx of indirect block ind. If it is 0 and alloc is
+ * set it is pointed at block, or at a newly allocated block (cleared
+ * if clear is set) if block is 0.
+ */
+static blknum_t indirect_entry(blknum_t ind, int idx, int alloc, int clear, blknum_t block) {
+    blknum_t entry;
+
+    block_read_part(ind, idx * sizeof(blknum_t), sizeof(blknum_t), &entry);
+    if (entry == 0 && alloc) {
+        entry = (block != 0) ? block : alloc_data_block(BLOCK_GROUP(ind), clear);
+        if (entry != 0) {
+            block_modify(ind, idx * sizeof(blknum_t), sizeof(blknum_t), &entry);
+        }
     }
+    return entry;
+}
 
-    // Write the data to the current block
-    blknum_t* active_block_idx = &global_inode_table[current_running->filedes[fd].idx].d_inode.direct[block_num];
+/*
+ * bmap_leaf:
+ * Returns the indirect block holding the pointer to block block_idx,
+ * past the direct ones, of a block mapped file and stores the first
+ * file block it maps in *base_out. Returns 0 if it is not allocated, unless
+ * alloc is set and the disk is not full. The result is remembered in
+ * the inode, so walking through a file reads one pointer per block.
+ */
+static blknum_t bmap_leaf(mem_inode_t *inode, int block_idx, int alloc, int *base_out) {
+    disk_inode_t *d_inode = &inode->d_inode;
+    blknum_t leaf;
+    int base;
+
+    // First file block mapped by the indirect block holding the pointer
+    if (block_idx < INODE_NDIRECT + PTRS_PER_BLK) {
+        base = INODE_NDIRECT;
+    }
+    else {
+        int rel = block_idx - INODE_NDIRECT - PTRS_PER_BLK;
+        base = block_idx - rel % PTRS_PER_BLK;
+    }
+    *base_out = base;
+
+    // Readers sharing the inode share the map cache too
+    lock_acquire(&INODE_LOCK(inode)->lock);
+    leaf = (inode->map_base == base) ? inode->map_leaf : 0;
+    lock_release(&INODE_LOCK(inode)->lock);
+
+    if (leaf == 0) {
+        if (base == INODE_NDIRECT) {
+            if (d_inode->indirect == 0 && alloc) {
+                d_inode->indirect = alloc_data_block(INODE_GROUP(inode->inode_num), TRUE);
+                inode->dirty = 1;
+            }
+            leaf = d_inode->indirect;
+        }
+        else {
+            if (d_inode->dindirect == 0 && alloc) {
+                d_inode->dindirect = alloc_data_block(INODE_GROUP(inode->inode_num), TRUE);
+                inode->dirty = 1;
+            }
+            if (d_inode->dindirect == 0) {
+                return 0;
+            }
+            leaf = indirect_entry(d_inode->dindirect, (base - INODE_NDIRECT - PTRS_PER_BLK) / PTRS_PER_BLK, alloc, TRUE, 0);
+        }
+        if (leaf == 0) {
+            return 0;
+        }
+        lock_acquire(&INODE_LOCK(inode)->lock);
+        inode->map_leaf = leaf;
+        inode->map_base = base;
+        lock_release(&INODE_LOCK(inode)->lock);
+    }
+    return leaf;
+}
 
-    // Check if block is already allocated
-    if (active_inode->d_inode.current_size == 0) {
-        // Allocate a new block
-        if (block_num >= INODE_NDIRECT) {
-            return FSE_INVALIDBLOCK;
+/*
+ * bmap_block:
+ * Returns the disk block holding block block_idx of a block mapped
+ * file, or 0 if it is not allocated. If alloc is set a missing block,
+ * and the indirect blocks leading to it, are allocated; block is used
+ * for it instead if it is not 0. With alloc set 0 is only returned
+ * when the disk is full.
+ */
+static blknum_t bmap_block(mem_inode_t *inode, int block_idx, int alloc, blknum_t block) {
+    disk_inode_t *d_inode = &inode->d_inode;
+    int base;
+
+    if (block_idx < INODE_NDIRECT) {
+        if (d_inode->direct[block_idx] == 0 && alloc) {
+            d_inode->direct[block_idx] = (block != 0) ? block : alloc_data_block(INODE_GROUP(inode->inode_num), FALSE);
+            inode->dirty = 1;
         }
-        // Allocate a new block
-        active_inode->d_inode.direct[block_num] = get_free_entry((unsigned char*)dblk_bmap);
-        super_block.d_super.ndata_blks++;
+        return d_inode->direct[block_idx];
+    }
+    blknum_t leaf = bmap_leaf(inode, block_idx, alloc, &base);
+    if (leaf == 0) {
+        return 0;
+    }
+    return indirect_entry(leaf, block_idx - base, alloc, FALSE, block);
+}
+
+// Point block block_idx of a block mapped file, which is allocated, at block instead
+static void bmap_replace(mem_inode_t *inode, int block_idx, blknum_t block) {
+    int base;
+
+    if (block_idx < INODE_NDIRECT) {
+        inode->d_inode.direct[block_idx] = block;
+        inode->dirty = 1;
+        return;
+    }
+    blknum_t leaf = bmap_leaf(inode, block_idx, FALSE, &base);
+    block_modify(leaf, (block_idx - base) * sizeof(blknum_t), sizeof(blknum_t), &block);
+}
+
+// Number of blocks mapped by the extents of an inode
+static int extent_blocks(disk_inode_t *d_inode) {
+    int blocks = 0;
+    for (int i = 0; i < INODE_NEXTENT; i++) {
+        blocks += d_inode->extents[i].length;
+    }
+    return blocks;
+}
+
+// Returns the disk block holding block block_idx of an extent mapped file, or 0
+static blknum_t extent_lookup(disk_inode_t *d_inode, int block_idx) {
+    for (int i = 0; i < INODE_NEXTENT && d_inode->extents[i].length != 0; i++) {
+        if (block_idx < d_inode->extents[i].length) {
+            if (d_inode->extents[i].start == 0) {
+                return 0;
+            }
+            return d_inode->extents[i].start + block_idx;
+        }
+        block_idx -= d_inode->extents[i].length;
+    }
+    return 0;
+}
+
+// Switch an extent mapped file over to block pointers
+static int extents_to_bmap(mem_inode_t *inode) {
+    struct extent extents[INODE_NEXTENT];
+    int block_idx = 0;
+
+    bcopy((char*)inode->d_inode.extents, (char*)extents, sizeof(extents));
+    bzero((char*)inode->d_inode.extents, sizeof(extents));
+    inode->d_inode.flags &= ~INFLAG_EXTENTS;
+    inode->map_leaf = 0;
+    inode->dirty = 1;
+
+    for (int i = 0; i < INODE_NEXTENT; i++) {
+        // Holes are just pointers left at 0
+        if (extents[i].start == 0) {
+            block_idx += extents[i].length;
+            continue;
+        }
+        for (int j = 0; j < extents[i].length; j++) {
+            if (bmap_block(inode, block_idx++, TRUE, extents[i].start + j) == 0) {
+                return FSE_BITMAP;
+            }
+        }
+    }
+    return FSE_OK;
+}
+
+// Largest number of blocks in one extent
+#define EXTENT_LENGTH_MAX 0x7fff
+
+/*
+ * extent_hole:
+ * Add count unallocated blocks to the end of an extent mapped file, as
+ * hole extents. If the extents run out the file is switched to block
+ * pointers, where the blocks are unallocated already.
+ */
+static void extent_hole(mem_inode_t *inode, int count) {
+    disk_inode_t *d_inode = &inode->d_inode;
+    int n = 0;
+
+    while (n < INODE_NEXTENT && d_inode->extents[n].length != 0) {
+        n++;
+    }
+    inode->dirty = 1;
+    while (count > 0) {
+        struct extent *last = (n > 0) ? &d_inode->extents[n - 1] : NULL;
+        if (last == NULL || last->start != 0 || last->length == EXTENT_LENGTH_MAX) {
+            if (n == INODE_NEXTENT) {
+                extents_to_bmap(inode);
+                return;
+            }
+            last = &d_inode->extents[n++];
+        }
+        int length = EXTENT_LENGTH_MAX - last->length;
+        if (length > count) {
+            length = count;
+        }
+        last->length += length;
+        count -= length;
+    }
+}
+
+/*
+ * extent_grow:
+ * Add count blocks to the end of an extent mapped file. The last
+ * extent is extended while the blocks following it are free, and the
+ * rest comes from a free run sized to what is still needed. If the
+ * extents run out the file is switched to block pointers and the
+ * remaining blocks are left for the caller to map. fs_lock is held
+ * throughout, so the blocks after the last extent stay free while it
+ * is extended.
+ */
+static int extent_grow(mem_inode_t *inode, int count) {
+    disk_inode_t *d_inode = &inode->d_inode;
+    int allocated = 0;
+    int n = 0;
+
+    nest_acquire(&fs_lock);
+    while (n < INODE_NEXTENT && d_inode->extents[n].length != 0) {
+        n++;
+    }
+
+    // Extend the last extent in place, unless it is a hole
+    if (n > 0 && d_inode->extents[n - 1].start != 0) {
+        struct extent *last = &d_inode->extents[n - 1];
+        while (count > 0 && last->length < EXTENT_LENGTH_MAX &&
+               get_bitmap_entry(last->start + last->length, &dblk_bmap) == 0) {
+            last->length++;
+            allocated++;
+            count--;
+        }
+    }
+
+    while (count > 0) {
+        if (n == INODE_NEXTENT) {
+            extents_to_bmap(inode);
+            break;
+        }
+        // Next to the previous extent, or in the group of the inode
+        int group = (n > 0 && d_inode->extents[n - 1].start != 0) ? BLOCK_GROUP(d_inode->extents[n - 1].start) : INODE_GROUP(inode->inode_num);
+        int start;
+        int length = get_free_run(&dblk_bmap, group, count, &start);
+        if (length == 0) {
+            break;
+        }
+        d_inode->extents[n].start = start;
+        d_inode->extents[n].length = length;
+        n++;
+        allocated += length;
+        count -= length;
+    }
+
+    if (allocated > 0) {
+        super_block.d_super.ndata_blks += allocated;
         block_modify(0, 0, sizeof(disk_superblock_t), &super_block.d_super);
-        if (active_inode->d_inode.direct[block_num] == -1) {
+        inode->dirty = 1;
+    }
+    nest_release(&fs_lock);
+    return (count == 0) ? FSE_OK : FSE_BITMAP;
+}
+
+/*
+ * inode_block:
+ * Returns the disk block holding block block_idx of the file, or 0 if
+ * it is not allocated. If alloc is set a missing block is allocated;
+ * 0 is then only returned when the disk is full or block_idx is out
+ * of range. Extent mapped files grow at the end, past a hole if
+ * block_idx lies beyond it. Filling a hole in the middle switches the
+ * file to block pointers.
+ */
+static blknum_t inode_block(mem_inode_t *inode, int block_idx, int alloc) {
+    disk_inode_t *d_inode = &inode->d_inode;
+
+    if (block_idx < 0 || block_idx >= FILE_BLOCKS_MAX || (d_inode->flags & INFLAG_INLINE)) {
+        return 0;
+    }
+    if (d_inode->flags & INFLAG_EXTENTS) {
+        int mapped = extent_blocks(d_inode);
+        blknum_t block = extent_lookup(d_inode, block_idx);
+        if (block != 0 || !alloc) {
+            return block;
+        }
+        if (block_idx >= mapped) {
+            extent_hole(inode, block_idx - mapped);
+            // Still extent mapped unless the extents ran out
+            if (d_inode->flags & INFLAG_EXTENTS) {
+                extent_grow(inode, 1);
+            }
+        }
+        else {
+            extents_to_bmap(inode);
+        }
+        if (d_inode->flags & INFLAG_EXTENTS) {
+            return extent_lookup(d_inode, block_idx);
+        }
+    }
+    return bmap_block(inode, block_idx, alloc, 0);
+}
+
+/*
+ * inode_alloc_range:
+ * Make sure blocks first to last of the file are allocated. An extent
+ * mapped file growing at the end gets them as a single run if there
+ * is one, after a hole if first lies beyond the end.
+ */
+static int inode_alloc_range(mem_inode_t *inode, int first, int last) {
+    disk_inode_t *d_inode = &inode->d_inode;
+
+    // The blocks past the end come as one run, the loop below maps the rest
+    if ((d_inode->flags & INFLAG_EXTENTS) && last < FILE_BLOCKS_MAX) {
+        int mapped = extent_blocks(d_inode);
+        int from = (first > mapped) ? first : mapped;
+        if (last >= mapped) {
+            extent_hole(inode, from - mapped);
+            if (d_inode->flags & INFLAG_EXTENTS) {
+                extent_grow(inode, last - from + 1);
+            }
+        }
+    }
+    for (int i = first; i <= last; i++) {
+        if (inode_block(inode, i, TRUE) == 0) {
             return FSE_BITMAP;
         }
     }
-    // Write the data to buffer and update inode
-    block_modify(*active_block_idx, active_inode->pos % BLOCK_SIZE, rest, buffer);
-    active_inode->d_inode.current_size += rest;
-    active_inode->dirty = 1;
-    active_inode->pos += rest;
-    size -= rest;
+    return FSE_OK;
+}
 
-    // If there's data left, write it to a new block
-    if (size > 0) {
+/*
+ * inline_to_extents:
+ * Move the data of an inline file out to a data block, making it an
+ * extent mapped file. An empty file gets no block.
+ */
+static int inline_to_extents(mem_inode_t *inode) {
+    disk_inode_t *d_inode = &inode->d_inode;
+    char data[INODE_INLINE_MAX];
+
+    bcopy(d_inode->data, data, INODE_INLINE_MAX);
+    bzero(d_inode->data, INODE_INLINE_MAX);
+    d_inode->flags = (d_inode->flags & ~INFLAG_INLINE) | INFLAG_EXTENTS;
+    inode->map_leaf = 0;
+    inode->dirty = 1;
+
+    if (d_inode->current_size == 0) {
+        return FSE_OK;
+    }
+    blknum_t block = inode_block(inode, 0, TRUE);
+    if (block == 0) {
+        return FSE_BITMAP;
+    }
+    if (block_write_data(block, zero_block) != 0) {
+        return FSE_ERROR;
+    }
+    return (block_modify_data(block, 0, INODE_INLINE_MAX, data) == 0) ? FSE_OK : FSE_ERROR;
+}
 
-        // Check if block_num is within the direct block range or if (current size + size) > max_filesize, return error
-        if ((block_num >= INODE_NDIRECT) || (active_inode->d_inode.current_size + size) > super_block.d_super.max_filesize) {
-            return FSE_INVALIDBLOCK;
+/*
+ * inode_unshare:
+ * Give the blocks holding bytes pos to pos + size of the file disk
+ * blocks of their own before they are written, where they share one
+ * with a clone. A block the write covers whole is not copied. An
+ * extent mapped file is switched to block pointers first, as the
+ * copies break its runs.
+ */
+static int inode_unshare(mem_inode_t *inode, int pos, int size) {
+    int first = pos / BLOCK_SIZE;
+    int last = (pos + size - 1) / BLOCK_SIZE;
+
+    for (int i = first; i <= last; i++) {
+        blknum_t block = inode_block(inode, i, FALSE);
+        nest_acquire(&fs_lock);
+        int shared = (block != 0 && block_refs(block) > 0);
+        nest_release(&fs_lock);
+        if (!shared) {
+            continue;
+        }
+        if ((inode->d_inode.flags & INFLAG_EXTENTS) && extents_to_bmap(inode) != FSE_OK) {
+            return FSE_BITMAP;
+        }
+        int whole = (i * BLOCK_SIZE >= pos && (i + 1) * BLOCK_SIZE <= pos + size);
+        blknum_t copy = alloc_data_block(BLOCK_GROUP(block), FALSE);
+        if (copy == 0) {
+            return FSE_BITMAP;
+        }
+        if (!whole && block_copy_data(block, copy) != 0) {
+            free_data_block(copy);
+            return FSE_ERROR;
+        }
+        bmap_replace(inode, i, copy);
+        free_data_block(block);
+    }
+    return FSE_OK;
+}
+
+/*
+ * inode_alloc_bytes:
+ * Make room for size bytes at byte pos of the file before writing
+ * them. Blocks shared with a clone are unshared. An inline file stays inline if they fit, otherwise it is
+ * moved to blocks first. A new block the write only covers part of is
+ * cleared, since the rest of it can be read once the file is sparse.
+ */
+static int inode_alloc_bytes(mem_inode_t *inode, int pos, int size) {
+    int first = pos / BLOCK_SIZE;
+    int last = (pos + size - 1) / BLOCK_SIZE;
+
+    if (inode->d_inode.flags & INFLAG_INLINE) {
+        if (pos + size <= INODE_INLINE_MAX) {
+            return FSE_OK;
         }
-        block_num++;
+        if (inline_to_extents(inode) != FSE_OK) {
+            return FSE_BITMAP;
+        }
+    }
 
-        // Check if block is already allocated
-        if (active_inode->d_inode.direct[block_num] == 0) {
-            // Allocate a new block
-            active_inode->d_inode.direct[block_num] = get_free_entry((unsigned char*)dblk_bmap);
-            super_block.d_super.ndata_blks++;
-            block_modify(0, 0, sizeof(disk_superblock_t), &super_block.d_super);
-            if (active_inode->d_inode.direct[block_num] == -1) {
-                return FSE_BITMAP;
+    int clear_first = (pos % BLOCK_SIZE != 0 && inode_block(inode, first, FALSE) == 0);
+    int clear_last = ((pos + size) % BLOCK_SIZE != 0 && inode_block(inode, last, FALSE) == 0);
+    if (inode_unshare(inode, pos, size) != FSE_OK || inode_alloc_range(inode, first, last) != FSE_OK) {
+        return FSE_BITMAP;
+    }
+    if (clear_first) {
+        block_write_data(inode_block(inode, first, FALSE), zero_block);
+    }
+    if (clear_last && !(clear_first && first == last)) {
+        block_write_data(inode_block(inode, last, FALSE), zero_block);
+    }
+    return FSE_OK;
+}
+
+// Number of free data blocks in the file system
+static int fs_free_blocks(void) {
+    int free = 0;
+    for (int g = 0; g < super_block.d_super.ngroups; g++) {
+        free += super_block.d_super.groups[g].free_blocks;
+    }
+    return free;
+}
+
+// Number of data blocks that can be allocated without using the reserve, called with fs_lock held
+static int delay_room(void) {
+    if (delay_blocks == 0 || delay_placing) {
+        return fs_free_blocks();
+    }
+    return fs_free_blocks() - FS_DELAY_RESERVE(delay_blocks);
+}
+
+// True if block block_idx of the file is held in the cache
+static int delay_held(mem_inode_t *inode, int block_idx) {
+    return block_idx >= inode->delay_first && block_idx < inode->delay_first + inode->delay_count;
+}
+
+/*
+ * delay_flush:
+ * Give the held blocks of a file their disk blocks, all at once so
+ * the allocator can place the tail as one run, and write them out a
+ * contiguous run per transfer. Called with the inode locked.
+ */
+static int delay_flush(mem_inode_t *inode) {
+    int first = inode->delay_first;
+    int count = inode->delay_count;
+    int rc;
+
+    if (count == 0) {
+        return FSE_OK;
+    }
+    inode->delay_count = 0;
+
+    // The reserve makes sure there are blocks for all of them
+    nest_acquire(&fs_lock);
+    delay_blocks -= count;
+    delay_placing = 1;
+    rc = inode_alloc_range(inode, first, first + count - 1);
+    delay_placing = 0;
+    nest_release(&fs_lock);
+    for (int i = 0; i < count; i++) {
+        blknum_t block = inode_block(inode, first + i, FALSE);
+        if (block == 0 || block_delay_place(DELAY_TAG(inode, first + i), block) != 0) {
+            block_delay_drop(DELAY_TAG(inode, first + i));
+            rc = FSE_BITMAP;
+        }
+    }
+
+    for (int i = 0, run; i < count; i += run) {
+        blknum_t block = inode_block(inode, first + i, FALSE);
+        run = 1;
+        while (block != 0 && i + run < count && inode_block(inode, first + i + run, FALSE) == block + run) {
+            run++;
+        }
+        if (block != 0 && block_write_back(block, run) != 0) {
+            rc = FSE_ERROR;
+        }
+    }
+    return rc;
+}
+
+/*
+ * delay_flush_other:
+ * Flush the held blocks of another file than self, which the caller
+ * has locked. Only files holding blocks are open, so the slot stays
+ * put; one that is locked is left alone rather than waited for, as
+ * its holder may be waiting for self. Returns FALSE if it was locked.
+ */
+static int delay_flush_other(mem_inode_t *self, mem_inode_t *inode) {
+    if (inode == self) {
+        delay_flush(inode);
+        return TRUE;
+    }
+    if (!inode_trylock(inode)) {
+        return FALSE;
+    }
+    delay_flush(inode);
+    inode_unlock(inode);
+    return TRUE;
+}
+
+// Flush the held blocks of every file that is not locked, self being locked by the caller
+static void delay_flush_all(mem_inode_t *self) {
+    for (int i = 0; i < INODE_TABLE_ENTRIES && delay_blocks > 0; i++) {
+        if (global_inode_table[i].delay_count > 0) {
+            delay_flush_other(self, &global_inode_table[i]);
+        }
+    }
+}
+
+/*
+ * delay_reclaim:
+ * Make room for count more held blocks, flushing the files holding
+ * the most first. The others keep growing their tails in the cache.
+ * Files that are locked are skipped; if that leaves too little room,
+ * delay_hold() places the write instead of holding it.
+ */
+static void delay_reclaim(mem_inode_t *self, int count) {
+    char busy[INODE_TABLE_ENTRIES];
+
+    bzero(busy, sizeof(busy));
+    while (delay_blocks > 0 && delay_blocks + count > FS_DELAY_MAX) {
+        mem_inode_t *most = NULL;
+        for (int i = 0; i < INODE_TABLE_ENTRIES; i++) {
+            if (!busy[i] && global_inode_table[i].delay_count > 0 &&
+                (most == NULL || global_inode_table[i].delay_count > most->delay_count)) {
+                most = &global_inode_table[i];
             }
         }
+        if (most == NULL) {
+            break;
+        }
+        if (!delay_flush_other(self, most)) {
+            busy[most - global_inode_table] = 1;
+        }
+    }
+}
 
-        // Write the remaining data to the new block
-        active_block_idx = &global_inode_table[current_running->filedes[fd].idx].d_inode.direct[block_num];
-        block_modify(*active_block_idx, active_inode->pos % BLOCK_SIZE, size, &buffer[rest]);
-        active_inode->d_inode.current_size += size;
-        active_inode->dirty = 1;
-        active_inode->pos += size;
+// Throw away the held blocks of a file that is removed, called with the inode locked
+static void delay_drop(mem_inode_t *inode) {
+    for (int i = 0; i < inode->delay_count; i++) {
+        block_delay_drop(DELAY_TAG(inode, inode->delay_first + i));
+    }
+    nest_acquire(&fs_lock);
+    delay_blocks -= inode->delay_count;
+    nest_release(&fs_lock);
+    inode->delay_count = 0;
+}
+
+// Hold or allocate the blocks for delay_alloc_bytes(), with fs_lock held
+static int delay_hold(mem_inode_t *inode, int pos, int size, int count) {
+    disk_inode_t *d_inode = &inode->d_inode;
+    int end = CEIL(d_inode->current_size, BLOCK_SIZE);
+    int first = pos / BLOCK_SIZE;
+    int last = (pos + size - 1) / BLOCK_SIZE;
+
+    if (size >= BLOCK_SIZE || delay_blocks + count > FS_DELAY_MAX ||
+        fs_free_blocks() < FS_DELAY_RESERVE(delay_blocks + count)) {
+        if (delay_flush(inode) != FSE_OK) {
+            return FSE_BITMAP;
+        }
+        return inode_alloc_bytes(inode, pos, size);
+    }
+    if (delay_blocks == 0) {
+        delay_start = get_timer();
+    }
+
+    if (d_inode->flags & INFLAG_INLINE) {
+        char data[INODE_INLINE_MAX];
+        bcopy(d_inode->data, data, INODE_INLINE_MAX);
+        bzero(d_inode->data, INODE_INLINE_MAX);
+        d_inode->flags = (d_inode->flags & ~INFLAG_INLINE) | INFLAG_EXTENTS;
+        inode->map_leaf = 0;
+        inode->dirty = 1;
+        if (end > 0 && block_delay_write(DELAY_TAG(inode, 0), 0, INODE_INLINE_MAX, data) != 0) {
+            return FSE_ERROR;
+        }
+        inode->delay_first = 0;
+        inode->delay_count = end;
+        delay_blocks += end;
+    }
+
+    // Held blocks have no gaps, a write past them starts a new tail
+    if (inode->delay_count > 0 && first > end && delay_flush(inode) != FSE_OK) {
+        return FSE_BITMAP;
+    }
+    if (inode->delay_count == 0) {
+        inode->delay_first = (first > end) ? first : end;
+    }
+
+    int from = inode->delay_first;
+    if (first < from) {
+        int bytes = from * BLOCK_SIZE - pos;
+        if (inode_alloc_bytes(inode, pos, (bytes < size) ? bytes : size) != FSE_OK) {
+            return FSE_BITMAP;
+        }
+    }
+    if (last >= from + inode->delay_count) {
+        delay_blocks += last + 1 - (from + inode->delay_count);
+        inode->delay_count = last + 1 - from;
     }
     return FSE_OK;
 }
 
 /*
- * fs_lseek:
- * This function is really incorrectly named, since neither its offset
- * argument or its return value are longs (or off_t's).
+ * delay_alloc_bytes:
+ * Make room for size bytes at byte pos of the file, for fs_write. The
+ * blocks of the write past the end of the file are held, and whatever
+ * comes before them is allocated by inode_alloc_bytes(). An inline
+ * file that outgrows the inode moves into a held block. A write of a
+ * block or more flushes the held blocks and is placed at once: it
+ * already comes as a run, and copying it through the cache would cost
+ * more than it saves. Called with the inode locked.
  */
-int fs_lseek(int fd, int offset, int whence) {
-    // Get inode from global inode table
+static int delay_alloc_bytes(mem_inode_t *inode, int pos, int size) {
+    disk_inode_t *d_inode = &inode->d_inode;
+    int end = CEIL(d_inode->current_size, BLOCK_SIZE);
+    int first = pos / BLOCK_SIZE;
+    int last = (pos + size - 1) / BLOCK_SIZE;
+    // Blocks this write adds to the held ones, counting the data of an inline file
+    int count = last + 1 - ((d_inode->flags & INFLAG_INLINE) ? 0 : (first > end) ? first : end);
+
+    if ((d_inode->flags & INFLAG_INLINE) && pos + size <= INODE_INLINE_MAX) {
+        return FSE_OK;
+    }
+    if (delay_blocks > 0 && get_timer() - delay_start > FS_DELAY_CYCLES) {
+        delay_flush_all(inode);
+    }
+    delay_reclaim(inode, count);
+
+    // The held block count is only changed with fs_lock held
+    nest_acquire(&fs_lock);
+    int rc = delay_hold(inode, pos, size, count);
+    nest_release(&fs_lock);
+    return rc;
+}
+
+/*
+ * Position in an iovec array: the current segment, the number of
+ * segments left and the offset into the current segment.
+ */
+struct iov_cursor {
+    struct iovec *iov;
+    int left;
+    int off;
+};
+
+// Skip used up segments and return the bytes left in the current one
+static int iov_contig(struct iov_cursor *cur) {
+    while (cur->left > 0 && cur->off >= cur->iov->iov_len) {
+        cur->iov++;
+        cur->left--;
+        cur->off = 0;
+    }
+    return (cur->left > 0) ? cur->iov->iov_len - cur->off : 0;
+}
+
+/*
+ * Copy bytes between buf and the segments at the cursor, advancing
+ * it. Copies into the segments if to_iov is set, out of them if not.
+ */
+static void iov_copy(struct iov_cursor *cur, char *buf, int bytes, int to_iov) {
+    while (bytes > 0) {
+        int n = iov_contig(cur);
+        if (n == 0) {
+            return;
+        }
+        if (n > bytes) {
+            n = bytes;
+        }
+        if (to_iov) {
+            bcopy(buf, &cur->iov->iov_base[cur->off], n);
+        }
+        else {
+            bcopy(&cur->iov->iov_base[cur->off], buf, n);
+        }
+        cur->off += n;
+        buf += n;
+        bytes -= n;
+    }
+}
+
+/*
+ * Returns the total length of an iovec array, or FSE_ERROR if the
+ * array is too long or a segment is invalid.
+ */
+static int iov_total(struct iovec *iov, int iovcnt) {
+    int total = 0;
+
+    if (iov == NULL || iovcnt < 0 || iovcnt > FS_IOV_MAX) {
+        return FSE_ERROR;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len < 0 || (iov[i].iov_len > 0 && iov[i].iov_base == NULL)) {
+            return FSE_ERROR;
+        }
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+/*
+ * file_io:
+ * Move size bytes between the iovec segments at cur and the file,
+ * starting at byte pos of the file (a read if write is FALSE), and
+ * advance cur past them. The block map is walked once for all
+ * segments. The whole blocks of each run that lies contiguously on
+ * disk are moved with a single block range transfer, and partial
+ * blocks go through the buffer cache. Blocks that straddle segments go
+ * through io_stage, which stage_lock keeps to one caller at a time.
+ * Blocks must be allocated or held before a write; unallocated blocks
+ * read as zeros. An inline file is copied straight from or to the
+ * inode. Called with the inode locked, shared for a read.
+ */
+static int file_io(mem_inode_t *inode, int pos, struct iov_cursor *cur, int size, int write) {
+    int done = 0;
+    int rc = 0;
+
+    if (inode->d_inode.flags & INFLAG_INLINE) {
+        if (pos + size > INODE_INLINE_MAX) {
+            return FSE_ERROR;
+        }
+        iov_copy(cur, &inode->d_inode.data[pos], size, !write);
+        if (write) {
+            inode->dirty = 1;
+        }
+        return FSE_OK;
+    }
+
+    while (done < size && rc == 0) {
+        int block_idx = (pos + done) / BLOCK_SIZE;
+        int offset = (pos + done) % BLOCK_SIZE;
+        blknum_t block = inode_block(inode, block_idx, FALSE);
+        int held = (block == 0 && delay_held(inode, block_idx));
+        int contig = iov_contig(cur);
+        int partial = (offset != 0 || size - done < BLOCK_SIZE);
+        int bytes;
+        int run = 1;
+
+        if (block == 0 && write && !held) {
+            return FSE_ERROR;
+        }
+
+        if (partial) {
+            bytes = BLOCK_SIZE - offset;
+            if (bytes > size - done) {
+                bytes = size - done;
+            }
+        }
+        else {
+            // Whole blocks, as many as follow each other on disk and fit one buffer
+            int max = (contig >= BLOCK_SIZE) ? contig / BLOCK_SIZE : FS_IO_STAGE_BLOCKS;
+            if (max > FS_IO_RUN_MAX) {
+                max = FS_IO_RUN_MAX;
+            }
+            while (block != 0 && run < max && size - done >= (run + 1) * BLOCK_SIZE &&
+                   inode_block(inode, block_idx + run, FALSE) == block + run) {
+                run++;
+            }
+            bytes = run * BLOCK_SIZE;
+        }
+
+        if (block == 0 && !held) {
+            iov_copy(cur, zero_block, bytes, TRUE);
+            done += bytes;
+            continue;
+        }
+
+        char *data = (contig >= bytes) ? &cur->iov->iov_base[cur->off] : io_stage;
+        if (data == io_stage) {
+            lock_acquire(&stage_lock);
+        }
+        if (data == io_stage && write) {
+            iov_copy(cur, io_stage, bytes, FALSE);
+        }
+
+        if (held) {
+            if (write) {
+                rc = block_delay_write(DELAY_TAG(inode, block_idx), offset, bytes, data);
+            }
+            else {
+                rc = block_delay_read(DELAY_TAG(inode, block_idx), offset, bytes, data);
+            }
+        }
+        else if (partial) {
+            if (write) {
+                rc = block_modify_data(block, offset, bytes, data);
+            }
+            else {
+                rc = block_read_part(block, offset, bytes, data);
+            }
+        }
+        else if (!write && data != io_stage && ((uintptr_t)data % FS_PAGE_SIZE) == 0 && run >= FS_PAGE_BLOCKS) {
+            // Whole pages only, the rest of the run is read next time around
+            run -= run % FS_PAGE_BLOCKS;
+            bytes = run * BLOCK_SIZE;
+            rc = block_read_direct(block, run, data);
+        }
+        else if (!write) {
+            rc = block_read_range(block, run, data);
+        }
+        else if (run == 1) {
+            rc = block_write_data(block, data);
+        }
+        else {
+            rc = block_write_range(block, run, data);
+        }
+
+        if (data != io_stage) {
+            cur->off += bytes;
+        }
+        else {
+            if (!write) {
+                iov_copy(cur, io_stage, bytes, TRUE);
+            }
+            lock_release(&stage_lock);
+        }
+        done += bytes;
+    }
+    return (rc == 0) ? FSE_OK : FSE_ERROR;
+}
+
+/*
+ * Sequential readahead. While a file is read block after block the
+ * window doubles (up to BCACHE_RA_MAX), and the window's worth of
+ * blocks is brought into the block cache with one transfer. Only
+ * blocks that lie next to each other on disk can share a transfer.
+ */
+static void fs_readahead(mem_inode_t *inode, int block_idx) {
+    // Random access turns readahead off
+    if (block_idx != inode->ra_next) {
+        inode->ra_next = block_idx + 1;
+        inode->ra_window = 0;
+        return;
+    }
+    inode->ra_next = block_idx + 1;
+    if (inode->ra_window == 0) {
+        inode->ra_window = 2;
+    }
+    else if (inode->ra_window < BCACHE_RA_MAX) {
+        inode->ra_window *= 2;
+    }
+
+    // Stop at the end of the file or where the blocks stop being contiguous
+    int last = CEIL(inode->d_inode.current_size, BLOCK_SIZE);
+    blknum_t first = inode_block(inode, block_idx, FALSE);
+    int run = 1;
+    if (first == 0) {
+        return;
+    }
+    while (run < inode->ra_window && block_idx + run < last &&
+           inode_block(inode, block_idx + run, FALSE) == first + run) {
+        run++;
+    }
+    block_readahead(first, run);
+}
+
+/*
+ * file_read:
+ * Read into the iovec segments of a regular file open as fd, from its
+ * current position. Returns the number of bytes read, 0 at the end of
+ * the file. Readers share the inode lock; each claims its bytes by
+ * moving the position past them first. The readahead state is only a
+ * hint, and readers of the same file may race on it.
+ */
+static int file_read(int fd, struct iovec *iov, int iovcnt) {
     mem_inode_t* active_inode = &global_inode_table[current_running->filedes[fd].idx];
+
     // Check if file is open for reading or reading and writing
-    if ((current_running->filedes[fd].mode == MODE_RDONLY) ||
-        (current_running->filedes[fd].mode == MODE_RDWR)) {
-        // Check if whence is SEEK_SET
-        if (whence == SEEK_SET) {
-            // Check if offset is within the file size
-            if (offset <= active_inode->d_inode.current_size) {
-                active_inode->pos = offset;
-                return 0;
-            }
+    if (!(current_running->filedes[fd].mode & (MODE_RDONLY | MODE_RDWR))) {
+        return FSE_ERROR;
+    }
+    int size = iov_total(iov, iovcnt);
+    if (size < 0) {
+        return FSE_ERROR;
+    }
+    inode_lock_shared(active_inode);
+
+    // Read no further than the end of the file
+    lock_acquire(&INODE_LOCK(active_inode)->lock);
+    int pos = active_inode->pos;
+    int left = active_inode->d_inode.current_size - pos;
+    if (size > left) {
+        size = left;
+    }
+    if (size > 0) {
+        active_inode->pos += size;
+    }
+    lock_release(&INODE_LOCK(active_inode)->lock);
+    if (size <= 0) {
+        inode_unlock_shared(active_inode);
+        return 0;
+    }
+
+    // Small reads of a streamed file read ahead, large ones are coalesced below
+    int first = pos / BLOCK_SIZE;
+    int last = (pos + size - 1) / BLOCK_SIZE;
+    if (first == last) {
+        fs_readahead(active_inode, first);
+    }
+    else {
+        active_inode->ra_next = last + 1;
+    }
+
+    struct iov_cursor cur = {iov, iovcnt, 0};
+    int rc = file_io(active_inode, pos, &cur, size, FALSE);
+    inode_unlock_shared(active_inode);
+    if (rc != FSE_OK) {
+        return FSE_ERROR;
+    }
+
+    // Return the number of bytes read
+    return size;
+}
+
+/*
+ * write_locked:
+ * The rest of file_write(), with the inode locked and txn_lock held,
+ * which it releases. New blocks at the end are only held, the others
+ * are allocated at once, and the file is grown under txn_lock; the
+ * data is copied after it is released. A large write is allocated a
+ * step at a time, so the journal can commit in between, and the data
+ * of each step but the last is copied before that commit; a crash
+ * there leaves the file with blocks past its end that the write had
+ * not reached yet. An inline file's data is in the inode, so it is
+ * copied under txn_lock.
+ */
+static int write_locked(mem_inode_t *active_inode, struct iovec *iov, int iovcnt, int size) {
+    struct iov_cursor cur = {iov, iovcnt, 0};
+    int pos = active_inode->pos;
+    int old_size = active_inode->d_inode.current_size;
+    int rc = FSE_OK;
+    int n = 0;
+
+    // Check that the data fits in the largest possible file
+    if (pos + size > super_block.d_super.max_filesize) {
+        txn_release(FALSE);
+        return FSE_INVALIDBLOCK;
+    }
+    if (size == 0) {
+        txn_release(FALSE);
+        return 0;
+    }
+
+    for (int done = 0; rc == FSE_OK && done < size; done += n) {
+        n = (size - done >= 2 * FS_TXN_WRITE) ? FS_TXN_WRITE : size - done;
+        if (delay_alloc_bytes(active_inode, pos + done, n) != FSE_OK) {
+            rc = FSE_BITMAP;
         }
-        // Check if whence is SEEK_CUR
-        else if (whence == SEEK_CUR) {
-            // Check if offset is within the file size
-            if ((active_inode->pos + offset) <= active_inode->d_inode.current_size) {
-                active_inode->pos += offset;
-                return 0;
+        else if (done + n < size) {
+            rc = file_io(active_inode, pos + done, &cur, n, TRUE);
+            txn_step();
+        }
+    }
+    if (rc != FSE_OK) {
+        txn_release(FALSE);
+        return rc;
+    }
+
+    // Update the inode, then write the last step's data
+    active_inode->pos = pos + size;
+    if (active_inode->pos > old_size) {
+        active_inode->d_inode.current_size = active_inode->pos;
+    }
+    active_inode->dirty = 1;
+    int copy = !(active_inode->d_inode.flags & INFLAG_INLINE);
+    if (copy) {
+        txn_release(TRUE);
+    }
+    rc = file_io(active_inode, pos + size - n, &cur, n, TRUE);
+    if (rc != FSE_OK) {
+        nest_acquire(&fs_lock);
+        active_inode->pos = pos;
+        active_inode->d_inode.current_size = old_size;
+        active_inode->dirty = 1;
+        nest_release(&fs_lock);
+    }
+    if (copy) {
+        txn_copied();
+    }
+    else {
+        txn_release(FALSE);
+    }
+
+    // Return the number of bytes written
+    return (rc == FSE_OK) ? size : FSE_ERROR;
+}
+
+/*
+ * file_write:
+ * Write the iovec segments to the file open as fd, at its current
+ * position. Every block is allocated or held before any data is
+ * written. Returns the number of bytes written. The inode is locked
+ * for the whole write, txn_lock only until the blocks are allocated.
+ */
+static int file_write(int fd, struct iovec *iov, int iovcnt) {
+    // Get inode from global inode table
+    mem_inode_t* active_inode = &global_inode_table[current_running->filedes[fd].idx];
+
+    // Check if file is open, read only, or a directory
+    if ((current_running->filedes[fd].mode == MODE_UNUSED) ||
+        (current_running->filedes[fd].mode == MODE_RDONLY) ||
+        (active_inode->d_inode.type == INTYPE_DIR)) {
+        return FSE_ERROR;
+    }
+    int size = iov_total(iov, iovcnt);
+    if (size < 0) {
+        return FSE_ERROR;
+    }
+
+    txn_begin();
+    inode_lock(active_inode);
+    int rc = write_locked(active_inode, iov, iovcnt, size);
+    inode_unlock(active_inode);
+    return rc;
+}
+
+#ifndef LINUX_SIM
+// User pages one call in user_io() may pin: a run, which may start inside a page
+#define FS_PIN_PAGES (FS_IO_RUN_MAX * BLOCK_SIZE / PAGE_SIZE + 1)
+#endif
+
+/*
+ * user_io:
+ * file_read() or file_write() on iovec segments from the caller. No
+ * page fault may be taken with the inode locked, so in the kernel
+ * every page of the segments is pinned before the call, and unpinned
+ * after it. Pinned pages cannot be swapped out, so the segments are
+ * moved at most a run (FS_IO_RUN_MAX blocks, FS_PIN_PAGES pages) per
+ * call. A short read ends the transfer. The simulator has no paging
+ * and moves them all at once.
+ */
+static int user_io(int fd, struct iovec *iov, int iovcnt, int write) {
+#ifndef LINUX_SIM
+    int size = iov_total(iov, iovcnt);
+    struct iov_cursor cur = {iov, iovcnt, 0};
+    int done = 0;
+
+    while (size > 0 && done < size) {
+        struct iovec run[FS_IOV_MAX];
+        uint32_t pinned[FS_PIN_PAGES];
+        int npinned = 0;
+        int nrun = 0;
+        int bytes = 0;
+
+        // Pin the pages of the next run, merging the pieces of a segment again
+        while (npinned < FS_PIN_PAGES && bytes < FS_IO_RUN_MAX * BLOCK_SIZE && iov_contig(&cur) > 0) {
+            char *base = &cur.iov->iov_base[cur.off];
+            int n = PAGE_SIZE - (int)((uint32_t)base & PAGE_MASK);
+            if (n > iov_contig(&cur)) {
+                n = iov_contig(&cur);
             }
+            if (n > FS_IO_RUN_MAX * BLOCK_SIZE - bytes) {
+                n = FS_IO_RUN_MAX * BLOCK_SIZE - bytes;
+            }
+
+            // Reading the file writes to the page
+            page_pin_user((uint32_t)base, !write);
+            pinned[npinned++] = (uint32_t)base;
+            if (nrun > 0 && &run[nrun - 1].iov_base[run[nrun - 1].iov_len] == base) {
+                run[nrun - 1].iov_len += n;
+            }
+            else {
+                run[nrun].iov_base = base;
+                run[nrun++].iov_len = n;
+            }
+            cur.off += n;
+            bytes += n;
         }
-        // Check if whence is SEEK_END
-        else if (whence == SEEK_END) {
-            // Check if offset is within the file size
-            if ((active_inode->d_inode.current_size - offset) >= 0) {
-                active_inode->pos = active_inode->d_inode.current_size - offset;
-                return 0;
+
+        int rc = write ? file_write(fd, run, nrun) : file_read(fd, run, nrun);
+        while (npinned > 0) {
+            page_unpin_user(pinned[--npinned]);
+        }
+        if (rc < 0) {
+            return (done > 0) ? done : rc;
+        }
+        done += rc;
+        if (rc < bytes) {
+            break;
+        }
+    }
+    if (size > 0) {
+        return done;
+    }
+#endif /* !LINUX_SIM */
+    return write ? file_write(fd, iov, iovcnt) : file_read(fd, iov, iovcnt);
+}
+
+// Read the next entry of a directory open as fd, with ns_lock held
+static int dir_read(int fd, mem_inode_t *active_inode, char *buffer, int size) {
+    // Check if we're trying to read more than a directory
+    if (size > (int)sizeof(dirent_t)) {
+        return FSE_OK;
+    }
+    // Check if file is a directory
+    if (active_inode->d_inode.direct[active_inode->pos_block] != 0) {
+        dirent_t dir;
+        // Simply here to be "used" has no effect on the code
+        do_lseek(fd, 0, SEEK_CUR);
+        block_read_part(active_inode->d_inode.direct[active_inode->pos_block], active_inode->pos % (sizeof(dirent_t) * DIRENTS_PER_BLK), size, &dir);
+        // If the directory entry is not empty, copy it to the buffer
+        if (dir.name[0] != '\0') {
+            active_inode->pos += size;
+            if (active_inode->pos % (sizeof(dirent_t) * DIRENTS_PER_BLK) == 0) {
+                active_inode->pos_block++;
             }
+            bcopy((char *)&dir, buffer, size);
+            return 1;
         }
     }
-    return FSE_ERROR;
+    return 0;
+}
+
+static int do_read(int fd, char *buffer, int size) {
+    // Check if file descriptor is open
+    if (fd < 0 || fd >= MAX_OPEN_FILES || current_running->filedes[fd].mode == MODE_UNUSED) {
+        return FSE_ERROR;
+    }
+    // Get inode from global inode table
+    mem_inode_t* active_inode = &global_inode_table[current_running->filedes[fd].idx];
+    if (active_inode->d_inode.type == INTYPE_DIR) {
+        nest_acquire(&ns_lock);
+        int rc = dir_read(fd, active_inode, buffer, size);
+        nest_release(&ns_lock);
+        return rc;
+    }
+
+    // Check if file is a regular file
+    else if (active_inode->d_inode.type == INTYPE_FILE) {
+        struct iovec iov = {buffer, size};
+        if (size <= 0) {
+            return 0;
+        }
+        return user_io(fd, &iov, 1, FALSE);
+    }
+    return FSE_ERROR;
+}
+
+static int do_write(int fd, char *buffer, int size) {
+    struct iovec iov = {buffer, size};
+
+    if (fd < 0 || fd >= MAX_OPEN_FILES) {
+        return FSE_ERROR;
+    }
+    if (size <= 0) {
+        return 0;
+    }
+    return user_io(fd, &iov, 1, TRUE);
+}
+
+/*
+ * do_readv:
+ * Read from fd into iovcnt buffers, filling each before the next, with
+ * one pass over the block map. Returns the number of bytes read.
+ */
+static int do_readv(int fd, struct iovec *iov, int iovcnt) {
+    if (fd < 0 || fd >= MAX_OPEN_FILES || current_running->filedes[fd].mode == MODE_UNUSED ||
+        global_inode_table[current_running->filedes[fd].idx].d_inode.type != INTYPE_FILE) {
+        return FSE_ERROR;
+    }
+    return user_io(fd, iov, iovcnt, FALSE);
+}
+
+/*
+ * do_writev:
+ * Write iovcnt buffers to fd as one contiguous write, so data from
+ * different buffers that shares a block costs one block write. Returns
+ * the number of bytes written.
+ */
+static int do_writev(int fd, struct iovec *iov, int iovcnt) {
+    if (fd < 0 || fd >= MAX_OPEN_FILES) {
+        return FSE_ERROR;
+    }
+    return user_io(fd, iov, iovcnt, TRUE);
+}
+
+/*
+ * fs_fd_borrow:
+ * Copy descriptor fd of another process, whose table is owner_fds, to
+ * the running thread, taking a reference on its inode so the inode
+ * stays put if the owner closes fd meanwhile. Returns
+ * FSE_INVALIDHANDLE if fd is not open. fs_fd_return() gives it back.
+ */
+int fs_fd_borrow(struct fd_entry *owner_fds, int fd) {
+    int rc = FSE_INVALIDHANDLE;
+
+    if (fd < 0 || fd >= MAX_OPEN_FILES) {
+        return rc;
+    }
+    nest_acquire(&fs_lock);
+    if (owner_fds[fd].mode != MODE_UNUSED) {
+        current_running->filedes[fd] = owner_fds[fd];
+        iref(&global_inode_table[owner_fds[fd].idx]);
+        rc = FSE_OK;
+    }
+    nest_release(&fs_lock);
+    return rc;
+}
+
+// Drop a descriptor taken by fs_fd_borrow(), placing the held blocks if the owner closed it
+void fs_fd_return(int fd) {
+    mem_inode_t *inode = &global_inode_table[current_running->filedes[fd].idx];
+
+    current_running->filedes[fd].idx = -1;
+    current_running->filedes[fd].mode = MODE_UNUSED;
+    nest_acquire(&fs_lock);
+    int last = (inode->open_count == 1);
+    nest_release(&fs_lock);
+    if (last) {
+        txn_begin();
+        inode_lock(inode);
+        delay_flush(inode);
+        inode_unlock(inode);
+        txn_end();
+    }
+    nest_acquire(&fs_lock);
+    iput(inode);
+    if (inode->open_count == 0) {
+        inode->pos = 0;
+        inode->pos_block = 0;
+    }
+    nest_release(&fs_lock);
+}
+
+/*
+ * File mappings. fs_mmap() and fs_munmap() live in memory.c, with the
+ * page tables; the file system only moves pages in and out of a
+ * mapped file through its block map. A mapping holds a reference on
+ * the inode, so its inode cache slot stays put while it exists.
+ */
+
+/*
+ * fs_map_open:
+ * Take a reference on the regular file open as fd for a mapping.
+ * Returns its index in the inode table, or an error code.
+ */
+int fs_map_open(int fd) {
+    if (fd < 0 || fd >= MAX_OPEN_FILES || current_running->filedes[fd].mode == MODE_UNUSED) {
+        return FSE_INVALIDHANDLE;
+    }
+    int idx = current_running->filedes[fd].idx;
+    if (global_inode_table[idx].d_inode.type != INTYPE_FILE) {
+        return FSE_ERROR;
+    }
+    nest_acquire(&fs_lock);
+    iref(&global_inode_table[idx]);
+    nest_release(&fs_lock);
+    return idx;
+}
+
+// Drop the reference taken by fs_map_open()
+void fs_map_close(int idx) {
+    iput_ref(&global_inode_table[idx]);
+    fs_op_done();
+}
+
+/*
+ * do_map_read:
+ * Read up to size bytes at offset of a mapped file into page. Nothing
+ * is read past the end of the file. Returns the number of bytes read.
+ */
+static int do_map_read(int idx, int offset, char *page, int size) {
+    mem_inode_t *inode = &global_inode_table[idx];
+
+    inode_lock_shared(inode);
+    int left = inode->d_inode.current_size - offset;
+    struct iovec iov = {page, (size < left) ? size : left};
+    int rc = (iov.iov_len > 0) ? iov.iov_len : 0;
+
+    struct iov_cursor cur = {&iov, 1, 0};
+
+    if (rc > 0 && file_io(inode, offset, &cur, iov.iov_len, FALSE) != FSE_OK) {
+        rc = FSE_ERROR;
+    }
+    inode_unlock_shared(inode);
+    return rc;
+}
+
+/*
+ * do_map_write:
+ * Write a dirty page of a mapped file back. A mapping does not grow
+ * the file, so only the bytes before the end of the file are written.
+ * Like a write, it holds txn_lock only to allocate the blocks, unless
+ * the file is inline. Returns the number of bytes written.
+ */
+static int do_map_write(int idx, int offset, char *page, int size) {
+    mem_inode_t *inode = &global_inode_table[idx];
+
+    txn_begin();
+    inode_lock(inode);
+    int left = inode->d_inode.current_size - offset;
+    struct iovec iov = {page, (size < left) ? size : left};
+    struct iov_cursor cur = {&iov, 1, 0};
+    int rc = (iov.iov_len > 0) ? iov.iov_len : 0;
+
+    // Pages are written in place, so held blocks get theirs first
+    if (rc > 0 &&
+        (delay_flush(inode) != FSE_OK ||
+         inode_alloc_bytes(inode, offset, iov.iov_len) != FSE_OK)) {
+        rc = FSE_ERROR;
+    }
+    if (rc > 0) {
+        inode->dirty = 1;
+    }
+    int copy = (rc > 0 && !(inode->d_inode.flags & INFLAG_INLINE));
+    if (copy) {
+        txn_release(TRUE);
+    }
+    if (rc > 0 && file_io(inode, offset, &cur, iov.iov_len, TRUE) != FSE_OK) {
+        rc = FSE_ERROR;
+    }
+    if (copy) {
+        txn_copied();
+    }
+    else {
+        txn_release(FALSE);
+    }
+    inode_unlock(inode);
+    return rc;
+}
+
+/*
+ * do_lseek:
+ * This function is really incorrectly named, since neither its offset
+ * argument or its return value are longs (or off_t's). The position
+ * may be put past the end of the file; a write there leaves a hole
+ * that reads as zeros. SEEK_END counts offset back from the end.
+ */
+static int do_lseek(int fd, int offset, int whence) {
+    // Check if file is open
+    if (fd < 0 || fd >= MAX_OPEN_FILES || current_running->filedes[fd].mode == MODE_UNUSED) {
+        return FSE_ERROR;
+    }
+    // Get inode from global inode table
+    mem_inode_t* active_inode = &global_inode_table[current_running->filedes[fd].idx];
+    int pos;
+
+    inode_lock(active_inode);
+    if (whence == SEEK_SET) {
+        pos = offset;
+    }
+    else if (whence == SEEK_CUR) {
+        pos = active_inode->pos + offset;
+    }
+    else if (whence == SEEK_END) {
+        pos = active_inode->d_inode.current_size - offset;
+    }
+    else {
+        pos = -1;
+    }
+
+    // Anywhere from the start to the largest possible file
+    int rc = (pos < 0 || pos > super_block.d_super.max_filesize) ? FSE_ERROR : 0;
+    if (rc == 0) {
+        active_inode->pos = pos;
+    }
+    inode_unlock(active_inode);
+    return rc;
 }
 
-int fs_mkfile(char *filename) {
+static int do_mkfile(char *filename) {
     // Initialize variables
     char filename_copy[MAX_PATH_LEN];
     bcopy(filename, filename_copy, MAX_PATH_LEN);
@@ -857,7 +3194,16 @@ int fs_mkfile(char *filename) {
     return new_inode_num;
 }
 
-int fs_mkdir(char* dirname) {
+int fs_mkfile(char *filename) {
+    txn_begin();
+    nest_acquire(&ns_lock);
+    int rc = do_mkfile(filename);
+    nest_release(&ns_lock);
+    txn_end();
+    return rc;
+}
+
+static int do_mkdir(char* dirname) {
     // Initialize variables
     char dirname_copy[MAX_PATH_LEN];
     bcopy(dirname, dirname_copy, MAX_PATH_LEN);
@@ -902,13 +3248,16 @@ int fs_mkdir(char* dirname) {
             if (ev < 0) {
                 return ev;
             }
+            // Each directory made is complete, a long path may commit between them
+            txn_step();
         }
         found_inode = inode_num;
     }
+    fs_op_done();
     return FSE_OK;
 }
 
-int fs_chdir(char *path) {
+static int do_chdir(char *path) {
     // Find inode
     inode_t new_path = name2inode(path);
 
@@ -928,7 +3277,7 @@ int fs_chdir(char *path) {
     return FSE_OK;
 }
 
-int fs_rmdir(char *path) {
+static int do_rmdir(char *path) {
     // Find inode
     inode_t found_inode = name2inode(path);
     disk_inode_t active_inode = read_inode_table(found_inode);
@@ -972,6 +3321,7 @@ int fs_rmdir(char *path) {
         return ev;
     }
 
+    fs_op_done();
     return FSE_OK;
 }
 
@@ -991,7 +3341,7 @@ void strconcat(char* source, const char* destination) {
     *source = '\0';
 }
 
-int fs_recursive_rmdir(char *path) {
+static int do_recursive_rmdir(char *path) {
     char child_path[MAX_PATH_LEN];
     // Get inode
     inode_t inode_num = name2inode(path);
@@ -1007,20 +3357,21 @@ int fs_recursive_rmdir(char *path) {
     for (int i = 0; i < INODE_NDIRECT; i++) {
         blknum_t current_block = inode.direct[i];
         if (current_block != 0) {
-            dirent_t dir[DIRENTS_PER_BLK];
-            block_read_part(current_block, 0, sizeof(dirent_t) * DIRENTS_PER_BLK, &dir);
             // Skip "." and ".."
             for (int j = 2; j < DIRENTS_PER_BLK; j++) {
-                if (dir[j].name[0] != '\0') {
+                dirent_t dir;
+                block_read_part(current_block, j * sizeof(dirent_t), sizeof(dirent_t), &dir);
+                if (dir.name[0] != '\0') {
                     // Construct full path for child
                     strcpy(child_path, path);
                     strconcat(child_path, "/");
-                    strconcat(child_path, dir[j].name);
+                    strconcat(child_path, dir.name);
                     // Recursive call
-                    int result = fs_recursive_rmdir(child_path);
+                    int result = do_recursive_rmdir(child_path);
                     if (result != FSE_OK) {
                         return result;
                     }
+                    txn_step();
                 }
             }
         }
@@ -1029,7 +3380,16 @@ int fs_recursive_rmdir(char *path) {
     return fs_rmdir(path);
 }
 
-int fs_link(char *source, char *destination) {
+int fs_recursive_rmdir(char *path) {
+    txn_begin();
+    nest_acquire(&ns_lock);
+    int rc = do_recursive_rmdir(path);
+    nest_release(&ns_lock);
+    txn_end();
+    return rc;
+}
+
+static int do_link(char *source, char *destination) {
     // Get inode of source
     inode_t src_inode_num = name2inode(source);
 	char child_path[MAX_PATH_LEN];
@@ -1064,18 +3424,18 @@ int fs_link(char *source, char *destination) {
 	}
 
     // Update parent directory inodes
-    src_inode.nlinks++;
-    write_inode2table(src_inode_num, src_inode);
+    inode_add_links(src_inode_num, 1);
     int ev = create_directory_entry(parent_inode_num, destination, src_inode_num);
 	if (ev < 0) {
 		return ev;
 	}
 
+    fs_op_done();
     return FSE_OK;
 }
 
 
-int fs_unlink(char *source) {
+static int do_unlink(char *source) {
     // Get inode of source
     inode_t src_inode_num = name2inode(source);
 
@@ -1111,8 +3471,7 @@ int fs_unlink(char *source) {
     // Then handle source
     // Check if source is a link
     if (src_inode.nlinks > 1) {
-        src_inode.nlinks--;
-        write_inode2table(src_inode_num, src_inode);
+        inode_add_links(src_inode_num, -1);
     }
     else{
         // Use remove_inode to handle the cleaning up and removal of the inode
@@ -1121,11 +3480,168 @@ int fs_unlink(char *source) {
             return ev;
         }
     }
+    fs_op_done();
     return FSE_OK;
 }
 
+/*
+ * Clones. A clone starts out with the data blocks of its source, each
+ * gaining a reference, so making one moves no file data: only the
+ * inode, the pointer blocks, of which every file has its own, and the
+ * reference counts are written. A later write to either file unshares
+ * the blocks it touches (inode_unshare()).
+ */
 
-int fs_stat(int fd, char *buffer) {
+/*
+ * Take another reference to a data block for a clone. Cloning a large
+ * file commits as it goes: until the inode of the clone is written the
+ * references taken only keep blocks from being freed.
+ */
+static int block_share(blknum_t block) {
+    nest_acquire(&fs_lock);
+    int refs = block_refs(block);
+    int rc = (refs < REFS_MAX) ? block_set_refs(block, refs + 1) : FSE_ERROR;
+    nest_release(&fs_lock);
+    txn_step();
+    return rc;
+}
+
+/*
+ * clone_indirect:
+ * Copy indirect block ind, depth levels above the data blocks, to a
+ * new block in group stored in copy, sharing the data blocks. On
+ * failure the pointers not shared are left at 0 in the copy, so it
+ * can be freed like any other.
+ */
+static int clone_indirect(blknum_t ind, int depth, int group, blknum_t *copy) {
+    blknum_t ptrs[PTRS_PER_SCAN];
+    int rc = FSE_OK;
+
+    *copy = alloc_data_block(group, TRUE);
+    if (*copy == 0) {
+        return FSE_BITMAP;
+    }
+    for (int base = 0; base < PTRS_PER_BLK && rc == FSE_OK; base += PTRS_PER_SCAN) {
+        block_read_part(ind, base * sizeof(blknum_t), sizeof(ptrs), ptrs);
+        for (int i = 0; i < PTRS_PER_SCAN; i++) {
+            if (ptrs[i] == 0) {
+                continue;
+            }
+            if (rc != FSE_OK) {
+                ptrs[i] = 0;
+            }
+            else if (depth > 1) {
+                rc = clone_indirect(ptrs[i], depth - 1, group, &ptrs[i]);
+            }
+            else if ((rc = block_share(ptrs[i])) != FSE_OK) {
+                ptrs[i] = 0;
+            }
+        }
+        block_modify(*copy, base * sizeof(blknum_t), sizeof(ptrs), ptrs);
+    }
+    return rc;
+}
+
+/*
+ * clone_blocks:
+ * Turn a copy of the inode of a file into the inode of its clone, by
+ * sharing the data blocks and copying the pointer blocks to group. On
+ * failure the inode is left with only what the clone got, for the
+ * caller to free.
+ */
+static int clone_blocks(disk_inode_t *inode, int group) {
+    int rc = FSE_OK;
+
+    if (inode->flags & INFLAG_INLINE) {
+        return FSE_OK;
+    }
+    if (inode->flags & INFLAG_EXTENTS) {
+        for (int i = 0; i < INODE_NEXTENT; i++) {
+            struct extent *ext = &inode->extents[i];
+            int shared = 0;
+            while (rc == FSE_OK && ext->start != 0 && shared < ext->length) {
+                if ((rc = block_share(ext->start + shared)) == FSE_OK) {
+                    shared++;
+                }
+            }
+            if (rc != FSE_OK) {
+                ext->length = shared;
+            }
+        }
+        return rc;
+    }
+    for (int i = 0; i < INODE_NDIRECT; i++) {
+        if (inode->direct[i] != 0 && (rc != FSE_OK || (rc = block_share(inode->direct[i])) != FSE_OK)) {
+            inode->direct[i] = 0;
+        }
+    }
+    for (int depth = 1; depth <= 2; depth++) {
+        blknum_t *ind = (depth == 1) ? &inode->indirect : &inode->dindirect;
+        if (*ind != 0 && rc != FSE_OK) {
+            *ind = 0;
+        }
+        else if (*ind != 0) {
+            rc = clone_indirect(*ind, depth, group, ind);
+        }
+    }
+    return rc;
+}
+
+static int do_clone(char *source, char *destination) {
+    // Get inode of source
+    inode_t src_inode_num = name2inode(source);
+    int rc = FSE_OK;
+
+    // Check if source exists
+    if (src_inode_num < 0) {
+        return FSE_NOTEXIST;
+    }
+    // Check if source is a directory
+    disk_inode_t inode = read_inode_table(src_inode_num);
+    if (inode.type == INTYPE_DIR) {
+        return FSE_FILEISDIR;
+    }
+
+    // The clone is a new file in the current directory, like a link
+    char dirname_copy[MAX_PATH_LEN];
+    bcopy(destination, dirname_copy, MAX_PATH_LEN);
+    char *argv[MAX_PATH_LEN];
+    char buf[MAX_FILENAME_LEN * 2];
+    if (parse_path(dirname_copy, argv, buf) > 1) {
+        return FSE_ERROR;
+    }
+    inode_t dst_inode_num = do_mkfile(destination);
+    if (dst_inode_num < 0) {
+        return dst_inode_num;
+    }
+
+    // The source is locked while its blocks are shared, its held blocks are placed first
+    mem_inode_t *entry = iget_ref(src_inode_num, &inode, inode_disk_read);
+    if (entry != NULL) {
+        inode_lock(entry);
+        rc = delay_flush(entry);
+        inode = entry->d_inode;
+    }
+    if (rc == FSE_OK) {
+        rc = clone_blocks(&inode, INODE_GROUP(dst_inode_num));
+    }
+    if (entry != NULL) {
+        inode_unlock(entry);
+        iput_ref(entry);
+    }
+
+    // The clone has links of its own, a failed one is removed with what it got
+    inode.nlinks = read_inode_table(dst_inode_num).nlinks;
+    write_inode2table(dst_inode_num, inode);
+    if (rc != FSE_OK) {
+        remove_directory_entry(current_running->cwd, destination);
+        remove_inode(dst_inode_num);
+    }
+    fs_op_done();
+    return rc;
+}
+
+static int do_stat(int fd, char *buffer) {
     // Get inode from global inode table
     mem_inode_t* active_inode = &global_inode_table[current_running->filedes[fd].idx];
     // Check if file descriptor is open
@@ -1133,10 +3649,244 @@ int fs_stat(int fd, char *buffer) {
         return FSE_ERROR;
     }
 
-    // Fill in buffer with inode information
-    buffer[0] = active_inode->d_inode.type;
-    buffer[1] = active_inode->d_inode.nlinks;
-    bcopy((char*)&active_inode->d_inode.current_size, (char*)(buffer + 2), sizeof(int));
+    // Fill in buffer with inode information, copied out with the inode unlocked
+    char stat[2 + sizeof(int)];
+    inode_lock_shared(active_inode);
+    stat[0] = active_inode->d_inode.type;
+    stat[1] = active_inode->d_inode.nlinks;
+    bcopy((char*)&active_inode->d_inode.current_size, &stat[2], sizeof(int));
+    inode_unlock_shared(active_inode);
+    bcopy(stat, buffer, sizeof(stat));
+    return FSE_OK;
+}
+
+/*
+ * Accounted entry points. Each exported call is bracketed by
+ * iostat_begin() and iostat_end(), which charge the block I/O done in
+ * between to one of the FS_OP_* operations.
+ */
+static void iostat_begin(struct iostat_mark *m) {
+    if (current_running->fs_depth++ == 0) {
+        bcache_stats(&m->io);
+        m->start = get_timer();
+    }
+}
+
+// Charge the call to op, bytes being what it moved for the caller. Returns rc
+static int iostat_end(struct iostat_mark *m, int op, int rc, int bytes) {
+    struct fs_iostat *st = &iostat[op];
+    bcache_stats_t io;
+
+    if (--current_running->fs_depth > 0) {
+        return rc;
+    }
+    bcache_stats(&io);
+    unsigned long long cycles = get_timer() - m->start;
+    nest_acquire(&fs_lock);
+    st->calls++;
+    st->reads += io.reads - m->io.reads;
+    st->writes += io.writes - m->io.writes;
+    st->modifies += io.modifies - m->io.modifies;
+    st->dev_reads += io.dev_reads - m->io.dev_reads;
+    st->dev_writes += io.dev_writes - m->io.dev_writes;
+    if (bytes > 0) {
+        st->bytes += bytes;
+    }
+    st->cycles += cycles;
+    nest_release(&fs_lock);
+    return rc;
+}
+
+int fs_open(const char *filename, int mode) {
+    struct iostat_mark m;
+
+    iostat_begin(&m);
+    txn_begin();
+    nest_acquire(&ns_lock);
+    int rc = do_open(filename, mode);
+    nest_release(&ns_lock);
+    txn_end();
+    return iostat_end(&m, FS_OP_OPEN, rc, 0);
+}
+
+int fs_close(int fd) {
+    struct iostat_mark m;
+
+    iostat_begin(&m);
+    txn_begin();
+    int rc = do_close(fd);
+    if (txn_end() != FSE_OK && rc == FSE_OK) {
+        rc = FSE_ERROR;
+    }
+    return iostat_end(&m, FS_OP_CLOSE, rc, 0);
+}
+
+int fs_read(int fd, char *buffer, int size) {
+    struct iostat_mark m;
+    int rc;
+
+    iostat_begin(&m);
+    rc = do_read(fd, buffer, size);
+    return iostat_end(&m, FS_OP_READ, rc, rc);
+}
+
+int fs_write(int fd, char *buffer, int size) {
+    struct iostat_mark m;
+    int rc;
+
+    iostat_begin(&m);
+    rc = do_write(fd, buffer, size);
+    return iostat_end(&m, FS_OP_WRITE, rc, rc);
+}
+
+int fs_readv(int fd, struct iovec *iov, int iovcnt) {
+    struct iostat_mark m;
+    int rc;
+
+    iostat_begin(&m);
+    rc = do_readv(fd, iov, iovcnt);
+    return iostat_end(&m, FS_OP_READ, rc, rc);
+}
+
+int fs_writev(int fd, struct iovec *iov, int iovcnt) {
+    struct iostat_mark m;
+    int rc;
+
+    iostat_begin(&m);
+    rc = do_writev(fd, iov, iovcnt);
+    return iostat_end(&m, FS_OP_WRITE, rc, rc);
+}
+
+int fs_map_read(int idx, int offset, char *page, int size) {
+    struct iostat_mark m;
+    int rc;
+
+    iostat_begin(&m);
+    rc = do_map_read(idx, offset, page, size);
+    return iostat_end(&m, FS_OP_PAGE, rc, rc);
+}
+
+int fs_map_write(int idx, int offset, char *page, int size) {
+    struct iostat_mark m;
+    int rc;
+
+    iostat_begin(&m);
+    rc = do_map_write(idx, offset, page, size);
+    return iostat_end(&m, FS_OP_PAGE, rc, rc);
+}
+
+int fs_lseek(int fd, int offset, int whence) {
+    struct iostat_mark m;
+
+    iostat_begin(&m);
+    return iostat_end(&m, FS_OP_LSEEK, do_lseek(fd, offset, whence), 0);
+}
+
+int fs_stat(int fd, char *buffer) {
+    struct iostat_mark m;
+
+    iostat_begin(&m);
+    return iostat_end(&m, FS_OP_STAT, do_stat(fd, buffer), 0);
+}
+
+int fs_link(char *source, char *destination) {
+    struct iostat_mark m;
+
+    iostat_begin(&m);
+    txn_begin();
+    nest_acquire(&ns_lock);
+    int rc = do_link(source, destination);
+    nest_release(&ns_lock);
+    txn_end();
+    return iostat_end(&m, FS_OP_LINK, rc, 0);
+}
+
+int fs_unlink(char *source) {
+    struct iostat_mark m;
+
+    iostat_begin(&m);
+    txn_begin();
+    nest_acquire(&ns_lock);
+    int rc = do_unlink(source);
+    nest_release(&ns_lock);
+    txn_end();
+    return iostat_end(&m, FS_OP_UNLINK, rc, 0);
+}
+
+int fs_clone(char *source, char *destination) {
+    struct iostat_mark m;
+
+    iostat_begin(&m);
+    txn_begin();
+    nest_acquire(&ns_lock);
+    int rc = do_clone(source, destination);
+    nest_release(&ns_lock);
+    txn_end();
+    return iostat_end(&m, FS_OP_CLONE, rc, 0);
+}
+
+int fs_mkdir(char *dirname) {
+    struct iostat_mark m;
+
+    iostat_begin(&m);
+    txn_begin();
+    nest_acquire(&ns_lock);
+    int rc = do_mkdir(dirname);
+    nest_release(&ns_lock);
+    txn_end();
+    return iostat_end(&m, FS_OP_MKDIR, rc, 0);
+}
+
+int fs_chdir(char *path) {
+    struct iostat_mark m;
+
+    iostat_begin(&m);
+    nest_acquire(&ns_lock);
+    int rc = do_chdir(path);
+    nest_release(&ns_lock);
+    return iostat_end(&m, FS_OP_CHDIR, rc, 0);
+}
+
+int fs_rmdir(char *path) {
+    struct iostat_mark m;
+
+    iostat_begin(&m);
+    txn_begin();
+    nest_acquire(&ns_lock);
+    int rc = do_rmdir(path);
+    nest_release(&ns_lock);
+    txn_end();
+    return iostat_end(&m, FS_OP_RMDIR, rc, 0);
+}
+
+int fs_sync(void) {
+    struct iostat_mark m;
+
+    iostat_begin(&m);
+    txn_begin();
+    int rc = do_sync();
+    txn_end();
+    return iostat_end(&m, FS_OP_SYNC, rc, 0);
+}
+
+/*
+ * fs_iostat:
+ * Copy the counters of the FS_OP_COUNT operations into stats, and
+ * start counting from zero if reset is set.
+ */
+int fs_iostat(struct fs_iostat *stats, int reset) {
+    struct fs_iostat snap[FS_OP_COUNT];
+
+    // Copied out with fs_lock released, stats may be a user page
+    nest_acquire(&fs_lock);
+    bcopy((char *)iostat, (char *)snap, sizeof(iostat));
+    if (reset) {
+        bzero((char *)iostat, sizeof(iostat));
+    }
+    nest_release(&fs_lock);
+    if (stats != NULL) {
+        bcopy((char *)snap, (char *)stats, sizeof(snap));
+    }
     return FSE_OK;
 }
 
@@ -1144,112 +3894,226 @@ int fs_stat(int fd, char *buffer) {
  * Helper functions for the system calls
  */
 
+/*
+ * bitmap_word_free:
+ * Returns the first free entry (zero bit) in a bitmap word that is
+ * not full. The word holds four bitmap bytes loaded little-endian, so
+ * the lowest set bit of ~word is in the first byte with a free entry,
+ * and the highest set bit of that byte is its first free entry.
+ */
+static int bitmap_word_free(uint32_t word) {
+    uint32_t free = ~word;
+    int byte = __builtin_ctz(free) / 8;
+    uint32_t bits = (free >> (byte * 8)) & 0xff;
+    return byte * 8 + (__builtin_clz(bits) - 24);
+}
+
+/*
+ * group_bitmap_block, group_table_block:
+ * Return the bitmap block and the first inode table block of a block
+ * group. Group 0 has them after the superblock, others at their start.
+ */
+static int group_bitmap_block(int group) {
+    return (group == 0) ? super_block.d_super.bitmap_placement : group * GROUP_BLOCKS;
+}
+
+static int group_table_block(int group) {
+    return (group == 0) ? super_block.d_super.table_placement : group * GROUP_BLOCKS + 1;
+}
+
+// The superblock's count of free entries of the bitmap in group
+static short *group_free(struct bitmap *bitmap, int group) {
+    if (bitmap == &inode_bmap) {
+        return &super_block.d_super.groups[group].free_inodes;
+    }
+    return &super_block.d_super.groups[group].free_blocks;
+}
+
+/*
+ * bitmap_store:
+ * Write the loaded group of the bitmap back to its bitmap block, if
+ * it was changed.
+ */
+static void bitmap_store(struct bitmap *bitmap) {
+    if (bitmap->group != -1 && bitmap->dirty) {
+        block_modify(group_bitmap_block(bitmap->group), bitmap->offset, bitmap->entries / 8, bitmap->map);
+    }
+    bitmap->dirty = 0;
+}
+
+/*
+ * bitmap_load:
+ * Make group the loaded group of the bitmap, writing back the one it
+ * replaces. If fresh is set, as in fs_mkfs(), the group is not read
+ * but starts out with every entry free.
+ */
+static void bitmap_load(struct bitmap *bitmap, int group, int fresh) {
+    if (bitmap->group == group && !fresh) {
+        return;
+    }
+    bitmap_store(bitmap);
+    if (fresh) {
+        bzero((char*)bitmap->map, sizeof(bitmap->map));
+        bitmap->dirty = 1;
+        super_block.dirty = 1;
+    }
+    else {
+        block_read_part(group_bitmap_block(group), bitmap->offset, bitmap->entries / 8, bitmap->map);
+    }
+    bitmap->group = group;
+    bitmap->hint = 0;
+}
+
+// Set entry n of the loaded group, which must be free
+static void bitmap_set(struct bitmap *bitmap, int n) {
+    ((unsigned char*)bitmap->map)[n / 8] |= 0x80 >> (n % 8);
+    (*group_free(bitmap, bitmap->group))--;
+    bitmap->dirty = 1;
+    super_block.dirty = 1;
+}
+
+/*
+ * bitmap_pick:
+ * Load the first group with free entries, starting at group and
+ * wrapping around. Returns the group or -1 if every group is full.
+ */
+static int bitmap_pick(struct bitmap *bitmap, int group) {
+    int ngroups = super_block.d_super.ngroups;
+
+    for (int n = 0; n < ngroups; n++) {
+        int current = (group + n) % ngroups;
+        if (*group_free(bitmap, current) > 0) {
+            bitmap_load(bitmap, current, FALSE);
+            return current;
+        }
+    }
+    return -1;
+}
+
 /*
  * get_free_entry:
  *
- * Search the given bitmap for the first zero bit.  If an entry is
- * found it is set to one and the entry number is returned.  Returns
- * -1 if all entrys in the bitmap are set.
+ * Search the given bitmap for a zero bit, in group or else the first
+ * group after it with a free entry. A group is searched a word at a
+ * time, starting at the word of the previous allocation (next fit).
+ * If an entry is found it is set to one and the entry number is
+ * returned. Returns -1 if all entrys in the bitmap are set.
  */
-static int get_free_entry(unsigned char *bitmap) {
-    int i;
-    /* Seach for a free entry */
-    for (i = 0; i < BITMAP_ENTRIES / 8; i++) {
-        if (bitmap[i] == 0xff) /* All taken */
+static int get_free_entry(struct bitmap *bitmap, int group) {
+    int words = bitmap->entries / BITMAP_WORD_BITS;
+
+    // Blocks held for delayed allocation come first
+    if (bitmap == &dblk_bmap && delay_room() < 1) {
+        return -1;
+    }
+    if ((group = bitmap_pick(bitmap, group)) == -1) {
+        return -1;
+    }
+    for (int n = 0; n < words; n++) {
+        int i = (bitmap->hint + n) % words;
+        if (bitmap->map[i] == 0xffffffff) /* All taken */
             continue;
-        if ((bitmap[i] & 0x80) == 0) { /* msb */
-            bitmap[i] |= 0x80;
-            fs_update_bitmap();
-            return i * 8;
-        }
-        else if ((bitmap[i] & 0x40) == 0) {
-            bitmap[i] |= 0x40;
-            fs_update_bitmap();
-            return i * 8 + 1;
-        }
-        else if ((bitmap[i] & 0x20) == 0) {
-            bitmap[i] |= 0x20;
-            fs_update_bitmap();
-            return i * 8 + 2;
-        }
-        else if ((bitmap[i] & 0x10) == 0) {
-            bitmap[i] |= 0x10;
-            fs_update_bitmap();
-            return i * 8 + 3;
-        }
-        else if ((bitmap[i] & 0x08) == 0) {
-            bitmap[i] |= 0x08;
-            fs_update_bitmap();
-            return i * 8 + 4;
-        }
-        else if ((bitmap[i] & 0x04) == 0) {
-            bitmap[i] |= 0x04;
-            fs_update_bitmap();
-            return i * 8 + 5;
-        }
-        else if ((bitmap[i] & 0x02) == 0) {
-            bitmap[i] |= 0x02;
-            fs_update_bitmap();
-            return i * 8 + 6;
-        }
-        else if ((bitmap[i] & 0x01) == 0) { /* lsb */
-            bitmap[i] |= 0x01;
-            fs_update_bitmap();
-            return i * 8 + 7;
-        }
+        int entry = i * BITMAP_WORD_BITS + bitmap_word_free(bitmap->map[i]);
+        bitmap_set(bitmap, entry);
+        bitmap->hint = i;
+        return group * bitmap->entries + entry;
     }
     return -1;
 }
 
 /*
- * free_bitmap_entry:
+ * get_free_run:
+ *
+ * Search the bitmap for count free entrys in a row, in group or else
+ * the first group after it with a free entry, starting at the word of
+ * the previous allocation. Runs stay within a group. If there is no
+ * such run the longest run found is taken instead. The entrys are
+ * set, the first one is stored in start and the length of the run is
+ * returned (zero if the bitmap is full).
+ */
+static int get_free_run(struct bitmap *bitmap, int group, int count, int *start) {
+    int best = 0, best_start = 0;
+    int run = 0, run_start = 0;
+
+    if (bitmap == &dblk_bmap && count > delay_room()) {
+        count = delay_room();
+    }
+    if (count < 1 || (group = bitmap_pick(bitmap, group)) == -1) {
+        return 0;
+    }
+    int first = bitmap->hint * BITMAP_WORD_BITS;
+    for (int n = 0; n < bitmap->entries && best < count; n++) {
+        int entry = (first + n) % bitmap->entries;
+        // Runs do not wrap around the end of the bitmap
+        if (entry == 0) {
+            run = 0;
+        }
+        // Skip full words
+        if (entry % BITMAP_WORD_BITS == 0 && bitmap->map[entry / BITMAP_WORD_BITS] == 0xffffffff) {
+            run = 0;
+            n += BITMAP_WORD_BITS - 1;
+            continue;
+        }
+        if (((unsigned char*)bitmap->map)[entry / 8] & (0x80 >> (entry % 8))) {
+            run = 0;
+            continue;
+        }
+        if (run++ == 0) {
+            run_start = entry;
+        }
+        if (run > best) {
+            best = run;
+            best_start = run_start;
+        }
+    }
+
+    for (int i = 0; i < best; i++) {
+        bitmap_set(bitmap, best_start + i);
+    }
+    if (best > 0) {
+        bitmap->hint = (best_start + best - 1) / BITMAP_WORD_BITS;
+    }
+    *start = group * bitmap->entries + best_start;
+    return best;
+}
+
+/*
+ * get_bitmap_entry:
  *
+ * Set a given bitmap entry if it is free. Returns -1 if the entry is
+ * already set or not in the bitmap, otherwise zero.
+ */
+static int get_bitmap_entry(int entry, struct bitmap *bitmap) {
+    if (entry < 0 || entry >= super_block.d_super.ngroups * bitmap->entries)
+        return -1;
+    if (bitmap == &dblk_bmap && delay_room() < 1)
+        return -1;
+    bitmap_load(bitmap, entry / bitmap->entries, FALSE);
+    entry %= bitmap->entries;
+    if (((unsigned char*)bitmap->map)[entry / 8] & (0x80 >> (entry % 8)))
+        return -1;
+
+    bitmap_set(bitmap, entry);
+    return 0;
+}
+
+/*
+ * free_bitmap_entry:
  * Free a bitmap entry, if the entry is not found -1 is returned, otherwise zero.
  * Note that this function does not check if the bitmap entry was used (freeing
  * an unused entry has no effect).
  */
-static int free_bitmap_entry(int entry, unsigned char *bitmap) {
-    unsigned char *bme;
-    if (entry >= BITMAP_ENTRIES)
+static int free_bitmap_entry(int entry, struct bitmap *bitmap) {
+    if (entry < 0 || entry >= super_block.d_super.ngroups * bitmap->entries)
         return -1;
-
-    bme = &bitmap[entry / 8];
-
-    switch (entry % 8) {
-    case 0:
-        *bme &= ~0x80;
-        fs_update_bitmap();
-        break;
-    case 1:
-        *bme &= ~0x40;
-        fs_update_bitmap();
-        break;
-    case 2:
-        *bme &= ~0x20;
-        fs_update_bitmap();
-        break;
-    case 3:
-        *bme &= ~0x10;
-        fs_update_bitmap();
-        break;
-    case 4:
-        *bme &= ~0x08;
-        fs_update_bitmap();
-        break;
-    case 5:
-        *bme &= ~0x04;
-        fs_update_bitmap();
-        break;
-    case 6:
-        *bme &= ~0x02;
-        fs_update_bitmap();
-        break;
-    case 7:
-        *bme &= ~0x01;
-        fs_update_bitmap();
-        break;
+    bitmap_load(bitmap, entry / bitmap->entries, FALSE);
+    entry %= bitmap->entries;
+    if (((unsigned char*)bitmap->map)[entry / 8] & (0x80 >> (entry % 8))) {
+        ((unsigned char*)bitmap->map)[entry / 8] &= ~(0x80 >> (entry % 8));
+        (*group_free(bitmap, bitmap->group))++;
+        bitmap->dirty = 1;
+        super_block.dirty = 1;
     }
-
     return 0;
 }
 
@@ -1287,6 +4151,29 @@ static blknum_t idx2blk(int index) {
     return os_size + 2 + index;
 }
 
+/*
+ * dir_lookup:
+ * Returns the inode number of the entry called name in the directory
+ * dir_inode, or FSE_ERROR if there is none. The dentry cache is
+ * checked first, and the result of a directory scan is added to it.
+ */
+static inode_t dir_lookup(inode_t dir_inode, char *name) {
+    struct dcache_entry *entry = dcache_lookup(dir_inode, name);
+    if (entry != NULL) {
+        return entry->inode;
+    }
+
+    // Look the name up in the directory itself
+    disk_inode_t current_inode = read_inode_table(dir_inode);
+    inode_t found_inode = FSE_ERROR;
+    dirent_t dir;
+    if (dir_find(&current_inode, name, &dir) >= 0) {
+        found_inode = dir.inode;
+    }
+    dcache_insert(dir_inode, name, found_inode);
+    return found_inode;
+}
+
 /*
  * name2inode:
  * Parses a file name and returns the corresponding inode number. If
@@ -1303,7 +4190,7 @@ static inode_t name2inode(char *name) {
     // Set found_inode to current directory
     inode_t found_inode = current_running->cwd;
 
-    int found, path_index = 0;
+    int path_index = 0;
 
     // If path starts with /, start at root
     if (name[0] == '/') {
@@ -1313,42 +4200,11 @@ static inode_t name2inode(char *name) {
 
     // Iterate through path
     for (; path_index < path_amount; path_index++) {
-        // Initialize found to 0 at the start of each new path iteration
-        found = 0;
-
-        // Read current directory
-        disk_inode_t current_inode = read_inode_table(found_inode);
-
-        // Iterate through direct blocks
-        for (int i = 0; i < INODE_NDIRECT; i++) {
-            // Only go through if current_block has data
-            if (current_inode.direct[i] != 0) {
-                dirent_t dir[DIRENTS_PER_BLK];
-                block_read_part(current_inode.direct[i], 0, sizeof(dirent_t) * DIRENTS_PER_BLK, &dir);
-                // Iterate through directory entries
-                for (int j = 0; j < DIRENTS_PER_BLK; j++) {
-                    // Check if there is a name (means that there is data in directory entry)
-                    if (dir[j].name[0] != '\0') {
-                        // Check if the name matches the current path index
-                        if (strncmp(argv[path_index], dir[j].name, strlen(argv[path_index])) == 0) {
-                            found_inode = dir[j].inode;
-                            found = 1;
-                            break;
-                        }
-                    }
-                }
-                // Exit the directory entry loop if the inode was found
-                if (found) {
-                    break;
-                }
-            }
-        }
-        // If inode not found, set found_inode to FSE_ERROR
-        if (!found) {
-            found_inode = FSE_ERROR;
-            // Exit the path_index loop since the inode wasn't found
+        found_inode = dir_lookup(found_inode, argv[path_index]);
+        // Exit the path_index loop since the inode wasn't found
+        if (found_inode == FSE_ERROR) {
             break;
         }
     }
     return found_inode;
-}
\ No newline at end of file
+}
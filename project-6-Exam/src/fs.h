@@ -12,10 +12,10 @@
 
 #endif /* LINUX_SIM */
 
-/* Number of file system blocks.
- *
- * If you decide to change this, you must probably change the number
- * of blocks reserved for the filesystem in createimage.c as well.*/
+/*
+ * Smallest file system, the blocks createimage.c reserves or fills.
+ * fs_mkfs() makes it as big as the device allows.
+ */
 #define FS_BLOCKS (512 + 2)
 
 #define MASK(v) (1 << (v))
@@ -66,6 +66,36 @@ typedef struct dirent dirent_t;
 
 #define DIRENTS_PER_BLK (int)(BLOCK_SIZE / sizeof(struct dirent))
 
+/*
+ * On-disk formats shared by fs.c and createimage.c; the macros using
+ * INODE_NDIRECT need inode.h. A directory holds at most
+ * DIR_ENTRIES_MAX entries, and one bigger than a block has a hash
+ * index block of DIRINDEX_SLOTS slots (see fs.c). An index slot keeps
+ * the entry number + 1 in a byte that is not DIRINDEX_DELETED, which
+ * limits big blocks to 254 entries. createimage.c has its own copy of
+ * dirindex_hash().
+ */
+#define PTRS_PER_BLK (int)(BLOCK_SIZE / sizeof(blknum_t))
+#define FILE_BLOCKS_MAX (INODE_NDIRECT + PTRS_PER_BLK + PTRS_PER_BLK * PTRS_PER_BLK)
+#define FILE_SIZE_MAX (FILE_BLOCKS_MAX < 0x7fffffff / BLOCK_SIZE ? BLOCK_SIZE * FILE_BLOCKS_MAX : 0x7fffffff / BLOCK_SIZE * BLOCK_SIZE)
+#define DIR_ENTRIES_MAX (INODE_NDIRECT * DIRENTS_PER_BLK < 254 ? INODE_NDIRECT * DIRENTS_PER_BLK : 254)
+#define DIRINDEX_SLOTS (int)(BLOCK_SIZE / sizeof(uint16_t))
+#define DIRINDEX_EMPTY 0x0000
+#define DIRINDEX_DELETED 0x00ff /* no entry number + 1 is 0xff */
+#define DIRINDEX_SLOT(hash, k) (uint16_t)((((hash) & 0xff) << 8) | ((k) + 1))
+
+/*
+ * One buffer of a vectored read or write (fs_readv, fs_writev). The
+ * buffers are filled or drained in order, as if they were one.
+ */
+struct iovec {
+	char *iov_base; /* Start of the buffer */
+	int iov_len;    /* Size of the buffer in bytes */
+};
+
+/* Largest number of buffers in one fs_readv or fs_writev call */
+#define FS_IOV_MAX 16
+
 #ifndef SEEK_SET
 enum
 {
@@ -75,6 +105,48 @@ enum
 };
 #endif
 
+/*
+ * Block I/O accounting (fs_iostat). Every file system call is charged
+ * to one of these operations, with the block cache calls it made
+ * (see bcache.h), the blocks it moved to or from the device, the bytes
+ * it read or wrote for the caller and the get_timer() cycles it took.
+ * Work done on behalf of a call, like a journal commit, is charged to
+ * that call. FS_OP_PAGE is a page of a mapped file read or written.
+ */
+enum
+{
+	FS_OP_OPEN,
+	FS_OP_CLOSE,
+	FS_OP_READ,
+	FS_OP_WRITE,
+	FS_OP_LSEEK,
+	FS_OP_STAT,
+	FS_OP_LINK,
+	FS_OP_UNLINK,
+	FS_OP_MKDIR,
+	FS_OP_CHDIR,
+	FS_OP_RMDIR,
+	FS_OP_SYNC,
+	FS_OP_PAGE,
+	FS_OP_CLONE,
+	FS_OP_COUNT
+};
+
+/* Names of the operations, for printing */
+#define FS_OP_NAMES {"open", "close", "read", "write", "lseek", "stat", "link", \
+	"unlink", "mkdir", "chdir", "rmdir", "sync", "page", "clone"}
+
+struct fs_iostat {
+	unsigned int calls;
+	unsigned int reads;      /* block_read*() calls */
+	unsigned int writes;     /* block_write*() calls */
+	unsigned int modifies;   /* block_modify*() calls */
+	unsigned int dev_reads;  /* blocks read from the device */
+	unsigned int dev_writes; /* blocks written to the device */
+	unsigned int bytes;      /* bytes read or written by the caller */
+	unsigned long long cycles;
+};
+
 void fs_init(void);
 void fs_mkfs(void);
 int fs_mkfile(char *filename);
@@ -82,10 +154,16 @@ int fs_open(const char *filename, int mode);
 int fs_close(int fd);
 int fs_read(int fd, char *buffer, int size);
 int fs_write(int fd, char *buffer, int size);
+int fs_readv(int fd, struct iovec *iov, int iovcnt);
+int fs_writev(int fd, struct iovec *iov, int iovcnt);
 int fs_lseek(int fd, int offset, int whence);
+int fs_mmap(int fd, int size);
+int fs_munmap(int addr);
 int fs_link(char *linkname, char *filename);
 int fs_unlink(char *linkname);
+int fs_clone(char *source, char *destination);
 int fs_stat(int fd, char *buffer);
+int fs_iostat(struct fs_iostat *stats, int reset);
 
 int fs_mkdir(char *dirname);
 int fs_chdir(char *path);
@@ -94,5 +172,16 @@ int fs_recursive_rmdir(char *path);
 void strconcat(char* destination, const char* source);
 void fs_mount(void);
 void fs_update_bitmap(void);
+int fs_sync(void);
+
+/* Descriptors of another process, used by io_ring.c */
+int fs_fd_borrow(struct fd_entry *owner_fds, int fd);
+void fs_fd_return(int fd);
+
+/* Paging of mapped files, used by memory.c */
+int fs_map_open(int fd);
+void fs_map_close(int idx);
+int fs_map_read(int idx, int offset, char *page, int size);
+int fs_map_write(int idx, int offset, char *page, int size);
 
 #endif
@@ -1,7 +1,7 @@
 #ifndef FSTYPES_H
 #define FSTYPES_H
 
-typedef short blknum_t; /* type for disk block number */
+typedef int blknum_t; /* type for disk block number */
 
 typedef int inode_t; /* type for index node number */
 
@@ -14,7 +14,19 @@ struct fd_entry {
 typedef struct fd_entry fd_entry_t;
 
 
-/* per-process maximum open file count */
-#define MAX_OPEN_FILES (int)10
+/* per-process maximum open file count, one bit each in pcb fd_map */
+#define MAX_OPEN_FILES (int)32
+
+/* A file mapped into a process with fs_mmap() */
+struct mmap_region {
+	int idx;           /* index into the global inode_table */
+	int writable;      /* pages are mapped read/write */
+	unsigned int size; /* mapped bytes, 0 if the region is unused */
+};
+
+typedef struct mmap_region mmap_region_t;
+
+/* per-process maximum mapped file count */
+#define MAX_MMAPS (int)4
 
 #endif /* FSTYPES_H */
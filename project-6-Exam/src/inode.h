@@ -8,26 +8,60 @@
  * consistency-check the filesystem (the number of references made in all
  * directories should equal nlinks). The first NDIRECT blocks of the
  * file are located in the direct blocks. The rest are located in the
- * blocks listed in disk block given in indirect. The member type
+ * blocks listed in disk block given in indirect, and after those in
+ * the blocks listed by the blocks listed in dindirect. If the
+ * INFLAG_EXTENTS flag is set the pointers are replaced by up to
+ * INODE_NEXTENT extents, each naming a run of contiguous blocks, and
+ * the file is the blocks of the extents in order. If INFLAG_INLINE
+ * is set the file has no blocks at all: its data, at most
+ * INODE_INLINE_MAX bytes, is kept in place of the pointers. The member type
  * describes the type of file this is (regular, directory). The size
  * member must be used to determine which direct and indirect entries
- * hold actual file data.
+ * hold actual file data. An inode is 64 bytes, so that a block holds
+ * a whole number of them and GROUP_INODES fill whole blocks.
  */
 
 #include "fstypes.h"
 
-#define INODE_NDIRECT 8 /* number of direct disk blocks in an inode */
+#define INODE_NDIRECT 11 /* number of direct disk blocks in an inode */
 
 #define INTYPE_FILE 1
 #define INTYPE_DIR 2
 
+/* A run of length blocks on disk, starting at block start */
+struct extent {
+	blknum_t start;
+	blknum_t length;
+};
+
+/* number of extents that fit in place of the block pointers */
+#define INODE_NEXTENT (int)((INODE_NDIRECT + 2) * sizeof(blknum_t) / sizeof(struct extent))
+
+/* bytes of file data that fit in place of the block pointers */
+#define INODE_INLINE_MAX (int)((INODE_NDIRECT + 2) * sizeof(blknum_t))
+
+/* flags */
+#define INFLAG_EXTENTS 1  /* blocks are mapped by extents, not pointers */
+#define INFLAG_DIRINDEX 2 /* directory has a hash index in indirect */
+#define INFLAG_INLINE 4   /* file data is kept in the inode, in data */
+
 struct disk_inode {
 	short type;   /* file type */
 	int current_size; /* current file size in bytes */
 	short nlinks; /* number of directory entries referring to this file */
-	/* pointers to the first NDIRECT blocks */
-	blknum_t direct[INODE_NDIRECT];
-	/*      blknum_t indirect; /\* The rest of the blocks *\/ */
+	short flags;  /* INFLAG_XXX bits */
+	union {
+		struct {
+			/* pointers to the first NDIRECT blocks */
+			blknum_t direct[INODE_NDIRECT];
+			blknum_t indirect;  /* block of pointers to the next blocks */
+			blknum_t dindirect; /* block of pointers to blocks of pointers */
+		};
+		/* the file's blocks in order, if INFLAG_EXTENTS is set */
+		struct extent extents[INODE_NEXTENT];
+		/* the file's data, if INFLAG_INLINE is set */
+		char data[INODE_INLINE_MAX];
+	};
 };
 
 typedef struct disk_inode disk_inode_t;
@@ -37,11 +71,21 @@ typedef struct disk_inode disk_inode_t;
 /*
  * Index node as used in memory; contains everything that is stored on
  * disk as well as:
- * open_count: The number of opens done on this file.
+ * open_count: The number of opens done on this file. The inode cache
+ * never reuses the entry of a file that is open.
  * inode_num: its inode_number.
  * dirty: True if the inode needs to be updated on disk.
  * pos: The current read/write position (if we implement fork(), then
  * we can't have this field here anymore).
+ * ra_next, ra_window: The block index a sequential reader will ask for
+ * next, and how many blocks to read ahead when it does.
+ * hash_next: Next entry on the inode cache hash chain.
+ * lru_prev, lru_next: Place in the list of entries that are not open,
+ * most recently used first; the last one is reused first.
+ * map_leaf, map_base: The indirect block used by the last block map
+ * lookup and the first file block it maps (map_leaf is 0 if unset).
+ * delay_first, delay_count: The last file blocks, written but not yet
+ * given disk blocks; their data is held in the block cache (see fs.c).
  */ 
 
 struct mem_inode {
@@ -51,6 +95,15 @@ struct mem_inode {
 	blknum_t pos_block;
 	inode_t inode_num;
 	char dirty;
+	int ra_next;
+	int ra_window;
+	struct mem_inode *hash_next;
+	struct mem_inode *lru_prev;
+	struct mem_inode *lru_next;
+	blknum_t map_leaf;
+	int map_base;
+	int delay_first;
+	int delay_count;
 };
 
 typedef struct mem_inode mem_inode_t;
@@ -0,0 +1,208 @@
+/*
+ * Asynchronous I/O rings.
+ *
+ * A process hands the kernel a struct io_ring in its own memory with
+ * io_ring_setup(). It queues operations by filling in submission
+ * entries and advancing sq_tail, and collects results from the
+ * completion entries between cq_head and cq_tail. Neither takes a
+ * system call: io_ring_enter() only wakes the kernel side up, and
+ * waits for completions if asked to.
+ *
+ * Each ring is served by a kernel thread that runs in the address
+ * space of the process, so it can use the buffers and open files of
+ * the process directly. The thread carries out the operations of its
+ * ring one at a time in submission order, while the process keeps
+ * running; it yields while the USB transfers it starts are polled.
+ */
+
+#include "common.h"
+#include "fs.h"
+#include "fs_error.h"
+#include "io_ring.h"
+#include "kernel.h"
+#include "mbox.h"
+#include "scheduler.h"
+#include "sleep.h"
+#include "thread.h"
+#include "util.h"
+
+static io_ctx_t rings[IO_RING_MAX];
+
+static void io_worker(void);
+
+void io_ring_init(void) {
+	int i;
+
+	for (i = 0; i < IO_RING_MAX; i++) {
+		rings[i].owner = NULL;
+		rings[i].worker = NULL;
+		rings[i].ring = NULL;
+		rings[i].busy = FALSE;
+		lock_init(&rings[i].l);
+		condition_init(&rings[i].submitted);
+		condition_init(&rings[i].completed);
+	}
+}
+
+/* Returns TRUE if the process a ring was set up for is still there */
+static int owner_alive(io_ctx_t *ctx) {
+	return (ctx->owner != NULL) && (ctx->owner->pid == ctx->pid) && (ctx->owner->status != EXITED);
+}
+
+/* Returns the ring of the calling process, or NULL */
+static io_ctx_t *ring_of(pcb_t *p) {
+	int i;
+
+	for (i = 0; i < IO_RING_MAX; i++) {
+		if ((rings[i].owner == p) && owner_alive(&rings[i]))
+			return &rings[i];
+	}
+	return NULL;
+}
+
+int io_ring_setup(struct io_ring *ring) {
+	io_ctx_t *ctx = NULL;
+	int i;
+
+	if (current_running->is_thread || (ring == NULL) || (ring_of(current_running) != NULL))
+		return -1;
+
+	/* Rings of processes that have exited are reused with their thread */
+	for (i = 0; i < IO_RING_MAX; i++) {
+		lock_acquire(&rings[i].l);
+		if (!owner_alive(&rings[i]) && !rings[i].busy) {
+			ctx = &rings[i];
+			break;
+		}
+		lock_release(&rings[i].l);
+	}
+	if (ctx == NULL)
+		return -1;
+
+	ring->sq_head = ring->sq_tail = 0;
+	ring->cq_head = ring->cq_tail = 0;
+	ctx->owner = current_running;
+	ctx->pid = current_running->pid;
+	ctx->ring = ring;
+
+	if (ctx->worker == NULL) {
+		ctx->worker = create_thread(io_worker, current_running);
+	}
+	else {
+		/* The thread is waiting for work, it wakes up in the new address space */
+		ctx->worker->page_directory = current_running->page_directory;
+		ctx->worker->swap_loc = current_running->swap_loc;
+		ctx->worker->swap_size = current_running->swap_size;
+	}
+	lock_release(&ctx->l);
+	return 0;
+}
+
+int io_ring_enter(int min_complete) {
+	io_ctx_t *ctx = ring_of(current_running);
+	struct io_ring *ring;
+	int n;
+
+	if (ctx == NULL)
+		return -1;
+	ring = ctx->ring;
+
+	lock_acquire(&ctx->l);
+	condition_signal(&ctx->submitted);
+
+	/* Never wait for more than has been submitted */
+	if (min_complete > (int)(ring->sq_tail - ring->cq_head))
+		min_complete = ring->sq_tail - ring->cq_head;
+
+	while ((int)(ring->cq_tail - ring->cq_head) < min_complete)
+		condition_wait(&ctx->l, &ctx->completed);
+	n = ring->cq_tail - ring->cq_head;
+	lock_release(&ctx->l);
+
+	return n;
+}
+
+/*
+ * Carry out one operation for the owner of the ring. File operations
+ * use the owner's descriptor, which is borrowed for the duration with
+ * a reference on its file; one the owner has closed fails.
+ */
+static int io_execute(io_ctx_t *ctx, struct io_sqe *sqe) {
+	int fd = sqe->arg;
+	int res;
+
+	switch (sqe->op) {
+	case IO_OP_NOP:
+		return 0;
+	case IO_OP_READ:
+	case IO_OP_WRITE:
+		if ((res = fs_fd_borrow(ctx->owner->filedes, fd)) != FSE_OK)
+			return res;
+		if (sqe->op == IO_OP_READ)
+			res = fs_read(fd, sqe->buf, sqe->size);
+		else
+			res = fs_write(fd, sqe->buf, sqe->size);
+		fs_fd_return(fd);
+		return res;
+	case IO_OP_MBOX_SEND:
+		return mbox_send(sqe->arg, (msg_t *)sqe->buf);
+	case IO_OP_SLEEP:
+		msleep(sqe->arg);
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * The thread serving a ring. It takes submissions while the completion
+ * ring has room for their results; a full completion ring waits until
+ * the process collects some and calls io_ring_enter(). Once the process
+ * has exited its ring, in memory that is gone, is not touched again:
+ * what it left submitted is dropped, and a submission being served
+ * when it exits is not posted.
+ */
+static void io_worker(void) {
+	io_ctx_t *ctx = NULL;
+	struct io_ring *ring;
+	struct io_sqe sqe;
+	struct io_cqe *cqe;
+	int i, res;
+
+	/* The thread can run before io_ring_setup() has recorded it */
+	while (ctx == NULL) {
+		for (i = 0; i < IO_RING_MAX; i++) {
+			if (rings[i].worker == current_running)
+				ctx = &rings[i];
+		}
+		if (ctx == NULL)
+			yield();
+	}
+
+	while (1) {
+		lock_acquire(&ctx->l);
+		ring = ctx->ring;
+		while (!owner_alive(ctx) || (ring->sq_head == ring->sq_tail) ||
+		       (ring->cq_tail - ring->cq_head >= IO_RING_ENTRIES)) {
+			condition_wait(&ctx->l, &ctx->submitted);
+			ring = ctx->ring;
+		}
+		sqe = ring->sq[ring->sq_head % IO_RING_ENTRIES];
+		ring->sq_head++;
+		ctx->busy = TRUE;
+		lock_release(&ctx->l);
+
+		res = owner_alive(ctx) ? io_execute(ctx, &sqe) : -1;
+
+		lock_acquire(&ctx->l);
+		if (owner_alive(ctx)) {
+			cqe = &ring->cq[ring->cq_tail % IO_RING_ENTRIES];
+			cqe->res = res;
+			cqe->user_data = sqe.user_data;
+			ring->cq_tail++;
+		}
+		ctx->busy = FALSE;
+		condition_broadcast(&ctx->completed);
+		lock_release(&ctx->l);
+	}
+}
@@ -0,0 +1,39 @@
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include "thread.h"
+
+enum
+{
+	IO_RING_MAX = 4 /* max number of rings (one per process) */
+};
+
+/* Kernel side of a ring */
+typedef struct {
+	pcb_t *owner;      /* process the ring belongs to */
+	uint32_t pid;      /* pid of the owner, pcbs are reused */
+	pcb_t *worker;     /* thread carrying out the operations */
+	struct io_ring *ring;
+	int busy;          /* the worker is carrying out an operation */
+	lock_t l;          /* the ring works like a monitor */
+	condition_t submitted, completed;
+} io_ctx_t;
+
+/* Initialize the ring system, called by kernel on startup */
+void io_ring_init(void);
+
+/*
+ * Register ring, in the memory of the calling process, as its
+ * asynchronous I/O ring. Returns 0, or -1 if the process already has
+ * a ring or no ring is free.
+ */
+int io_ring_setup(struct io_ring *ring);
+
+/*
+ * Tell the kernel new submissions were queued, and wait until at least
+ * min_complete completions are ready to be collected. Returns the
+ * number of completions ready.
+ */
+int io_ring_enter(int min_complete);
+
+#endif /* !IO_RING_H */
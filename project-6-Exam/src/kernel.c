@@ -1,6 +1,7 @@
 #include "common.h"
 #include "fs.h"
 #include "interrupt.h"
+#include "io_ring.h"
 #include "kernel.h"
 #include "keyboard.h"
 #include "mbox.h"
@@ -22,7 +23,6 @@ static void init_idt(void);
 static void init_gdt(void);
 static void init_tss(void);
 static void init_pcb_table(void);
-static int create_thread(int i);
 static int create_process(uint32_t location, uint32_t size);
 static pcb_t *alloc_pcb();
 static void insert_pcb(pcb_t *p);
@@ -101,13 +101,22 @@ void _start(int load_size) {
 	init_syscall(SYSCALL_FS_CLOSE, (syscall_t)fs_close);
 	init_syscall(SYSCALL_FS_READ, (syscall_t)fs_read);
 	init_syscall(SYSCALL_FS_WRITE, (syscall_t)fs_write);
+	init_syscall(SYSCALL_FS_READV, (syscall_t)fs_readv);
+	init_syscall(SYSCALL_FS_WRITEV, (syscall_t)fs_writev);
 	init_syscall(SYSCALL_FS_LSEEK, (syscall_t)fs_lseek);
+	init_syscall(SYSCALL_FS_MMAP, (syscall_t)fs_mmap);
+	init_syscall(SYSCALL_FS_MUNMAP, (syscall_t)fs_munmap);
 	init_syscall(SYSCALL_FS_LINK, (syscall_t)fs_link);
 	init_syscall(SYSCALL_FS_UNLINK, (syscall_t)fs_unlink);
+	init_syscall(SYSCALL_FS_CLONE, (syscall_t)fs_clone);
 	init_syscall(SYSCALL_FS_STAT, (syscall_t)fs_stat);
 	init_syscall(SYSCALL_FS_MKDIR, (syscall_t)fs_mkdir);
 	init_syscall(SYSCALL_FS_CHDIR, (syscall_t)fs_chdir);
 	init_syscall(SYSCALL_FS_RMDIR, (syscall_t)fs_rmdir);
+	init_syscall(SYSCALL_FS_SYNC, (syscall_t)fs_sync);
+	init_syscall(SYSCALL_FS_IOSTAT, (syscall_t)fs_iostat);
+	init_syscall(SYSCALL_IO_RING_SETUP, (syscall_t)io_ring_setup);
+	init_syscall(SYSCALL_IO_RING_ENTER, (syscall_t)io_ring_enter);
 
 #pragma GCC diagnostic pop
 
@@ -119,6 +128,7 @@ void _start(int load_size) {
 	/* Initialize various "subsystems" */
 	init_memory();
 	mbox_init();
+	io_ring_init();
 	time_init();
 	keyboard_init();
 	scsi_static_init();
@@ -127,7 +137,7 @@ void _start(int load_size) {
 	numthreads = sizeof(start_addr) / sizeof(func_t);
 	/* Create the threads */
 	for (i = 0; i < numthreads; i++) {
-		create_thread(i);
+		create_thread(start_addr[i], NULL);
 	}
 
 	/*
@@ -472,9 +482,11 @@ static void init_pcb_table() {
 
 /*
  * Allocate and set up the pcb for a new thread, allocate resources
- * for it and insert it into the ready queue.
+ * for it and insert it into the ready queue. If as is not NULL the
+ * thread runs in the address space of process as, and can reach its
+ * memory.
  */
-static int create_thread(int i) {
+pcb_t *create_thread(func_t start, pcb_t *as) {
 	/*
 	 * Disable interrupts and return the value of he EFlags register
 	 * prior to disabling the interrupts
@@ -502,6 +514,7 @@ static int create_thread(int i) {
 	p->disable_count = 1;
 	p->preempt_count = 0;
 	p->page_fault_count = 0;
+	p->fs_depth = 0;
 	p->yield_count = 0;
 	/* Enable keyboard, timer, fake_irq7, and PCI interrupts */
 	p->int_controller_mask = 0xf1d8;
@@ -512,7 +525,7 @@ static int create_thread(int i) {
 	 * All threads run in kernel address space, the start address
 	 * is known
 	 */
-	p->start_pc = (uint32_t) start_addr[i];
+	p->start_pc = (uint32_t)start;
 	/* Kernel code segment selector, RPL = 0 (kernel mode) */
 	p->cs = KERNEL_CS;
 	p->ds = KERNEL_DS;
@@ -521,9 +534,15 @@ static int create_thread(int i) {
 	p->swap_size = 0;
 	/* Sets p->page_directory = &(created page directory) */
 	setup_page_table(p);
+	if (as != NULL) {
+		/* Faults on the process image are served from its swap area */
+		p->page_directory = as->page_directory;
+		p->swap_loc = as->swap_loc;
+		p->swap_size = as->swap_size;
+	}
 	insert_pcb(p);
 
-	return 0;
+	return p;
 }
 
 /*
@@ -556,6 +575,7 @@ static int create_process(uint32_t location, uint32_t size) {
 	p->disable_count = 1;
 	p->preempt_count = 0;
 	p->page_fault_count = 0;
+	p->fs_depth = 0;
 	p->yield_count = 0;
 	/* Enable keyboard, timer, fake_irq7, and PCI interrupts */
 	p->int_controller_mask = 0xf1d8;
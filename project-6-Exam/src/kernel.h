@@ -51,9 +51,12 @@ enum
 	/* Number of pcbs the OS supports */
 	PCB_TABLE_SIZE = 128,
 
-	/* kernel stack allocator constants */
-	STACK_MIN = 0x40000,
-	STACK_MAX = 0x80000,
+	/*
+	 * kernel stack allocator constants. The kernel, bss included, has
+	 * to end below STACK_MIN; the stacks end below the EBDA.
+	 */
+	STACK_MIN = 0x50000,
+	STACK_MAX = 0x90000,
 	STACK_OFFSET = 0x1FFC,
 	STACK_SIZE = 0x2000,
 
@@ -124,9 +127,14 @@ struct pcb {
 	/* filesystem stuff */
 	inode_t cwd;
 	struct fd_entry filedes[MAX_OPEN_FILES];
+	uint32_t fd_map; /* bit n is set if filedes[n] is in use */
+	int fs_depth;    /* file system calls in progress, see fs_iostat() */
 
 	struct pcb *next;     /* Used when job is in the ready queue */
 	struct pcb *previous; /* Used when job is in the ready queue */
+
+	/* files mapped into the address space (see fs_mmap()) */
+	struct mmap_region mmaps[MAX_MMAPS];
 };
 
 #else  /* LINUX_SIM */
@@ -137,6 +145,8 @@ struct pcb {
 struct pcb {
 	inode_t cwd;
 	struct fd_entry filedes[MAX_OPEN_FILES];
+	uint32_t fd_map;
+	int fs_depth;
 };
 #endif /* !LINUX_SIM */
 
@@ -250,6 +260,8 @@ extern tss_t tss;
  * register.
  */
 void select_page_directory(void);
+/* Create a kernel thread, see kernel.c */
+pcb_t *create_thread(func_t start, pcb_t *as);
 /* Print some debug info */
 void print_status(int time);
 /* Reset timer 0 to the frequency specified by PREEMPT_TICKS */
@@ -13,6 +13,8 @@
  */
 
 #include "common.h"
+#include "fs.h"
+#include "fs_error.h"
 #include "interrupt.h"
 #include "kernel.h"
 #include "memory.h"
@@ -47,6 +49,21 @@ static void page_swap_out(int pageno);
 /* return the disk_sector of the given page */
 static uint32_t page_disk_sector(page_map_entry_t *page);
 
+/* read the i-th page in from its mapped file */
+static void page_map_in(int pageno);
+
+/* return a page released by fs_munmap() to the free pages */
+static void page_free(int pageno);
+
+/* return the page table entry of vaddr, or NULL if it has no page table */
+static uint32_t *page_table_entry(uint32_t *pdir, uint32_t vaddr);
+
+/* return the mapped file region holding vaddr, or NULL */
+static mmap_region_t *mmap_lookup(pcb_t *p, uint32_t vaddr);
+
+/* return the offset into its mapped file of the page at vaddr */
+static uint32_t mmap_offset(uint32_t vaddr);
+
 /* Static global variables */
 /* the page map */
 static page_map_entry_t page_map[PAGEABLE_PAGES];
@@ -136,7 +153,7 @@ inline void dir_ins_table(uint32_t *directory, uint32_t vaddr, void *table, uint
  * for the kernel!
  *
  * This consists of setting up N_KERNEL_PTS (one in this case) which
- * identity maps memory between 0x0 and MAX_PHYSICAL_MEMORY.
+ * identity maps memory between 0x0 and KERNEL_MEM_END.
  *
  * The interrupts are off and paging is not enabled when this function
  * is called.
@@ -166,7 +183,7 @@ void init_memory(void) {
 
 		/* fill in the page table */
 		j = 0;
-		while ((pbaddr < MAX_PHYSICAL_MEMORY) && (j < PAGE_N_ENTRIES)) {
+		while ((pbaddr < KERNEL_MEM_END) && (j < PAGE_N_ENTRIES)) {
 			table_map_page(kernel_pts[i], pbaddr, pbaddr, PE_P | PE_RW);
 			pbaddr += PAGE_SIZE;
 			j++;
@@ -235,6 +252,11 @@ void setup_page_table(pcb_t *p) {
 			table_map_page(pte, PROCESS_START + i * PAGE_SIZE, PROCESS_START + i * PAGE_SIZE, PE_RW | PE_US);
 		}
 
+		/* no files are mapped yet */
+		for (i = 0; i < MAX_MMAPS; i++) {
+			p->mmaps[i].size = 0;
+		}
+
 		pte = page_addr(stkt);
 		/* map two stack pages into stack page table */
 		table_map_page(pte, PROCESS_STACK, (uint32_t)page_addr(stkp1), PE_P | PE_RW | PE_US);
@@ -286,6 +308,7 @@ void page_fault_handler(void) {
 	uint32_t *pta;          /* page table address */
 	int pidx;               /* page index in page map */
 	page_map_entry_t *page; /* ptr to page map entry of a page */
+	mmap_region_t *region;  /* mapped file region of the page */
 
 	current_running->page_fault_count++;
 	lock_acquire(&page_map_lock);
@@ -322,6 +345,12 @@ void page_fault_handler(void) {
 		if (pte & PE_P)
 			page_protection_error(pde, pte);
 
+		/* a fault in the mapping area must hit a mapped file */
+		region = mmap_lookup(current_running, current_running->fault_addr);
+		if ((region == NULL) && (current_running->fault_addr >= MMAP_START) &&
+		    (current_running->fault_addr < MMAP_START + MAX_MMAPS * MMAP_REGION_SPAN))
+			page_protection_error(pde, pte);
+
 		pidx = page_alloc(FALSE);
 
 		/* update the mapping for the new page */
@@ -332,8 +361,12 @@ void page_fault_handler(void) {
 		page->vaddr = current_running->fault_addr & PE_BASE_ADDR_MASK;
 		page->entry = &pta[pti];
 		page->pinned = FALSE;
+		page->region = region;
 
-		page_swap_in(pidx);
+		if (region != NULL)
+			page_map_in(pidx);
+		else
+			page_swap_in(pidx);
 	}
 	lock_release(&page_map_lock);
 }
@@ -357,9 +390,16 @@ static int page_alloc(int pinned) {
 		dole_ptr++;
 	}
 	else {
-		/* no free pages left: swap a page out */
-		page = page_replacement_policy();
-		page_swap_out(page);
+		/* reuse a page freed by fs_munmap() if there is one */
+		for (page = 0; page < PAGEABLE_PAGES; page++) {
+			if ((page_map[page].pinned == FALSE) && (page_map[page].entry == NULL))
+				break;
+		}
+		if (page == PAGEABLE_PAGES) {
+			/* no free pages left: swap a page out */
+			page = page_replacement_policy();
+			page_swap_out(page);
+		}
 	}
 	ASSERT((page >= 0) && (page < PAGEABLE_PAGES));
 
@@ -370,6 +410,7 @@ static int page_alloc(int pinned) {
 	page_map[page].vaddr = 0;
 	page_map[page].entry = NULL;
 	page_map[page].pinned = pinned;
+	page_map[page].region = NULL;
 
 	/* Zero out page before returning  */
 	p = page_addr(page);
@@ -492,7 +533,13 @@ static void page_swap_out(int pageno) {
 			nsectors = SECTORS_PER_PAGE;
 		}
 
-		scsi_write(sector, nsectors, (char *)addr);
+		if (page->region != NULL) {
+			/* mapped file pages go back through the file's block map */
+			fs_map_write(page->region->idx, mmap_offset(page->vaddr), (char *)addr, PAGE_SIZE);
+		}
+		else {
+			scsi_write(sector, nsectors, (char *)addr);
+		}
 	}
 	scrprintf(24, 71, "x");
 }
@@ -501,3 +548,194 @@ static void page_swap_out(int pageno) {
 static uint32_t page_disk_sector(page_map_entry_t *page) {
 	return page->swap_loc + ((page->vaddr - PROCESS_START) / PAGE_SIZE) * SECTORS_PER_PAGE;
 }
+
+static uint32_t *page_table_entry(uint32_t *pdir, uint32_t vaddr) {
+	uint32_t pde = pdir[get_directory_index(vaddr)];
+
+	if ((pde & PE_P) == 0)
+		return NULL;
+	return &((uint32_t *)(pde & PE_BASE_ADDR_MASK))[get_table_index(vaddr)];
+}
+
+/*
+ * page_pin_user()
+ *
+ * Pinning keeps the page resident while a device transfers to it.
+ * Only demand paged pages are in the page map with an entry; the
+ * other pages of a process are pinned already.
+ */
+uint32_t page_pin_user(uint32_t vaddr, int dirty) {
+	uint32_t *pte;
+	int i;
+
+	if (vaddr < KERNEL_MEM_END)
+		return vaddr;
+
+	while (1) {
+		/* Touching the page faults it in */
+		(void)*(volatile char *)vaddr;
+
+		lock_acquire(&page_map_lock);
+		pte = page_table_entry(current_running->page_directory, vaddr);
+		if ((pte != NULL) && (*pte & PE_P))
+			break;
+		/* Swapped out again before we got the lock */
+		lock_release(&page_map_lock);
+	}
+
+	for (i = 0; i < PAGEABLE_PAGES; i++) {
+		if (page_map[i].entry == pte)
+			page_map[i].pinned++;
+	}
+	if (dirty)
+		*pte |= PE_D;
+	lock_release(&page_map_lock);
+
+	return (*pte & PE_BASE_ADDR_MASK) | (vaddr & PAGE_MASK);
+}
+
+void page_unpin_user(uint32_t vaddr) {
+	uint32_t *pte;
+	int i;
+
+	if (vaddr < KERNEL_MEM_END)
+		return;
+
+	lock_acquire(&page_map_lock);
+	pte = page_table_entry(current_running->page_directory, vaddr);
+	for (i = 0; i < PAGEABLE_PAGES; i++) {
+		if ((pte != NULL) && (page_map[i].entry == pte) && (page_map[i].pinned > 0))
+			page_map[i].pinned--;
+	}
+	lock_release(&page_map_lock);
+}
+
+/*
+ * page_user_phys()
+ *
+ * A pinned page is never swapped out, so its page table entry can be
+ * read without page_map_lock. The file system pins user buffers
+ * before it takes its locks, and the block layer, which runs with
+ * them held, translates through here: the page fault handler may be
+ * waiting for those locks with page_map_lock held.
+ */
+uint32_t page_user_phys(uint32_t vaddr, int dirty) {
+	uint32_t *pte;
+
+	if (vaddr < KERNEL_MEM_END)
+		return vaddr;
+
+	pte = page_table_entry(current_running->page_directory, vaddr);
+	ASSERT2((pte != NULL) && (*pte & PE_P), "user page not pinned");
+	if (dirty)
+		*pte |= PE_D;
+	return (*pte & PE_BASE_ADDR_MASK) | (vaddr & PAGE_MASK);
+}
+
+/* Read a page of a mapped file in, past the end of the file it is zero */
+static void page_map_in(int pageno) {
+	page_map_entry_t *page = &page_map[pageno];
+	uint32_t addr = (uint32_t)page_addr(pageno);
+	uint32_t mode = PE_P | PE_US | PE_A;
+
+	scrprintf(23, 50, "pid %-3d mping page %-3d", current_running->pid, pageno);
+
+	fs_map_read(page->region->idx, mmap_offset(page->vaddr), (char *)addr, PAGE_SIZE);
+	if (page->region->writable)
+		mode |= PE_RW;
+	*page->entry = mode | addr;
+}
+
+/* Mark a page as free, page_alloc() hands it out before swapping */
+static void page_free(int pageno) {
+	page_map[pageno].owner = NULL;
+	page_map[pageno].vaddr = 0;
+	page_map[pageno].entry = NULL;
+	page_map[pageno].pinned = FALSE;
+	page_map[pageno].region = NULL;
+}
+
+static mmap_region_t *mmap_lookup(pcb_t *p, uint32_t vaddr) {
+	mmap_region_t *region;
+
+	if ((vaddr < MMAP_START) || (vaddr >= MMAP_START + MAX_MMAPS * MMAP_REGION_SPAN))
+		return NULL;
+
+	region = &p->mmaps[(vaddr - MMAP_START) / MMAP_REGION_SPAN];
+	if (mmap_offset(vaddr) >= region->size)
+		return NULL;
+	return region;
+}
+
+static uint32_t mmap_offset(uint32_t vaddr) {
+	return ((vaddr & PE_BASE_ADDR_MASK) - MMAP_START) % MMAP_REGION_SPAN;
+}
+
+/*
+ * fs_mmap()
+ *
+ * Set up region i of the calling process for the file. No page is
+ * touched here: the page fault handler reads each page in from the
+ * file the first time it is used.
+ */
+int fs_mmap(int fd, int size) {
+	mmap_region_t *region;
+	int i, idx;
+
+	if (current_running->is_thread || (size <= 0) || (size > MMAP_REGION_SPAN))
+		return FSE_ERROR;
+
+	for (i = 0; i < MAX_MMAPS; i++) {
+		if (current_running->mmaps[i].size == 0)
+			break;
+	}
+	if (i == MAX_MMAPS)
+		return FSE_ERROR;
+
+	idx = fs_map_open(fd);
+	if (idx < 0)
+		return idx;
+
+	region = &current_running->mmaps[i];
+	region->idx = idx;
+	region->writable = (current_running->filedes[fd].mode & (MODE_WRONLY | MODE_RDWR)) != 0;
+	region->size = size;
+
+	return MMAP_START + i * MMAP_REGION_SPAN;
+}
+
+/*
+ * fs_munmap()
+ *
+ * Write the dirty resident pages of the region back through the
+ * file's block map and release them. Pages that were swapped out have
+ * been written back already.
+ */
+int fs_munmap(int addr) {
+	mmap_region_t *region;
+	page_map_entry_t *page;
+	int i;
+
+	region = mmap_lookup(current_running, addr);
+	if ((region == NULL) || (mmap_offset(addr) != 0))
+		return FSE_ERROR;
+
+	lock_acquire(&page_map_lock);
+	for (i = 0; i < PAGEABLE_PAGES; i++) {
+		page = &page_map[i];
+		if (page->region != region)
+			continue;
+
+		if ((*page->entry & (PE_P | PE_D)) == (PE_P | PE_D))
+			fs_map_write(region->idx, mmap_offset(page->vaddr), (char *)page_addr(i), PAGE_SIZE);
+
+		*page->entry = 0;
+		invalidate_page((uint32_t *)page->vaddr);
+		page_free(i);
+	}
+	lock_release(&page_map_lock);
+
+	fs_map_close(region->idx);
+	region->size = 0;
+	return FSE_OK;
+}
@@ -28,6 +28,15 @@ enum
 	PAGEABLE_PAGES = 33,
 	MAX_PHYSICAL_MEMORY = (MEM_START + PAGEABLE_PAGES * PAGE_SIZE),
 
+	/*
+	 * The block cache buffers live above the pageable pages, so their
+	 * size does not depend on the space left below the thread stacks.
+	 * Memory up to KERNEL_MEM_END is identity mapped in every process.
+	 */
+	BCACHE_MEM_START = MAX_PHYSICAL_MEMORY,
+	BCACHE_MEM_SIZE = 0x40000, /* 256 KB */
+	KERNEL_MEM_END = (BCACHE_MEM_START + BCACHE_MEM_SIZE),
+
 	/* number of kernel page tables */
 	N_KERNEL_PTS = 1,
 
@@ -39,7 +48,16 @@ enum
 	/* used to extract the 10 lsb of a page directory entry */
 	MODE_MASK = 0x000003ff,
 
-	PAGE_TABLE_SIZE = (1024 * 4096 - 1) /* size of a page table in bytes */
+	PAGE_TABLE_SIZE = (1024 * 4096 - 1), /* size of a page table in bytes */
+
+	/*
+	 * Files mapped with fs_mmap() go in the upper half of the process
+	 * page table. Each of the MAX_MMAPS regions of a process has a
+	 * fixed address and can map up to MMAP_REGION_SPAN bytes.
+	 */
+	MMAP_REGION_PAGES = 128,
+	MMAP_REGION_SPAN = (MMAP_REGION_PAGES * PAGE_SIZE),
+	MMAP_START = (PROCESS_START + PTABLE_SPAN / 2)
 };
 
 /* structure of an entry in the page map */
@@ -49,7 +67,8 @@ typedef struct {
 	uint32_t swap_size;
 	uint32_t vaddr;  /* page-aligned virtual address of this page */
 	uint32_t *entry; /* entry that points to this page */
-	bool_t pinned;   /* is this page pinned? */
+	int pinned;      /* pin count, the page is only swapped out at 0 */
+	mmap_region_t *region; /* mapped file region, NULL for image pages */
 } page_map_entry_t;
 
 /* Prototypes */
@@ -68,4 +87,33 @@ void setup_page_table(pcb_t *p);
  */
 void page_fault_handler(void);
 
+/*
+ * Fault in and pin the page holding the user address vaddr, and
+ * return the physical address vaddr maps to, for DMA. If dirty is
+ * set the page is marked dirty. Kernel addresses are returned as they
+ * are. Unpin with page_unpin_user().
+ */
+uint32_t page_pin_user(uint32_t vaddr, int dirty);
+void page_unpin_user(uint32_t vaddr);
+
+/*
+ * Like page_pin_user(), for a page the caller has pinned already. No
+ * lock is taken, so it may be called with file system locks held.
+ */
+uint32_t page_user_phys(uint32_t vaddr, int dirty);
+
+/*
+ * Map size bytes of the file open as fd into the address space of the
+ * calling process. Returns the address of the mapping or an error
+ * code. Pages are read from the file when they are first touched.
+ */
+int fs_mmap(int fd, int size);
+
+/*
+ * Remove the mapping at addr, writing its dirty pages back to the
+ * file. Mappings are not removed when a process exits, so changes
+ * that are not unmapped can be lost.
+ */
+int fs_munmap(int addr);
+
 #endif /* !MEMORY_H */
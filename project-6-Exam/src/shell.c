@@ -34,6 +34,7 @@ static void ls(char *path);
 static void cat(char *filename);
 static void more(char *filename);
 static void stat(char *filename);
+static void iostat(int reset);
 
 /* cursor coordinate */
 int cursor = 0;
@@ -253,6 +254,16 @@ int main(void) {
 				continue;
 			}
 		}
+		else if (same_string("clone", argv[0])) {
+			if (argc == 3) {
+				if ((ev = fs_clone(argv[1], argv[2])) < 0)
+					shprintf(" : error occured.\n");
+			}
+			else {
+				shprintf("usage: %s 'file name' 'clone name'\n", argv[0]);
+				continue;
+			}
+		}
 		else if (same_string("rm", argv[0])) {
 			if (argc == 2) {
 				if ((ev = fs_unlink(argv[1])) < 0) {
@@ -273,6 +284,25 @@ int main(void) {
 				continue;
 			}
 		}
+		else if (same_string("iostat", argv[0])) {
+			if (argc == 1 || (argc == 2 && same_string("reset", argv[1]))) {
+				iostat(argc == 2);
+			}
+			else {
+				shprintf("usage: %s [reset]\n", argv[0]);
+				continue;
+			}
+		}
+		else if (same_string("sync", argv[0])) {
+			if (argc == 1) {
+				if ((ev = fs_sync()) < 0)
+					shprintf(" : error occured.\n");
+			}
+			else {
+				shprintf("usage: %s\n", argv[0]);
+				continue;
+			}
+		}
 		else {
 			shprintf("%s : Command not found.\n", argv[0]);
 		}
@@ -471,7 +501,7 @@ static void cat(char *filename) {
 /* more */
 static void more(char *filename) {
 	int fd, read, ev;
-	char buf[BLOCK_SIZE];
+	char buf[BLOCK_SIZE + 1];
 
 	if ((fd = fs_open(filename, MODE_RDONLY)) < 0) {
 		shprintf("more> Could not open file\n");
@@ -518,6 +548,34 @@ static void stat(char *filename) {
 		shprintf(" : error occured.\n");
 }
 
+/*
+ * Print the block I/O of the file system calls made so far, per
+ * operation: block cache reads, writes and read-modify-writes, blocks
+ * moved to and from the USB stick, bytes moved for the caller and
+ * thousands (1024) of cycles per call. Then start counting from zero
+ * if reset is set.
+ */
+static void iostat(int reset) {
+	static char *names[FS_OP_COUNT] = FS_OP_NAMES;
+	struct fs_iostat st[FS_OP_COUNT];
+	int i;
+
+	if (fs_iostat(st, reset) < 0) {
+		shprintf("iostat : error occured.\n");
+		return;
+	}
+	shprintf("%-6s%5s%5s%5s%4s%5s%5s%7s%6s\n", "op", "calls", "rd", "wr",
+	         "rmw", "dvrd", "dvwr", "bytes", "kcyc");
+	for (i = 0; i < FS_OP_COUNT; i++) {
+		if (st[i].calls == 0)
+			continue;
+		shprintf("%-6s%5d%5d%5d%4d%5d%5d%7d%6d\n", names[i], st[i].calls,
+		         st[i].reads, st[i].writes, st[i].modifies, st[i].dev_reads,
+		         st[i].dev_writes, st[i].bytes,
+		         (unsigned int)(st[i].cycles >> 10) / st[i].calls);
+	}
+}
+
 /* Shell write */
 static int shwrite(void *drop, char c) {
 	int x;
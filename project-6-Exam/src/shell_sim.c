@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "bench.h"
 #include "block.h"
 #include "fs.h"
 #include "kernel.h"
@@ -32,15 +33,28 @@ static void ls(char *path);
 static void cat(char *filename);
 static void more(char *filename);
 static void stat(char *filename);
+static void iostat(int reset);
 
 int os_size = 0;
 
-int main(void) {
+/*
+ * Usage: p6sh [script]
+ * Commands are read from script if it is given, and echoed after the
+ * prompt. Lines starting with # are comments. The shell exits at the
+ * end of its input.
+ */
+int main(int main_argc, char *main_argv[]) {
 	int ev;
 	int argc;                  /* argument count */
 	char *argv[SIZEX];         /* argument vector */
 	char line[SIZEX + 1];      /* unparsed command */
 	char cwd[SIZEX + 1] = "/"; /* current working directory */
+	FILE *in = stdin;          /* where commands come from */
+
+	if (main_argc > 1 && (in = fopen(main_argv[1], "r")) == NULL) {
+		printf("p6sh: could not open %s\n", main_argv[1]);
+		return 1;
+	}
 
 	/* Initalize various subsystems */
 	fs_init();
@@ -48,14 +62,22 @@ int main(void) {
 	while (1) {
 		printf("%s", cwd);
 		printf("$ ");
-		fgets(line, SIZEX, stdin);
+		if (fgets(line, SIZEX, in) == NULL) {
+			printf("\n");
+			fs_sync();
+			block_destruct();
+			return 0;
+		}
 		fflush(stdin);
-		line[strlen(line) - 1] = '\0'; /* Remove \n */
+		if (in != stdin)
+			printf("%s", line);
+		if (strlen(line) > 0 && line[strlen(line) - 1] == '\n')
+			line[strlen(line) - 1] = '\0'; /* Remove \n */
 
 		argc = parse_line(line, argv);
 
-		/* if no arguments goto beginning of loop */
-		if (argc == 0) {
+		/* if no arguments or a comment goto beginning of loop */
+		if (argc == 0 || argv[0][0] == '#') {
 			continue;
 		}
 
@@ -139,6 +161,16 @@ int main(void) {
 				continue;
 			}
 		}
+		else if (same_string("clone", argv[0])) {
+			if (argc == 3) {
+				if ((ev = fs_clone(argv[1], argv[2])) < 0)
+					print_fse(ev);
+			}
+			else {
+				usage(argv[0], " 'file name' 'clone name'");
+				continue;
+			}
+		}
 		else if (same_string("rm", argv[0])) {
 			if (argc == 2) {
 				if ((ev = fs_unlink(argv[1])) < 0)
@@ -158,8 +190,31 @@ int main(void) {
 				continue;
 			}
 		}
+		else if (same_string("bench", argv[0])) {
+			bench(argc, argv);
+		}
+		else if (same_string("iostat", argv[0])) {
+			if (argc == 1 || (argc == 2 && same_string("reset", argv[1]))) {
+				iostat(argc == 2);
+			}
+			else {
+				usage(argv[0], "[reset]");
+				continue;
+			}
+		}
+		else if (same_string("sync", argv[0])) {
+			if (argc == 1) {
+				if ((ev = fs_sync()) < 0)
+					print_fse(ev);
+			}
+			else {
+				usage(argv[0], "");
+				continue;
+			}
+		}
 		else if (same_string("exit", argv[0])) {
 			if (argc == 1) {
+				fs_sync();
 				block_destruct();
 				return 0;
 			}
@@ -344,7 +399,7 @@ static void cat(char *filename) {
 /* more */
 static void more(char *filename) {
 	int fd, read, ev;
-	char buf[BLOCK_SIZE];
+	char buf[BLOCK_SIZE + 1];
 
 	if ((fd = fs_open(filename, MODE_RDONLY)) < 0) {
 		printf("more> Could not open file %s\n", filename);
@@ -391,6 +446,35 @@ static void stat(char *filename) {
 		print_fse(ev);
 }
 
+/*
+ * Print the block I/O of the file system calls made so far, per
+ * operation: block cache reads, writes and read-modify-writes, blocks
+ * moved to and from image_sim, bytes moved for the caller, cycles per
+ * call and how many bytes went to image_sim per byte asked for. Then
+ * start counting from zero if reset is set.
+ */
+static void iostat(int reset) {
+	static char *names[FS_OP_COUNT] = FS_OP_NAMES;
+	struct fs_iostat st[FS_OP_COUNT];
+	int i;
+
+	fs_iostat(st, reset);
+	printf("%-7s %7s %7s %7s %7s %7s %7s %9s %9s %6s\n", "op", "calls", "reads",
+	       "writes", "rmw", "devrd", "devwr", "bytes", "cyc/call", "amp");
+	for (i = 0; i < FS_OP_COUNT; i++) {
+		if (st[i].calls == 0)
+			continue;
+		printf("%-7s %7u %7u %7u %7u %7u %7u %9u %9llu", names[i], st[i].calls,
+		       st[i].reads, st[i].writes, st[i].modifies, st[i].dev_reads,
+		       st[i].dev_writes, st[i].bytes, st[i].cycles / st[i].calls);
+		if (st[i].bytes > 0)
+			printf(" %6.2f\n", (st[i].dev_reads + st[i].dev_writes) *
+			                       (double)BLOCK_SIZE / st[i].bytes);
+		else
+			printf(" %6s\n", "-");
+	}
+}
+
 /* Print file system error value */
 static void print_fse(int ev) {
 	printf("File system error value: %d\n", ev);
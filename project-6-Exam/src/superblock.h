@@ -4,20 +4,47 @@
 /*
  * The superblock describes the filesystem.
  *
- * The filesystem layout looks like this:
+ * The filesystem is split in block groups of GROUP_BLOCKS blocks,
+ * the last one possibly shorter. Every group starts with its own
+ * bitmap block and a slice of the inode table holding GROUP_INODES
+ * inodes; the rest of the group is data blocks. Group 0 also holds
+ * the superblock and the journal, before its bitmap and inode table:
  *
- * +-------------+-----------------------------+-/
- * | Super block |  Inode & data bitmap block  |
- * +-------------+-----------------------------+-/
+ * +-------------+-----------------------------+---------+-/
+ * | Super block |  Inode & data bitmap block  | Journal |
+ * +-------------+-----------------------------+---------+-/
  *
  * <------ Inode area ----> <-------- Data block area -------->
  * /--------+-//-+---------+--------------+-//-+--------------+
  *  Inode 1 |    | Inode n | Data block 1 |    | Data block n |
  * /--------+-//-+---------+--------------+-//-+--------------+
  *
+ * Group g > 0 starts at block g * GROUP_BLOCKS with its bitmap block,
+ * followed by its inodes and data blocks. Inode n is in group
+ * n / GROUP_INODES. A bitmap block holds the data block bitmap of
+ * its group at byte 0 and the inode bitmap at byte BITMAP_BYTES.
+ *
+ * fs_mkfs() makes the file system as big as the device allows, up to
+ * FS_BLOCKS_MAX blocks; nblocks and ngroups record the size. groups
+ * keeps the free blocks and inodes of every group, so allocation can
+ * pick a group without reading its bitmap.
+ *
+ * A data block shared by files made with fs_clone() counts its extra
+ * owners in the reference table of its group, a byte per block of the
+ * group. ref_table is the first block of that run of data blocks, 0
+ * until the group gets its first shared block (see fs.c).
+ *
+ * The journal is where metadata changes are logged before they are
+ * written in place (see bcache.c).
+ *
+ * Every block is block_size bytes, the BLOCK_SIZE the file system was
+ * made with (see block.h); a file system with another block size is
+ * not used.
+ *
  * The member max_filesize is:
- * BLOCK_SIZE * (NDIRECT + (BLOCK_SIZE / sizeof(blknum_t))) = 1056KB
- * at present.
+ * BLOCK_SIZE * (NDIRECT + PTRS + PTRS * PTRS), PTRS being
+ * BLOCK_SIZE / sizeof(blknum_t), which is a little over 8MB with 512
+ * byte blocks. The size of the file system limits files further.
  *
  * The root_inode member gives the block number on disk where the
  * inode for the root directory of this filesystem resides.
@@ -25,15 +52,45 @@
 
 #include "fstypes.h"
 
+#define FS_MAGIC 0x696a
+
+/* Bytes of each of the two bitmaps kept in a bitmap block */
+#define BITMAP_BYTES 256
+
+/* Blocks and inodes of a block group, the entries of its two bitmaps */
+#define GROUP_BLOCKS (BITMAP_BYTES * 8)
+#define GROUP_INODES 256
+
+/* The superblock keeps the free counts of every group, which caps the file system size */
+#define FS_GROUPS_MAX 32
+#define FS_BLOCKS_MAX (FS_GROUPS_MAX * GROUP_BLOCKS)
+
+/*
+ * Metadata journal (see bcache.c), a header block and its log blocks
+ * placed right after the superblock and bitmap. Its place is fixed so
+ * fs_init() can replay it before reading the superblock.
+ */
+#define JOURNAL_START 2
+#define JOURNAL_BLOCKS 17
 
 struct disk_superblock {
 	short magic;
 	short ninodes;       /* number of index nodes in the filesystem */
-	short ndata_blks;    /* number of data blocks */
+	int ndata_blks;      /* number of data blocks */
 	blknum_t root_inode; /* block number of inode for the root dir */
-	short max_filesize;  /* the size of the largest file */
-	int table_placement; /* where the inode table starts */
-	int bitmap_placement; /* where the bitmap starts */
+	int max_filesize;    /* the size of the largest file */
+	int table_placement; /* where the inode table of group 0 starts */
+	int bitmap_placement; /* the bitmap block of group 0 */
+	int journal_placement; /* where the metadata journal starts */
+	short journal_blocks;  /* journal size, header block included */
+	short block_size;      /* bytes per block */
+	int nblocks;           /* blocks in the filesystem */
+	short ngroups;         /* block groups, the last one may be short */
+	struct {
+		short free_blocks;
+		short free_inodes;
+		blknum_t ref_table; /* shared block counts, 0 if none */
+	} groups[FS_GROUPS_MAX];
 };
 
 typedef struct disk_superblock disk_superblock_t;
@@ -42,13 +99,11 @@ typedef struct disk_superblock disk_superblock_t;
 /*
  * The superblock as used in memory. The dirty member is true if
  * filesystem metadata needs to be updated (happens when one of the
- * inode bitmaps is changed).
+ * bitmaps is changed).
  */
 
 struct mem_superblock {
 	struct disk_superblock d_super;
-	int ibmap; /* bitmap for inodes */
-	int dbmap; /* bitmap for data blocks */
 	char dirty;
 };
 
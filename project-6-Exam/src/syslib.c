@@ -102,10 +102,26 @@ int fs_write(int handle, char *buffer, int size) {
 	return invoke_syscall(SYSCALL_FS_WRITE, handle, (int)buffer, size);
 }
 
+int fs_readv(int handle, struct iovec *iov, int iovcnt) {
+	return invoke_syscall(SYSCALL_FS_READV, handle, (int)iov, iovcnt);
+}
+
+int fs_writev(int handle, struct iovec *iov, int iovcnt) {
+	return invoke_syscall(SYSCALL_FS_WRITEV, handle, (int)iov, iovcnt);
+}
+
 int fs_lseek(int handle, int offset, int origin) {
 	return invoke_syscall(SYSCALL_FS_LSEEK, handle, offset, origin);
 }
 
+int fs_mmap(int handle, int size) {
+	return invoke_syscall(SYSCALL_FS_MMAP, handle, size, IGNORE);
+}
+
+int fs_munmap(int addr) {
+	return invoke_syscall(SYSCALL_FS_MUNMAP, addr, IGNORE, IGNORE);
+}
+
 int fs_link(char *linkname, char *filename) {
 	return invoke_syscall(SYSCALL_FS_LINK, (int)linkname, (int)filename, IGNORE);
 }
@@ -114,6 +130,11 @@ int fs_unlink(char *linkname) {
 	return invoke_syscall(SYSCALL_FS_UNLINK, (int)linkname, IGNORE, IGNORE);
 }
 
+/* Make destination a copy of source that shares its blocks, see fs.c */
+int fs_clone(char *source, char *destination) {
+	return invoke_syscall(SYSCALL_FS_CLONE, (int)source, (int)destination, IGNORE);
+}
+
 int fs_stat(int handle, char *buffer) {
 	return invoke_syscall(SYSCALL_FS_STAT, handle, (int)buffer, IGNORE);
 }
@@ -129,3 +150,24 @@ int fs_chdir(char *path) {
 int fs_rmdir(char *path) {
 	return invoke_syscall(SYSCALL_FS_RMDIR, (int)path, IGNORE, IGNORE);
 }
+
+int fs_sync(void) {
+	return invoke_syscall(SYSCALL_FS_SYNC, IGNORE, IGNORE, IGNORE);
+}
+
+/* Block I/O counters of the file system calls, see fs.h */
+int fs_iostat(struct fs_iostat *stats, int reset) {
+	return invoke_syscall(SYSCALL_FS_IOSTAT, (int)stats, reset, IGNORE);
+}
+
+/*
+ * Asynchronous I/O ring, see common.h and io_ring.c.
+ */
+
+int io_ring_setup(struct io_ring *ring) {
+	return invoke_syscall(SYSCALL_IO_RING_SETUP, (int)ring, IGNORE, IGNORE);
+}
+
+int io_ring_enter(int min_complete) {
+	return invoke_syscall(SYSCALL_IO_RING_ENTER, min_complete, IGNORE, IGNORE);
+}
@@ -8,6 +8,9 @@ enum
 	IGNORE = 0
 };
 
+struct iovec;
+struct fs_iostat;
+
 /* Prototypes for exported system calls */
 void yield(void);
 void exit(void);
@@ -28,9 +31,18 @@ int fs_open(const char *filename, int mode);
 int fs_close(int fd);
 int fs_read(int fd, char *buffer, int size);
 int fs_write(int fd, char *buffer, int size);
+int fs_readv(int fd, struct iovec *iov, int iovcnt);
+int fs_writev(int fd, struct iovec *iov, int iovcnt);
 int fs_lseek(int fd, int offset, int whence);
+int fs_mmap(int fd, int size);
+int fs_munmap(int addr);
 int fs_link(char *linkname, char *filename);
 int fs_unlink(char *linkname);
+int fs_clone(char *source, char *destination);
 int fs_stat(int fd, char *buffer);
+int fs_sync(void);
+int fs_iostat(struct fs_iostat *stats, int reset);
+int io_ring_setup(struct io_ring *ring);
+int io_ring_enter(int min_complete);
 
 #endif /* !SYSLIB_H */
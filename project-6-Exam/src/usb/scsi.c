@@ -234,3 +234,13 @@ int scsi_write(int block_start, int block_count, char *data) {
   return scsi_read_write(SCSI_WRITE, block_start, block_count, data);
 }
 
+/*
+ * Number of blocks on the device, 0 if there is none. READ CAPACITY
+ * reports the address of the last block.
+ */
+int scsi_capacity(void) {
+  if (scsi == NULL)
+    return 0;
+  return scsi->total_block_count + 1;
+}
+
@@ -42,6 +42,7 @@ void scsi_static_init(void);
 int scsi_init(struct scsi_ifc *ifc);
 int scsi_read(int block_start, int block_count, char *data);
 int scsi_write(int block_start, int block_count, char *data);
+int scsi_capacity(void);
 void scsi_free();
 int scsi_up();
 
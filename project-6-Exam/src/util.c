@@ -341,27 +341,40 @@ int same_string(char *s1, char *s2) {
  * The arrays can overlap
  */
 void bcopy(const char *source, char *destin, int size) {
-	int i;
+	int i, words, bytes;
 
-	if (size == 0)
+	if (size <= 0)
 		return;
 
-	if (source < destin) {
+	if ((source < destin) && (destin < source + size)) {
+		/* dest overlaps the end of source, copy backwards */
 		for (i = size - 1; i >= 0; i--)
 			destin[i] = source[i];
 	}
 	else {
-		for (i = 0; i < size; i++)
-			destin[i] = source[i];
+		/* copy a word at a time, then the remaining bytes */
+		words = size / 4;
+		bytes = size % 4;
+		asm volatile("cld\n\trep movsl\n\tmovl %3, %%ecx\n\trep movsb"
+		             : "+S"(source), "+D"(destin), "+c"(words)
+		             : "r"(bytes)
+		             : "memory", "cc");
 	}
 }
 
 /* Zero out size bytes starting at area */
 void bzero(char *area, int size) {
-	int i;
+	int words, bytes;
+
+	if (size <= 0)
+		return;
 
-	for (i = 0; i < size; i++)
-		area[i] = 0;
+	words = size / 4;
+	bytes = size % 4;
+	asm volatile("cld\n\trep stosl\n\tmovl %3, %%ecx\n\trep stosb"
+	             : "+D"(area), "+c"(words)
+	             : "a"(0), "r"(bytes)
+	             : "memory", "cc");
 }
 
 /* Read byte from I/O address space */
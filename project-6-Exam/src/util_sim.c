@@ -104,7 +104,10 @@ void delay(int n) {
 
 /* Read the pentium time stamp counter */
 unsigned long long int get_timer(void) {
-	return 0;
+	unsigned int lo, hi;
+
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((unsigned long long int)hi << 32) | lo;
 }
 
 /* Convert an ASCII string (like "234") to an integer */